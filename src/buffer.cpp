@@ -0,0 +1,96 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <utility>
+#include "buffer.h"
+
+
+const size_t k_min_capacity = 64;
+// an empty buffer larger than this is released, e.g., after a large value
+const size_t k_max_idle_capacity = 256 * 1024;
+
+Buffer::~Buffer() {
+    free(buffer_begin);
+}
+
+Buffer::Buffer(Buffer &&other) noexcept {
+    buf_swap(*this, other);
+}
+
+Buffer &Buffer::operator=(Buffer &&other) noexcept {
+    buf_swap(*this, other);
+    buf_free(other);
+    return *this;
+}
+
+// make room for `len` more bytes at the back
+static void buf_reserve(Buffer &buf, size_t len) {
+    size_t size = buf_size(buf);
+    size_t head = (size_t)(buf.data_begin - buf.buffer_begin);
+    size_t cap = buf_capacity(buf);
+    if (head >= size && cap - size >= len) {
+        // compact: the gap at the front is at least the data size,
+        // so the memmove is paid by the consumed bytes.
+        memmove(buf.buffer_begin, buf.data_begin, size);
+    } else {
+        size_t new_cap = cap < k_min_capacity ? k_min_capacity : cap;
+        while (new_cap < size + len) {
+            new_cap *= 2;
+        }
+        uint8_t *mem = (uint8_t *)malloc(new_cap);
+        assert(mem);
+        if (size) {
+            memcpy(mem, buf.data_begin, size);
+        }
+        free(buf.buffer_begin);
+        buf.buffer_begin = mem;
+        buf.buffer_end = mem + new_cap;
+    }
+    buf.data_begin = buf.buffer_begin;
+    buf.data_end = buf.buffer_begin + size;
+}
+
+void buf_append(Buffer &buf, const uint8_t *data, size_t len) {
+    if ((size_t)(buf.buffer_end - buf.data_end) < len) {
+        buf_reserve(buf, len);
+    }
+    if (len) {
+        memcpy(buf.data_end, data, len);
+        buf.data_end += len;
+    }
+}
+
+void buf_consume(Buffer &buf, size_t n) {
+    assert(n <= buf_size(buf));
+    buf.data_begin += n;
+    if (buf.data_begin != buf.data_end) {
+        return;
+    }
+    if (buf_capacity(buf) > k_max_idle_capacity) {
+        buf_free(buf);
+    } else {
+        buf_clear(buf);     // rewind for free
+    }
+}
+
+void buf_truncate(Buffer &buf, size_t n) {
+    assert(n <= buf_size(buf));
+    buf.data_end = buf.data_begin + n;
+}
+
+void buf_clear(Buffer &buf) {
+    buf.data_begin = buf.data_end = buf.buffer_begin;
+}
+
+void buf_free(Buffer &buf) {
+    free(buf.buffer_begin);
+    buf.buffer_begin = buf.buffer_end = NULL;
+    buf.data_begin = buf.data_end = NULL;
+}
+
+void buf_swap(Buffer &a, Buffer &b) {
+    std::swap(a.buffer_begin, b.buffer_begin);
+    std::swap(a.buffer_end, b.buffer_end);
+    std::swap(a.data_begin, b.data_begin);
+    std::swap(a.data_end, b.data_end);
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// A byte buffer with read/write cursors.
+// Consuming from the front only moves `data_begin`; the data is moved back to
+// the front when the back runs out of room, and only if that is cheaper than
+// growing, so both ends are amortized O(1) per byte.
+struct Buffer {
+    uint8_t *buffer_begin = NULL;
+    uint8_t *buffer_end = NULL;
+    uint8_t *data_begin = NULL;
+    uint8_t *data_end = NULL;
+
+    Buffer() {}
+    ~Buffer();
+    Buffer(Buffer &&other) noexcept;
+    Buffer &operator=(Buffer &&other) noexcept;
+    Buffer(const Buffer &) = delete;
+    Buffer &operator=(const Buffer &) = delete;
+};
+
+inline size_t buf_size(const Buffer &buf) {
+    return (size_t)(buf.data_end - buf.data_begin);
+}
+inline uint8_t *buf_data(Buffer &buf) {
+    return buf.data_begin;
+}
+inline size_t buf_capacity(const Buffer &buf) {
+    return (size_t)(buf.buffer_end - buf.buffer_begin);
+}
+
+// append to the back
+void buf_append(Buffer &buf, const uint8_t *data, size_t len);
+// remove from the front
+void buf_consume(Buffer &buf, size_t n);
+// keep the first `n` bytes
+void buf_truncate(Buffer &buf, size_t n);
+// remove everything but keep the memory
+void buf_clear(Buffer &buf);
+// remove everything and release the memory
+void buf_free(Buffer &buf);
+void buf_swap(Buffer &a, Buffer &b);
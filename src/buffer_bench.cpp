@@ -0,0 +1,69 @@
+// Pipelined request consumption: vector erase versus the cursor Buffer.
+// g++ -std=c++11 -O2 buffer_bench.cpp buffer.cpp -o buffer_bench
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <vector>
+#include "buffer.h"
+
+
+static uint64_t get_monotonic_nsec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+const size_t k_read_size = 64 * 1024;   // like `read_once()`
+
+// the old buffer
+typedef std::vector<uint8_t> VecBuffer;
+
+static void vec_append(VecBuffer &buf, const uint8_t *data, size_t len) {
+    buf.insert(buf.end(), data, data + len);
+}
+static void vec_consume(VecBuffer &buf, size_t n) {
+    buf.erase(buf.begin(), buf.begin() + n);
+}
+
+// `depth` requests of `req_size` bytes arrive in `k_read_size` reads,
+// each read is followed by consuming all complete requests.
+template <class B, class Append, class Consume, class Size>
+static double bench(size_t depth, size_t req_size, size_t rounds,
+    Append append, Consume consume, Size size)
+{
+    std::vector<uint8_t> stream(depth * req_size, 'x');
+    B buf;
+    uint64_t start = get_monotonic_nsec();
+    for (size_t r = 0; r < rounds; ++r) {
+        for (size_t pos = 0; pos < stream.size(); pos += k_read_size) {
+            size_t n = std::min(k_read_size, stream.size() - pos);
+            append(buf, &stream[pos], n);
+            while (size(buf) >= req_size) {
+                consume(buf, req_size);
+            }
+        }
+        assert(size(buf) == 0);
+    }
+    return double(get_monotonic_nsec() - start) / (rounds * depth);
+}
+
+int main() {
+    const size_t depths[] = {1, 10, 100, 1000, 10000};
+    const size_t req_sizes[] = {32, 1024};
+    printf("%8s %8s %16s %16s\n", "depth", "req", "vector ns/req", "cursor ns/req");
+    for (size_t req_size : req_sizes) {
+        for (size_t depth : depths) {
+            size_t rounds = std::max<size_t>(1, 2000000 / depth / req_size * 32);
+            double vec = bench<VecBuffer>(depth, req_size, rounds,
+                vec_append, vec_consume,
+                [](VecBuffer &b) { return b.size(); });
+            double cur = bench<Buffer>(depth, req_size, rounds,
+                buf_append, buf_consume,
+                [](Buffer &b) { return buf_size(b); });
+            printf("%8zu %8zu %16.1f %16.1f\n", depth, req_size, vec, cur);
+        }
+    }
+    return 0;
+}
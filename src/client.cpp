@@ -8,10 +8,9 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/ip.h>
-#include <string.h>
+#include <string>
 #include <vector>
-
-const size_t k_max_msg = 32 << 20;
+#include "protocol.h"
 
 static void msg(const char *msg) {
     fprintf(stderr, "%s\n", msg);
@@ -51,10 +50,6 @@ static int32_t write_all(int fd, const char *buf, size_t n) {
     return 0;
 }
 
-static void buf_append(std::vector<uint8_t> &buf, const uint8_t *data, size_t len) {
-    buf.insert(buf.end(), data, data + len);
-}  
-
 static int32_t send_req(int fd, const std::vector<std::string> &cmd) {
     /*
      * Si on veut faire set name Mariam
@@ -67,36 +62,14 @@ static int32_t send_req(int fd, const std::vector<std::string> &cmd) {
      * donc 33o en tout et pour tout
      * 29 3 3 "set" 4 "name" 6 "Mariam"
     */
-    uint32_t len = 4; 
-    for(const std::string &s : cmd) len += 4 + s.size(); 
-    if(len > k_max_msg) return -1;
+    size_t len = req_size(cmd.data(), cmd.size());
+    if (len > 4 + k_max_msg) return -1;
 
-    // char wbuf[4 + k_max_msg];
-    std::vector<char> wbuf;
-    wbuf.resize(4 + len);
-    memcpy(wbuf.data(), &len, 4);
-    uint32_t n = cmd.size();
-    memcpy(wbuf.data() + 4, &n, 4);
-
-    size_t cur = 8;
-    for(const std::string &s : cmd) {
-        uint32_t p = (uint32_t)s.size();
-        memcpy(wbuf.data() + cur, &p, 4);
-        memcpy(wbuf.data() + cur + 4, s.data(), (size_t)p);
-        cur += 4 + (size_t)p;
-    }
-    return write_all(fd, wbuf.data(), 4 + len);
+    std::vector<uint8_t> wbuf(len);
+    req_write(wbuf.data(), cmd.data(), cmd.size());
+    return write_all(fd, (const char *)wbuf.data(), len);
 }
 
-enum {
-    TAG_NIL = 0,    
-    TAG_ERR = 1,    
-    TAG_STR = 2,    
-    TAG_INT = 3,   
-    TAG_DBL = 4,    
-    TAG_ARR = 5,    
-};
-
 static int32_t print_response(const uint8_t* data, size_t size) {
     if (size < 1) {
         msg("bad response");
@@ -39,6 +39,107 @@ $ ./client zquery zset 1 "" 0 10
 (str) n2
 (dbl) 2
 (arr) end
+$ ./client set ttlkey v
+(nil)
+$ ./client pttl ttlkey
+(int) -1
+$ ./client pexpire ttlkey 0
+(int) 1
+$ ./client get ttlkey
+(nil)
+$ ./client pttl ttlkey
+(int) -2
+$ ./client pexpire ttlkey 1x
+(err) 4 expect int
+$ ./client get
+(err) 4 wrong number of arguments
+$ ./client foo
+(err) 1 unknown command.
+$ ./client latency histogram foo
+(err) 4 unknown command
+$ ./client slowlog threshold
+(int) 10000
+$ ./client slowlog foo
+(err) 4 unknown slowlog subcommand
+$ ./client scan 0 count 0
+(err) 4 expect positive int
+$ ./client scan 0 match
+(err) 4 syntax error
+$ ./client scan x
+(err) 4 expect int
+$ ./client zadd zscan 1 m1
+(int) 1
+$ ./client zadd zscan 2 n2
+(int) 1
+$ ./client zscan zscan 0 match [^n]?
+(arr) len=2
+(int) 0
+(arr) len=2
+(str) m1
+(dbl) 1
+(arr) end
+(arr) end
+$ ./client zscan zscan 0 count 0
+(err) 4 expect positive int
+$ ./client zscan nokey 0
+(arr) len=2
+(int) 0
+(arr) len=0
+(arr) end
+(arr) end
+$ ./client mset mk1 1 mk2 2
+(nil)
+$ ./client mset mk1 1 mk2
+(err) 4 wrong number of arguments
+$ ./client mget mk1 nokey mk2
+(arr) len=3
+(str) 1
+(nil)
+(str) 2
+(arr) end
+$ ./client zadd mkz 1 a
+(int) 1
+$ ./client mset mkz 2 mkz 3
+(err) 3 a non-string value exists
+$ ./client mget mk1 mkz
+(arr) len=2
+(str) 1
+(nil)
+(arr) end
+$ ./client mdel mk1 mk2 nokey
+(int) 2
+$ ./client incr ctr
+(int) 1
+$ ./client incrby ctr 10
+(int) 11
+$ ./client decrby ctr 20
+(int) -9
+$ ./client get ctr
+(str) -9
+$ ./client set ctr 007
+(nil)
+$ ./client incr ctr
+(int) 8
+$ ./client decrby ctr -9223372036854775808
+(err) 4 increment would overflow
+$ ./client set ctr abc
+(nil)
+$ ./client incr ctr
+(err) 3 value is not an integer
+$ ./client incrbyfloat fctr 1.5
+(dbl) 1.5
+$ ./client incrbyfloat fctr 1.5
+(dbl) 3
+$ ./client incr fctr
+(int) 4
+$ ./client incrbyfloat fctr 0.1
+(dbl) 4.1
+$ ./client get fctr
+(str) 4.1
+$ ./client incrbyfloat fctr x
+(err) 4 expect float
+$ ./client incr mkz
+(err) 3 not a string value
 '''
 
 import shlex
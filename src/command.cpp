@@ -0,0 +1,51 @@
+#include <assert.h>
+#include <math.h>   // isnan
+#include <charconv>
+#include "command.h"
+
+
+// a leading '+' is accepted like strtoll(); whitespace isn't
+static std::string_view skip_plus(std::string_view sv) {
+    if (sv.size() >= 2 && sv[0] == '+' && sv[1] != '-') {
+        sv.remove_prefix(1);
+    }
+    return sv;
+}
+
+bool str2int(std::string_view sv, int64_t &out) {
+    sv = skip_plus(sv);
+    const char *end = sv.data() + sv.size();
+    std::from_chars_result r = std::from_chars(sv.data(), end, out);
+    return r.ec == std::errc() && r.ptr == end;
+}
+
+bool str2dbl(std::string_view sv, double &out) {
+    sv = skip_plus(sv);
+    const char *end = sv.data() + sv.size();
+    std::from_chars_result r = std::from_chars(sv.data(), end, out);
+    return r.ec == std::errc() && r.ptr == end && !isnan(out);
+}
+
+const char *cmd_decode(Req &req) {
+    const Command *cmd = req.cmd;
+    size_t argc = req.args.size();
+    if (!cmd_arity_ok(cmd, argc)) {
+        return "wrong number of arguments";
+    }
+    for (size_t i = 1; i < argc && cmd->schema[i - 1]; ++i) {
+        assert(i <= k_cmd_max_schema);
+        switch (cmd->schema[i - 1]) {
+        case 'i':
+            if (!str2int(req.args[i], req.num[i].i)) {
+                return "expect int";
+            }
+            break;
+        case 'd':
+            if (!str2dbl(req.args[i], req.num[i].d)) {
+                return "expect float";
+            }
+            break;
+        }
+    }
+    return NULL;
+}
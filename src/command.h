@@ -0,0 +1,136 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string_view>
+#include <vector>
+#include "outbuf.h"
+
+
+// request arguments, pointing into the connection's `incoming` buffer
+typedef std::vector<std::string_view> Args;
+
+// command flags
+enum {
+    CMD_READ    = 1 << 0,   // reads the keyspace
+    CMD_WRITE   = 1 << 1,   // may modify the keyspace
+    CMD_FAST    = 1 << 2,   // O(1) or O(log n)
+    CMD_SLOW    = 1 << 3,   // may be O(n)
+    CMD_ADMIN   = 1 << 4,   // server state, not the keyspace
+    CMD_ALL_SHARDS = 1 << 5,    // runs on every shard, the arrays are merged
+    CMD_CURSOR  = 1 << 6,   // args[1] is a cursor over all shards, see do_scan()
+};
+
+// The argument schema has 1 char per argument after the name:
+//   'k': a key, 's': a string, 'i': an int64, 'd': a double (not NaN).
+// The numbers are decoded before the handler is called; the arguments of
+// a variadic command after the schema are strings.
+const size_t k_cmd_max_schema = 8;
+
+union ArgNum {
+    int64_t i;
+    double d;
+};
+
+struct Command;
+
+// a request decoded by the schema of its command
+struct Req {
+    Args &args;                 // args[0] is the command name
+    const Command *cmd = NULL;
+    ArgNum num[1 + k_cmd_max_schema] = {};  // by argument position
+
+    explicit Req(Args &args) : args(args) {}
+};
+
+typedef void (*CmdFunc)(Req &req, OutBuf &out);
+
+struct Command {
+    std::string_view name;
+    CmdFunc func;
+    int32_t arity;      // including the name; -N means at least N
+    uint32_t flags;     // CMD_*
+    const char *schema;
+    // the keys are args[first_key], args[first_key + key_step], ...
+    // up to args[last_key]; a negative `last_key` counts from the end.
+    int32_t first_key;  // 0 if no keys
+    int32_t last_key;
+    int32_t key_step;
+};
+
+// A perfect hash table of the command names, built at compile time by
+// searching for a seed without collisions, so a lookup is 1 hash and
+// 1 string comparison.
+const uint32_t k_cmd_slots = 128;
+
+struct CmdIndex {
+    uint32_t seed = 0;
+    uint8_t slots[k_cmd_slots] = {};    // the command index + 1, 0 if empty
+};
+
+constexpr uint32_t cmd_hash(std::string_view name, uint32_t seed) {
+    uint32_t h = seed * 0x9E3779B9u;
+    for (size_t i = 0; i < name.size(); ++i) {
+        h = (h ^ (uint8_t)name[i]) * 0x01000193;
+    }
+    return (h ^ (h >> 15)) & (k_cmd_slots - 1);
+}
+
+// fails to compile if the names aren't unique
+template <size_t N>
+constexpr CmdIndex cmd_index_build(const Command (&cmds)[N]) {
+    static_assert(N < 255 && N * 4 <= k_cmd_slots, "too many commands");
+    CmdIndex idx;
+    for (uint32_t seed = 1; ; ++seed) {
+        for (uint8_t &slot : idx.slots) {
+            slot = 0;
+        }
+        size_t i = 0;
+        for (; i < N; ++i) {
+            uint32_t h = cmd_hash(cmds[i].name, seed);
+            if (idx.slots[h]) {
+                break;  // collision
+            }
+            idx.slots[h] = (uint8_t)(i + 1);
+        }
+        if (i == N) {
+            idx.seed = seed;
+            return idx;
+        }
+    }
+}
+
+inline const Command *cmd_lookup(
+    const CmdIndex &idx, const Command *cmds, std::string_view name)
+{
+    uint8_t i = idx.slots[cmd_hash(name, idx.seed)];
+    if (i == 0 || cmds[i - 1].name != name) {
+        return NULL;
+    }
+    return &cmds[i - 1];
+}
+
+// whether the number of arguments (including the name) fits the arity
+inline bool cmd_arity_ok(const Command *cmd, size_t argc) {
+    return cmd->arity >= 0
+        ? argc == (size_t)cmd->arity
+        : argc >= (size_t)-cmd->arity;
+}
+
+// the position of the last key in `args`, or 0 if no keys
+inline size_t cmd_last_key(const Command *cmd, size_t argc) {
+    if (cmd->first_key == 0) {
+        return 0;
+    }
+    return cmd->last_key >= 0
+        ? (size_t)cmd->last_key
+        : argc - (size_t)-cmd->last_key;
+}
+
+// check the arity and decode the numbers by the schema of `req.cmd`.
+// returns NULL or the error message.
+const char *cmd_decode(Req &req);
+
+// the whole string as a number, without copying
+bool str2int(std::string_view sv, int64_t &out);
+bool str2dbl(std::string_view sv, double &out);
@@ -0,0 +1,99 @@
+#include <assert.h>
+#include <string.h>
+#include <string>
+#include "command.cpp"
+
+
+static void test_numbers() {
+    int64_t i = 0;
+    assert(str2int("123", i) && i == 123);
+    assert(str2int("-9223372036854775808", i) && i == INT64_MIN);
+    assert(str2int("+7", i) && i == 7);
+    assert(!str2int("9223372036854775808", i));     // out of range
+    assert(!str2int("", i));
+    assert(!str2int("+", i));
+    assert(!str2int("+-1", i));
+    assert(!str2int(" 1", i));
+    assert(!str2int("1x", i));
+    assert(!str2int("1.5", i));
+    // not NUL-terminated
+    std::string s = "42999";
+    assert(str2int(std::string_view(s.data(), 2), i) && i == 42);
+
+    double d = 0;
+    assert(str2dbl("1.5", d) && d == 1.5);
+    assert(str2dbl("-2e3", d) && d == -2000);
+    assert(str2dbl("+0.25", d) && d == 0.25);
+    assert(str2dbl("inf", d) && isinf(d));
+    assert(!str2dbl("nan", d));
+    assert(!str2dbl("", d));
+    assert(!str2dbl("1.5.", d));
+}
+
+static void do_nothing(Req &, OutBuf &) {}
+
+static constexpr Command k_cmds[] = {
+    {"get", &do_nothing, 2, CMD_READ | CMD_FAST, "k", 1, 1, 1},
+    {"set", &do_nothing, 3, CMD_WRITE | CMD_FAST, "ks", 1, 1, 1},
+    {"zquery", &do_nothing, 6, CMD_READ | CMD_SLOW, "kdsii", 1, 1, 1},
+    {"mset", &do_nothing, -3, CMD_WRITE, "ks", 1, -2, 2},
+    {"keys", &do_nothing, 1, CMD_READ | CMD_SLOW, "", 0, 0, 0},
+    {"ping", &do_nothing, -1, CMD_ADMIN, "", 0, 0, 0},
+};
+static constexpr CmdIndex k_idx = cmd_index_build(k_cmds);
+
+static void test_lookup() {
+    for (const Command &cmd : k_cmds) {
+        assert(cmd_lookup(k_idx, k_cmds, cmd.name) == &cmd);
+    }
+    const char *misses[] = {"", "g", "gett", "GET", "zquer", "xyz", "set "};
+    for (const char *name : misses) {
+        assert(cmd_lookup(k_idx, k_cmds, name) == NULL);
+    }
+    // not NUL-terminated
+    std::string s = "settle";
+    assert(cmd_lookup(k_idx, k_cmds, std::string_view(s.data(), 3)) == &k_cmds[1]);
+}
+
+static const char *decode(const Command *cmd, Args args, Req *out = NULL) {
+    Req req(args);
+    req.cmd = cmd;
+    const char *err = cmd_decode(req);
+    if (out) {
+        memcpy(out->num, req.num, sizeof(req.num));
+    }
+    return err;
+}
+
+static void test_decode() {
+    Args tmp;
+    Req req(tmp);
+    assert(!decode(&k_cmds[2], {"zquery", "z", "1.5", "", "-2", "10"}, &req));
+    assert(req.num[2].d == 1.5 && req.num[4].i == -2 && req.num[5].i == 10);
+    assert(decode(&k_cmds[2], {"zquery", "z", "x", "", "0", "10"}));
+    assert(decode(&k_cmds[2], {"zquery", "z", "1", "", "0", "1e3"}));
+    assert(decode(&k_cmds[2], {"zquery", "z", "1", "", "0"}));  // arity
+    assert(!decode(&k_cmds[0], {"get", "k"}));
+    assert(decode(&k_cmds[0], {"get"}));
+    assert(decode(&k_cmds[0], {"get", "k", "v"}));
+    // variadic
+    assert(decode(&k_cmds[3], {"mset", "k"}));
+    assert(!decode(&k_cmds[3], {"mset", "k", "v"}));
+    assert(!decode(&k_cmds[3], {"mset", "k", "v", "k2", "v2"}));
+    assert(!decode(&k_cmds[5], {"ping"}));
+    assert(!decode(&k_cmds[5], {"ping", "a", "b"}));
+}
+
+static void test_keys() {
+    assert(cmd_last_key(&k_cmds[0], 2) == 1);
+    assert(cmd_last_key(&k_cmds[3], 5) == 3);
+    assert(cmd_last_key(&k_cmds[4], 1) == 0);
+}
+
+int main() {
+    test_numbers();
+    test_lookup();
+    test_decode();
+    test_keys();
+    return 0;
+}
@@ -0,0 +1,499 @@
+// The core data structures: HMap, AVL tree, heap and ZSet, from 1e3 to
+// MAX_N elements (1e7 by default; 1e8 needs ~16GB for the zset).
+// Reports ns/op, cache misses per op from the perf counters if available,
+// and allocated bytes per element.
+// g++ -std=c++17 -O2 ds_bench.cpp hashtable.cpp avl.cpp heap.cpp zset.cpp -o ds_bench
+// ./ds_bench [MAX_N] [hmap|avl|heap|zset]
+#include <assert.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "common.h"
+#include "hashtable.h"
+#include "avl.h"
+#include "heap.h"
+#include "zset.h"
+
+
+static uint64_t get_monotonic_nsec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+// xorshift64*, repeatable
+static uint64_t g_rng = 1;
+
+static uint64_t rand_u64() {
+    g_rng ^= g_rng >> 12;
+    g_rng ^= g_rng << 25;
+    g_rng ^= g_rng >> 27;
+    return g_rng * 0x2545F4914F6CDD1Dull;
+}
+
+// the allocated heap memory, including large blocks from mmap()
+static size_t heap_bytes() {
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+}
+
+// hardware counters of this thread, -1 if unavailable
+const size_t k_ncounters = 3;
+static const char *k_counter_names[k_ncounters] = {"llc_miss", "l1d_miss", "dtlb_miss"};
+static int g_counter_fds[k_ncounters] = {-1, -1, -1};
+
+static void counters_open() {
+    const uint64_t cache_read_miss[] = {
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+    };
+    for (size_t i = 0; i < k_ncounters; ++i) {
+        struct perf_event_attr attr = {};
+        attr.size = sizeof(attr);
+        attr.type = i == 0 ? PERF_TYPE_HARDWARE : PERF_TYPE_HW_CACHE;
+        attr.config = i == 0
+            ? (uint64_t)PERF_COUNT_HW_CACHE_MISSES : cache_read_miss[i - 1];
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        g_counter_fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+}
+
+static void counters_start() {
+    for (int fd : g_counter_fds) {
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+static void counters_stop(double *out, size_t nops) {
+    for (size_t i = 0; i < k_ncounters; ++i) {
+        int fd = g_counter_fds[i];
+        uint64_t val = 0;
+        if (fd < 0) {
+            out[i] = -1;
+            continue;
+        }
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        out[i] = read(fd, &val, sizeof(val)) == sizeof(val)
+            ? (double)val / (double)nops : -1;
+    }
+}
+
+struct Timer {
+    uint64_t start = 0;
+    uint64_t ns = 0;
+    size_t nops = 0;
+    double counters[k_ncounters] = {-1, -1, -1};
+};
+
+static void timer_start(Timer &t) {
+    counters_start();
+    t.start = get_monotonic_nsec();
+}
+
+// accumulates over rounds; the counters are from the last round
+static void timer_stop(Timer &t, size_t nops) {
+    t.ns += get_monotonic_nsec() - t.start;
+    t.nops += nops;
+    counters_stop(t.counters, nops);
+}
+
+static void report(const char *name, size_t n, const Timer &t, double bytes) {
+    printf("%-22s %10zu %9.1f", name, n, t.nops ? (double)t.ns / (double)t.nops : 0);
+    for (double c : t.counters) {
+        if (c < 0) {
+            printf(" %9s", "-");
+        } else {
+            printf(" %9.2f", c);
+        }
+    }
+    if (bytes > 0) {
+        printf(" %9.1f", bytes);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+// random ops on small sizes are repeated up to this many
+const size_t k_min_ops = 1000 * 1000;
+
+static std::vector<size_t> random_indexes(size_t n, size_t nops) {
+    std::vector<size_t> idx(nops);
+    for (size_t &i : idx) {
+        i = rand_u64() % n;
+    }
+    return idx;
+}
+
+static std::vector<size_t> permutation(size_t n) {
+    std::vector<size_t> perm(n);
+    for (size_t i = 0; i < n; ++i) {
+        perm[i] = i;
+    }
+    for (size_t i = n; i > 1; --i) {
+        std::swap(perm[i - 1], perm[rand_u64() % i]);
+    }
+    return perm;
+}
+
+// like `Entry`: an individually allocated node with a hashed key
+struct HKey {
+    HNode node;
+    uint64_t key = 0;
+};
+
+static uint64_t key_hash(uint64_t key) {
+    return str_hash((const uint8_t *)&key, sizeof(key));
+}
+
+static bool hkey_eq(HNode *lhs, HNode *rhs) {
+    return container_of(lhs, HKey, node)->key == container_of(rhs, HKey, node)->key;
+}
+
+static HNode *hm_find(HMap *hm, uint64_t key) {
+    HKey probe;
+    probe.key = key;
+    probe.node.hcode = key_hash(key);
+    return hm_lookup(hm, &probe.node, &hkey_eq);
+}
+
+static bool cb_count(HNode *, void *arg) {
+    (*(size_t *)arg)++;
+    return true;
+}
+
+// the slot arrays: a pointer and a control byte per slot
+static size_t table_bytes(HMap *hm) {
+    size_t n = hm->newer.ctrl ? hm->newer.mask + 1 : 0;
+    n += hm->older.ctrl ? hm->older.mask + 1 : 0;
+    return n * (sizeof(HNode *) + 1);
+}
+
+// hm_foreach over the keys left, and the table bytes per key left
+static void scan_after_delete(HMap *hm, size_t nleft) {
+    for (size_t i = 0; hm_rehashing(hm); ++i) {
+        hm_find(hm, i);     // let the shrinking finish
+    }
+    Timer scan;
+    size_t rounds = std::max<size_t>(1, k_min_ops / std::max<size_t>(nleft, 1));
+    timer_start(scan);
+    for (size_t r = 0; r < rounds; ++r) {
+        size_t count = 0;
+        hm_foreach(hm, &cb_count, &count);
+        assert(count == nleft);
+    }
+    timer_stop(scan, rounds * nleft);
+    report("hm_foreach (10% left)", nleft, scan,
+        (double)table_bytes(hm) / (double)std::max<size_t>(nleft, 1));
+}
+
+static void bench_hmap(size_t n) {
+    size_t rounds = std::max<size_t>(1, k_min_ops / n);
+    Timer insert, insert_rh, lookup_rh, del;
+    HMap hm;
+    size_t bytes = 0;
+    std::vector<HKey *> nodes(n);
+    for (size_t r = 0; r < rounds; ++r) {
+        size_t base = heap_bytes();
+        for (size_t i = 0; i < n; ++i) {
+            nodes[i] = new HKey();
+            nodes[i]->key = i;
+            nodes[i]->node.hcode = key_hash(i);
+        }
+        // inserts and lookups in chunks, by whether it's rehashing;
+        // not counted by the perf counters
+        const size_t k_chunk = 64;
+        for (size_t i = 0; i < n; i += k_chunk) {
+            size_t end = std::min(n, i + k_chunk);
+            bool rehashing = hm_rehashing(&hm);
+            uint64_t t0 = get_monotonic_nsec();
+            for (size_t j = i; j < end; ++j) {
+                hm_insert(&hm, &nodes[j]->node);
+            }
+            uint64_t t1 = get_monotonic_nsec();
+            Timer &ti = rehashing ? insert_rh : insert;
+            ti.ns += t1 - t0;
+            ti.nops += end - i;
+            if (rehashing) {
+                for (size_t j = i; j < end; ++j) {
+                    hm_find(&hm, rand_u64() % end);
+                }
+                lookup_rh.ns += get_monotonic_nsec() - t1;
+                lookup_rh.nops += end - i;
+            }
+        }
+        bytes = heap_bytes() - base;
+        if (r + 1 < rounds) {
+            hm_clear(&hm);
+            for (HKey *node : nodes) {
+                delete node;
+            }
+        }
+    }
+    report("hm_insert", n, insert, (double)bytes / (double)n);
+    report("hm_insert (rehashing)", n, insert_rh, 0);
+    report("hm_lookup (rehashing)", n, lookup_rh, 0);
+
+    size_t nops = std::max(n, k_min_ops);
+    std::vector<size_t> idx = random_indexes(n, nops);
+    Timer hit;
+    timer_start(hit);
+    for (size_t i : idx) {
+        HNode *node = hm_find(&hm, i);
+        assert(node);
+        (void)node;
+    }
+    timer_stop(hit, nops);
+    report("hm_lookup hit", n, hit, 0);
+
+    Timer miss;
+    timer_start(miss);
+    for (size_t i : idx) {
+        HNode *node = hm_find(&hm, i + n);
+        assert(!node);
+        (void)node;
+    }
+    timer_stop(miss, nops);
+    report("hm_lookup miss", n, miss, 0);
+
+    // delete 90%, scan the rest, then delete the rest
+    std::vector<size_t> perm = permutation(n);
+    size_t nleft = n / 10;
+    timer_start(del);
+    for (size_t k = 0; k < n; ++k) {
+        if (k == n - nleft) {
+            timer_stop(del, k);
+            scan_after_delete(&hm, nleft);
+            timer_start(del);
+        }
+        HKey probe;
+        probe.key = perm[k];
+        probe.node.hcode = key_hash(perm[k]);
+        HNode *node = hm_delete(&hm, &probe.node, &hkey_eq);
+        assert(node);
+        (void)node;
+    }
+    timer_stop(del, nleft);
+    report("hm_delete", n, del, 0);
+
+    hm_clear(&hm);
+    for (HKey *node : nodes) {
+        delete node;
+    }
+}
+
+struct AVLKey {
+    AVLNode node;
+    uint64_t key = 0;
+};
+
+static uint64_t avl_key(AVLNode *node) {
+    return container_of(node, AVLKey, node)->key;
+}
+
+static AVLNode *avl_insert(AVLNode *root, AVLKey *data) {
+    AVLNode *parent = NULL;
+    AVLNode **from = &root;
+    while (*from) {
+        parent = *from;
+        from = data->key < avl_key(parent) ? &parent->left : &parent->right;
+    }
+    *from = &data->node;
+    data->node.parent = parent;
+    return avl_fix(&data->node);
+}
+
+static void bench_avl(size_t n) {
+    size_t rounds = std::max<size_t>(1, k_min_ops / n);
+    std::vector<AVLKey *> nodes(n);
+    AVLNode *root = NULL;
+    Timer insert, del;
+    size_t bytes = 0;
+    for (size_t r = 0; r < rounds; ++r) {
+        size_t base = heap_bytes();
+        for (AVLKey *&node : nodes) {
+            node = new AVLKey();
+            avl_init(&node->node);
+            node->key = rand_u64();
+        }
+        root = NULL;
+        timer_start(insert);
+        for (AVLKey *node : nodes) {
+            root = avl_insert(root, node);
+        }
+        timer_stop(insert, n);
+        bytes = heap_bytes() - base;
+        if (r + 1 == rounds) {
+            break;
+        }
+        for (AVLKey *node : nodes) {
+            delete node;
+        }
+    }
+    report("avl insert+fix", n, insert, (double)bytes / (double)n);
+
+    // the rank query of zquery: from the first node
+    AVLNode *first = root;
+    while (first->left) {
+        first = first->left;
+    }
+    size_t nops = std::max(n, k_min_ops);
+    std::vector<size_t> idx = random_indexes(n, nops);
+    Timer offset;
+    timer_start(offset);
+    for (size_t i : idx) {
+        AVLNode *node = avl_offset(first, (int64_t)i);
+        assert(node);
+        (void)node;
+    }
+    timer_stop(offset, nops);
+    report("avl_offset", n, offset, 0);
+
+    std::vector<size_t> perm = permutation(n);
+    timer_start(del);
+    for (size_t i : perm) {
+        root = avl_del(&nodes[i]->node);
+    }
+    timer_stop(del, n);
+    assert(root == NULL);
+    report("avl_del", n, del, 0);
+    for (AVLKey *node : nodes) {
+        delete node;
+    }
+}
+
+// TTL-like updates of random items
+static void bench_heap(size_t n) {
+    size_t base = heap_bytes();
+    std::vector<size_t> refs(n);
+    std::vector<HeapItem> heap;
+    heap.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+        heap.push_back(HeapItem{rand_u64(), &refs[i]});
+        refs[i] = i;
+        heap_update(heap.data(), i, heap.size());
+    }
+    size_t bytes = heap_bytes() - base;
+    size_t nops = std::max(n, k_min_ops);
+    std::vector<size_t> idx = random_indexes(n, nops);
+    std::vector<uint64_t> vals(nops);
+    for (uint64_t &v : vals) {
+        v = rand_u64();
+    }
+    Timer update;
+    timer_start(update);
+    for (size_t i = 0; i < nops; ++i) {
+        size_t pos = refs[idx[i]];
+        heap[pos].val = vals[i];
+        heap_update(heap.data(), pos, n);
+    }
+    timer_stop(update, nops);
+    report("heap_update", n, update, (double)bytes / (double)n);
+}
+
+static std::string member_name(size_t i) {
+    char buf[32];
+    return std::string(buf, (size_t)snprintf(buf, sizeof(buf), "m:%zu", i));
+}
+
+static void bench_zset(size_t n) {
+    size_t rounds = std::max<size_t>(1, k_min_ops / n);
+    std::vector<std::string> names(n);
+    std::vector<double> scores(n);
+    for (size_t i = 0; i < n; ++i) {
+        names[i] = member_name(i);
+        scores[i] = (double)(rand_u64() % (n * 10));
+    }
+    ZSet zset;
+    Timer insert;
+    size_t bytes = 0;
+    for (size_t r = 0; r < rounds; ++r) {
+        if (r > 0) {
+            zset_clear(&zset);
+        }
+        size_t base = heap_bytes();
+        timer_start(insert);
+        for (size_t i = 0; i < n; ++i) {
+            zset_insert(&zset, names[i].data(), names[i].size(), scores[i]);
+        }
+        timer_stop(insert, n);
+        bytes = heap_bytes() - base;
+    }
+    report("zset_insert", n, insert, (double)bytes / (double)n);
+
+    size_t nops = std::max(n, k_min_ops);
+    std::vector<size_t> idx = random_indexes(n, nops);
+    Timer lookup;
+    timer_start(lookup);
+    for (size_t i : idx) {
+        ZNode *node = zset_lookup(&zset, names[i].data(), names[i].size());
+        assert(node);
+        (void)node;
+    }
+    timer_stop(lookup, nops);
+    report("zset_lookup", n, lookup, 0);
+
+    Timer seek;
+    timer_start(seek);
+    for (size_t i : idx) {
+        zset_seekge(&zset, scores[i], "", 0);
+    }
+    timer_stop(seek, nops);
+    report("zset_seekge", n, seek, 0);
+
+    ZNode *first = zset_seekge(&zset, -1, "", 0);
+    Timer offset;
+    timer_start(offset);
+    for (size_t i : idx) {
+        ZNode *node = znode_offset(first, (int64_t)i);
+        assert(node);
+        (void)node;
+    }
+    timer_stop(offset, nops);
+    report("znode_offset", n, offset, 0);
+    zset_clear(&zset);
+}
+
+int main(int argc, char **argv) {
+    size_t max_n = argc > 1 ? (size_t)strtod(argv[1], NULL) : 10 * 1000 * 1000;
+    std::string only = argc > 2 ? argv[2] : "";
+    counters_open();
+    printf("%-22s %10s %9s", "op", "n", "ns/op");
+    for (const char *name : k_counter_names) {
+        printf(" %9s", name);
+    }
+    printf(" %9s\n", "bytes/elem");
+    if (g_counter_fds[0] < 0) {
+        printf("# perf counters unavailable\n");
+    }
+    for (size_t n = 1000; n <= max_n; n *= 10) {
+        if (only.empty() || only == "hmap") {
+            bench_hmap(n);
+        }
+        if (only.empty() || only == "avl") {
+            bench_avl(n);
+        }
+        if (only.empty() || only == "heap") {
+            bench_heap(n);
+        }
+        if (only.empty() || only == "zset") {
+            bench_zset(n);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+
+// A seeded 64-bit string hash, 8 or 16 bytes at a time, based on
+// wyhash (public domain). Each step is a 64x64->128 bit multiply that
+// folds the high half into the low half.
+
+// per-process random seed against HashDoS; set once before any hashing
+inline uint64_t g_hash_seed = 0;
+
+const uint64_t k_hash_secret[4] = {
+    0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull,
+    0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull,
+};
+
+inline uint64_t hash_mix(uint64_t a, uint64_t b) {
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+inline uint64_t hash_read8(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+inline uint64_t hash_read4(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+inline uint64_t str_hash_seeded(const uint8_t *p, size_t len, uint64_t seed) {
+    const uint64_t *s = k_hash_secret;
+    seed ^= hash_mix(seed ^ s[0], s[1]);
+    uint64_t a = 0, b = 0;
+    if (len <= 16) {
+        if (len >= 4) {
+            // 2 overlapping reads from each end cover 4 to 16 bytes
+            size_t off = (len >> 3) << 2;
+            a = (hash_read4(p) << 32) | hash_read4(p + off);
+            b = (hash_read4(p + len - 4) << 32) | hash_read4(p + len - 4 - off);
+        } else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            // 3 independent lanes to overlap the multiplies
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = hash_mix(hash_read8(p) ^ s[1], hash_read8(p + 8) ^ seed);
+                see1 = hash_mix(hash_read8(p + 16) ^ s[2], hash_read8(p + 24) ^ see1);
+                see2 = hash_mix(hash_read8(p + 32) ^ s[3], hash_read8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = hash_mix(hash_read8(p) ^ s[1], hash_read8(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        // the last 16 bytes, overlapping the previous block
+        a = hash_read8(p + i - 16);
+        b = hash_read8(p + i - 8);
+    }
+    a ^= s[1];
+    b ^= seed;
+    __uint128_t r = (__uint128_t)a * b;
+    a = (uint64_t)r;
+    b = (uint64_t)(r >> 64);
+    return hash_mix(a ^ s[0] ^ len, b ^ s[1]);
+}
+
+inline uint64_t str_hash(const uint8_t *data, size_t len) {
+    return str_hash_seeded(data, len, g_hash_seed);
+}
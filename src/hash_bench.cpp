@@ -0,0 +1,60 @@
+// String hash throughput: the old byte-at-a-time FNV versus str_hash().
+// g++ -std=c++17 -O2 hash_bench.cpp -o hash_bench
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+#include "hash.h"
+
+
+static uint64_t get_monotonic_nsec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+// the old hash
+static uint64_t fnv_hash(const uint8_t *data, size_t len, uint64_t) {
+    uint32_t h = 0x811C9DC5;
+    for (size_t i = 0; i < len; i++) {
+        h = (h + data[i]) * 0x01000193;
+    }
+    return h;
+}
+
+const size_t k_bytes = 256 << 20;   // hashed per measurement
+const size_t k_pool = 1 << 20;      // a cache-resident input pool
+
+// ns per hash of `len` bytes at varying offsets
+static double bench(uint64_t (*f)(const uint8_t *, size_t, uint64_t),
+    const uint8_t *pool, size_t len)
+{
+    size_t n = k_bytes / len;
+    uint64_t sum = 0;
+    uint64_t start = get_monotonic_nsec();
+    for (size_t i = 0; i < n; i++) {
+        size_t off = (i * 64 + i % 7) % (k_pool - len);
+        sum += f(pool + off, len, 42);
+    }
+    uint64_t ns = get_monotonic_nsec() - start;
+    if (sum == 1) {
+        printf("!");    // keep the result alive
+    }
+    return (double)ns / (double)n;
+}
+
+int main() {
+    std::vector<uint8_t> pool(k_pool);
+    for (size_t i = 0; i < k_pool; i++) {
+        pool[i] = (uint8_t)rand();
+    }
+    size_t lens[] = {8, 16, 24, 32, 64, 128, 256, 1024, 4096};
+    printf("%6s %12s %10s %12s %10s\n", "bytes", "fnv ns", "fnv GB/s", "str_hash ns", "GB/s");
+    for (size_t len : lens) {
+        double fnv = bench(&fnv_hash, pool.data(), len);
+        double wy = bench(&str_hash_seeded, pool.data(), len);
+        printf("%6zu %12.1f %10.2f %12.1f %10.2f\n",
+            len, fnv, (double)len / fnv, wy, (double)len / wy);
+    }
+    return 0;
+}
@@ -0,0 +1,136 @@
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "hash.h"
+
+
+static uint64_t g_rng = 88172645463325252ull;
+
+static uint64_t rand_u64() {
+    g_rng ^= g_rng << 13;
+    g_rng ^= g_rng >> 7;
+    g_rng ^= g_rng << 17;
+    return g_rng;
+}
+
+static uint64_t hash_str(const std::string &s, uint64_t seed = 0) {
+    return str_hash_seeded((const uint8_t *)s.data(), s.size(), seed);
+}
+
+static void test_basic() {
+    // the seed and every byte and the length matter
+    assert(hash_str("hello") == hash_str("hello"));
+    assert(hash_str("hello", 1) != hash_str("hello", 2));
+    assert(hash_str("hello") != hash_str("hellp"));
+    assert(hash_str("") != hash_str(std::string(1, '\0')));
+    assert(hash_str(std::string(1, '\0')) != hash_str(std::string(2, '\0')));
+    std::string s;
+    std::vector<uint64_t> seen;
+    for (size_t i = 0; i < 200; i++) {
+        seen.push_back(hash_str(s));
+        s.push_back((char)('a' + i % 26));
+    }
+    std::sort(seen.begin(), seen.end());
+    assert(std::unique(seen.begin(), seen.end()) == seen.end());
+    // unaligned input
+    uint8_t buf[300];
+    for (size_t len = 0; len < 200; len++) {
+        for (size_t i = 0; i < len; i++) {
+            buf[i] = (uint8_t)rand_u64();
+        }
+        uint64_t h = str_hash_seeded(buf, len, 7);
+        for (size_t off = 1; off < 8; off++) {
+            memmove(buf + off, buf + off - 1, len);
+            assert(str_hash_seeded(buf + off, len, 7) == h);
+        }
+    }
+    // the default seed
+    g_hash_seed = 3;
+    assert(str_hash((const uint8_t *)"abc", 3) == hash_str("abc", 3));
+    g_hash_seed = 0;
+}
+
+// flipping any input bit flips each output bit with a probability of 1/2
+static void test_avalanche() {
+    const size_t k_trials = 1000;
+    size_t lens[] = {1, 3, 4, 7, 8, 12, 16, 17, 31, 48, 49, 100, 256};
+    uint8_t buf[256];
+    std::vector<uint32_t> flips;
+    for (size_t len : lens) {
+        flips.assign(len * 8 * 64, 0);
+        for (size_t t = 0; t < k_trials; t++) {
+            for (size_t i = 0; i < len; i++) {
+                buf[i] = (uint8_t)rand_u64();
+            }
+            uint64_t seed = rand_u64();
+            uint64_t h = str_hash_seeded(buf, len, seed);
+            for (size_t bit = 0; bit < len * 8; bit++) {
+                buf[bit / 8] ^= (uint8_t)(1 << (bit % 8));
+                uint64_t diff = h ^ str_hash_seeded(buf, len, seed);
+                buf[bit / 8] ^= (uint8_t)(1 << (bit % 8));
+                for (size_t j = 0; j < 64; j++) {
+                    flips[bit * 64 + j] += (uint32_t)((diff >> j) & 1);
+                }
+            }
+        }
+        double worst = 0;
+        for (uint32_t n : flips) {
+            worst = std::max(worst, fabs((double)n / k_trials - 0.5));
+        }
+        // 1000 trials: 0.1 is over 6 standard deviations
+        if (worst >= 0.1) {
+            fprintf(stderr, "avalanche: len=%zu bias=%.3f\n", len, worst);
+        }
+        assert(worst < 0.1);
+    }
+}
+
+// chi-squared against the uniform distribution
+static void check_uniform(const std::vector<uint64_t> &counts, size_t n) {
+    double expect = (double)n / (double)counts.size();
+    double chi2 = 0;
+    for (uint64_t c : counts) {
+        chi2 += ((double)c - expect) * ((double)c - expect) / expect;
+    }
+    double dof = (double)counts.size() - 1;
+    assert(fabs(chi2 - dof) < 6 * sqrt(2 * dof));
+}
+
+// similar keys spread over the slots and the tags of the hashtable
+static void test_distribution() {
+    const size_t n = 1000000;
+    std::vector<uint64_t> hashes;
+    char key[32];
+    for (size_t i = 0; i < n; i++) {
+        int len = snprintf(key, sizeof(key), "user:%zu", i);
+        hashes.push_back(str_hash_seeded((const uint8_t *)key, (size_t)len, 42));
+    }
+    std::vector<uint64_t> low(1 << 16), high(1 << 16), tags(128);
+    for (uint64_t h : hashes) {
+        low[h & 0xFFFF]++;
+        high[h >> 48]++;
+        tags[h & 0x7F]++;
+    }
+    check_uniform(low, n);
+    check_uniform(high, n);
+    check_uniform(tags, n);
+    std::vector<uint64_t> slots(1 << 16);
+    for (uint64_t h : hashes) {
+        slots[(h >> 7) & 0xFFFF]++;
+    }
+    check_uniform(slots, n);
+    // no 64-bit collisions
+    std::sort(hashes.begin(), hashes.end());
+    assert(std::adjacent_find(hashes.begin(), hashes.end()) == hashes.end());
+}
+
+int main() {
+    test_basic();
+    test_avalanche();
+    test_distribution();
+    return 0;
+}
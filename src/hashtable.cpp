@@ -1,84 +1,202 @@
 #include <assert.h>
-#include <stdlib.h>     // calloc(), free()
+#include <stdlib.h>     // aligned_alloc(), free()
+#include <string.h>
+#include <utility>      // std::swap()
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "hashtable.h"
 
 
-// n must be a power of 2
+// control bytes: a full slot holds the low 7 bits of the hash code
+const uint8_t k_ctrl_empty = 0x80;
+const uint8_t k_ctrl_deleted = 0xFE;
+const size_t k_group = 16;      // slots per probe
+
+// slot index from the high bits, tag from the low 7 bits
+static size_t h1(uint64_t hcode) { return (size_t)(hcode >> 7); }
+static uint8_t h2(uint64_t hcode) { return (uint8_t)(hcode & 0x7F); }
+
+// bitmasks of a group of 16 control bytes
+#if defined(__SSE2__)
+static uint32_t g_match(const uint8_t *ctrl, uint8_t tag) {
+    __m128i g = _mm_load_si128((const __m128i *)ctrl);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8((char)tag)));
+}
+
+// empty or deleted: the top bit is set
+static uint32_t g_match_free(const uint8_t *ctrl) {
+    __m128i g = _mm_load_si128((const __m128i *)ctrl);
+    return (uint32_t)_mm_movemask_epi8(g);
+}
+#else
+static uint32_t g_match(const uint8_t *ctrl, uint8_t tag) {
+    uint32_t bits = 0;
+    for (size_t i = 0; i < k_group; i++) {
+        bits |= (uint32_t)(ctrl[i] == tag) << i;
+    }
+    return bits;
+}
+
+static uint32_t g_match_free(const uint8_t *ctrl) {
+    uint32_t bits = 0;
+    for (size_t i = 0; i < k_group; i++) {
+        bits |= (uint32_t)(ctrl[i] >> 7) << i;
+    }
+    return bits;
+}
+#endif
+
+static uint32_t g_match_full(const uint8_t *ctrl) {
+    return ~g_match_free(ctrl) & 0xFFFF;
+}
+
+// n must be a power of 2, at least 1 group
 static void h_init(HTab *htab, size_t n) {
-    assert(n > 0 && ((n - 1) & n) == 0);
-    htab->tab = (HNode **)calloc(n, sizeof(HNode *));
+    assert(n >= k_group && ((n - 1) & n) == 0);
+    // control bytes first, so that the groups are aligned
+    htab->ctrl = (uint8_t *)aligned_alloc(k_group, n + n * sizeof(HNode *));
+    assert(htab->ctrl);
+    memset(htab->ctrl, k_ctrl_empty, n);
+    htab->slots = (HNode **)(htab->ctrl + n);
     htab->mask = n - 1;
     htab->size = 0;
+    htab->deleted = 0;
+}
+
+// the number of slots a table can use, including tombstones,
+// so that a probe always ends at an empty slot.
+static size_t h_max_used(HTab *htab) {
+    size_t n = htab->mask + 1;
+    return n - n / 8;
+}
+
+// The probe sequence visits groups: g, g+1, g+3, g+6, ...
+// which covers all groups when the number of groups is a power of 2.
+struct Probe {
+    size_t group;
+    size_t gmask;
+    size_t step = 0;
+};
+
+static Probe probe_start(HTab *htab, uint64_t hcode) {
+    size_t gmask = (htab->mask + 1) / k_group - 1;
+    return Probe{h1(hcode) & gmask, gmask};
+}
+
+static void probe_next(Probe &p) {
+    p.step++;
+    p.group = (p.group + p.step) & p.gmask;
 }
 
-// hashtable insertion
+// hashtable insertion, into the first free slot
 static void h_insert(HTab *htab, HNode *node) {
-    size_t pos = node->hcode & htab->mask;
-    HNode *next = htab->tab[pos];
-    node->next = next;
-    htab->tab[pos] = node;
-    htab->size++;
+    for (Probe p = probe_start(htab, node->hcode); ; probe_next(p)) {
+        size_t base = p.group * k_group;
+        uint32_t bits = g_match_free(&htab->ctrl[base]);
+        if (bits) {
+            size_t pos = base + (size_t)__builtin_ctz(bits);
+            htab->deleted -= (htab->ctrl[pos] == k_ctrl_deleted) ? 1 : 0;
+            htab->ctrl[pos] = h2(node->hcode);
+            htab->slots[pos] = node;
+            htab->size++;
+            return;
+        }
+    }
 }
 
 // hashtable look up subroutine.
-// Pay attention to the return value. It returns the address of
-// the parent pointer that owns the target node,
+// It returns the address of the slot that holds the target node,
 // which can be used to delete the target node.
 static HNode **h_lookup(HTab *htab, HNode *key, bool (*eq)(HNode *, HNode *)) {
-    if (!htab->tab) {
+    if (!htab->ctrl) {
         return NULL;
     }
 
-    size_t pos = key->hcode & htab->mask;
-    HNode **from = &htab->tab[pos];     // incoming pointer to the target
-    for (HNode *cur; (cur = *from) != NULL; from = &cur->next) {
-        if (cur->hcode == key->hcode && eq(cur, key)) {
-            return from;                // may be a node, may be a slot
+    uint8_t tag = h2(key->hcode);
+    for (Probe p = probe_start(htab, key->hcode); ; probe_next(p)) {
+        size_t base = p.group * k_group;
+        const uint8_t *ctrl = &htab->ctrl[base];
+        // only the tag matches are compared, 1 in 128 false positives
+        for (uint32_t bits = g_match(ctrl, tag); bits; bits &= bits - 1) {
+            HNode **from = &htab->slots[base + (size_t)__builtin_ctz(bits)];
+            HNode *cur = *from;
+            if (cur->hcode == key->hcode && eq(cur, key)) {
+                return from;
+            }
+        }
+        // the key would've been inserted into an empty slot
+        if (g_match(ctrl, k_ctrl_empty)) {
+            return NULL;
         }
     }
-    return NULL;
 }
 
-// remove a node from the chain
+// remove a node from its slot
 static HNode *h_detach(HTab *htab, HNode **from) {
-    HNode *node = *from;    // the target node
-    *from = node->next;     // update the incoming pointer to the target
+    size_t pos = (size_t)(from - htab->slots);
+    HNode *node = *from;
+    // A probe stops at a group with an empty slot, so if this group has
+    // one, no probe goes past it, and the slot can be empty too.
+    // Otherwise a tombstone keeps the probes going.
+    if (g_match(&htab->ctrl[pos & ~(k_group - 1)], k_ctrl_empty)) {
+        htab->ctrl[pos] = k_ctrl_empty;
+    } else {
+        htab->ctrl[pos] = k_ctrl_deleted;
+        htab->deleted++;
+    }
     htab->size--;
     return node;
 }
 
 const size_t k_rehashing_work = 128;    // constant work
 
-static void hm_help_rehashing(HMap *hmap) {
+static void hm_help_rehashing(HMap *hmap, size_t max_work) {
     size_t nwork = 0;
-    while (nwork < k_rehashing_work && hmap->older.size > 0) {
-        // find a non-empty slot
-        HNode **from = &hmap->older.tab[hmap->migrate_pos];
-        if (!*from) {
-            hmap->migrate_pos++;
-            continue;   // empty slot
+    while (nwork < max_work && hmap->older.size > 0) {
+        // find the non-empty slots in the next group
+        size_t base = hmap->migrate_pos;
+        assert(base <= hmap->older.mask);
+        uint32_t bits = g_match_full(&hmap->older.ctrl[base]);
+        if (!bits) {
+            hmap->migrate_pos += k_group;
+            nwork++;    // skipping a group is cheap, but not free
+            continue;
         }
-        // move the first list item to the newer table
+        // move a node to the newer table
+        HNode **from = &hmap->older.slots[base + (size_t)__builtin_ctz(bits)];
         h_insert(&hmap->newer, h_detach(&hmap->older, from));
         nwork++;
     }
     // discard the old table if done
-    if (hmap->older.size == 0 && hmap->older.tab) {
-        free(hmap->older.tab);
+    if (hmap->older.size == 0 && hmap->older.ctrl) {
+        free(hmap->older.ctrl);
         hmap->older = HTab{};
     }
 }
 
-static void hm_trigger_rehashing(HMap *hmap) {
-    assert(hmap->older.tab == NULL);
+// the table size for `size` keys at most half full
+static size_t h_capacity_for(size_t size) {
+    size_t n = k_group;
+    while (n / 2 < size) {
+        n *= 2;
+    }
+    return n;
+}
+
+// Resize to `n` slots. It's only triggered at a load factor of 7/8
+// (grow) or 1/8 (shrink), and the new table is 1/4 to 1/2 full, so
+// it doesn't flip between growing and shrinking.
+static void hm_trigger_rehashing(HMap *hmap, size_t n) {
+    assert(hmap->older.ctrl == NULL);
     // (newer, older) <- (new_table, newer)
     hmap->older = hmap->newer;
-    h_init(&hmap->newer, (hmap->newer.mask + 1) * 2);
+    h_init(&hmap->newer, n);
     hmap->migrate_pos = 0;
 }
 
 HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) {
-    hm_help_rehashing(hmap);
+    hm_help_rehashing(hmap, k_rehashing_work);
     HNode **from = h_lookup(&hmap->newer, key, eq);
     if (!from) {
         from = h_lookup(&hmap->older, key, eq);
@@ -86,37 +204,79 @@ HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) {
     return from ? *from : NULL;
 }
 
-const size_t k_max_load_factor = 8;
-
 void hm_insert(HMap *hmap, HNode *node) {
-    if (!hmap->newer.tab) {
-        h_init(&hmap->newer, 4);    // initialize it if empty
+    if (!hmap->newer.ctrl) {
+        h_init(&hmap->newer, k_group);  // initialize it if empty
+    }
+    // check whether we need to rehash before the table fills up
+    HTab *newer = &hmap->newer;
+    if (newer->size + newer->deleted + 1 > h_max_used(newer)) {
+        // The migration outpaces the inserts, so the older table is
+        // normally gone by now. Finish it otherwise.
+        hm_help_rehashing(hmap, (size_t)-1);
+        // grow, or clear the tombstones if most used slots are deleted
+        hm_trigger_rehashing(hmap, h_capacity_for(newer->size + 1));
     }
     h_insert(&hmap->newer, node);   // always insert to the newer table
+    hm_help_rehashing(hmap, k_rehashing_work);  // migrate some keys
+}
 
-    if (!hmap->older.tab) {         // check whether we need to rehash
-        size_t shreshold = (hmap->newer.mask + 1) * k_max_load_factor;
-        if (hmap->newer.size >= shreshold) {
-            hm_trigger_rehashing(hmap);
-        }
+const size_t k_min_load_factor = 8;     // shrink below 1/8 full
+
+static void hm_maybe_shrink(HMap *hmap) {
+    size_t n = hmap->newer.mask + 1;
+    if (!hmap->older.ctrl && n > k_group && hmap->newer.size < n / k_min_load_factor) {
+        hm_trigger_rehashing(hmap, h_capacity_for(hmap->newer.size));
     }
-    hm_help_rehashing(hmap);        // migrate some keys
 }
 
 HNode *hm_delete(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) {
-    hm_help_rehashing(hmap);
+    hm_help_rehashing(hmap, k_rehashing_work);
+    HNode *node = NULL;
     if (HNode **from = h_lookup(&hmap->newer, key, eq)) {
-        return h_detach(&hmap->newer, from);
+        node = h_detach(&hmap->newer, from);
+    } else if (HNode **from = h_lookup(&hmap->older, key, eq)) {
+        node = h_detach(&hmap->older, from);
+    }
+    if (node) {
+        hm_maybe_shrink(hmap);
     }
-    if (HNode **from = h_lookup(&hmap->older, key, eq)) {
-        return h_detach(&hmap->older, from);
+    return node;
+}
+
+static void h_prefetch(HTab *htab, uint64_t hcode) {
+    if (!htab->ctrl) {
+        return;
     }
-    return NULL;
+    size_t base = probe_start(htab, hcode).group * k_group;
+    __builtin_prefetch(&htab->ctrl[base]);
+    __builtin_prefetch(&htab->slots[base]);     // 2 cache lines
+    __builtin_prefetch(&htab->slots[base + k_group / 2]);
+}
+
+static void h_prefetch_nodes(HTab *htab, uint64_t hcode) {
+    if (!htab->ctrl) {
+        return;
+    }
+    size_t base = probe_start(htab, hcode).group * k_group;
+    for (uint32_t bits = g_match(&htab->ctrl[base], h2(hcode)); bits; bits &= bits - 1) {
+        __builtin_prefetch(htab->slots[base + (size_t)__builtin_ctz(bits)]);
+    }
+}
+
+void hm_prefetch(HMap *hmap, uint64_t hcode) {
+    h_prefetch(&hmap->newer, hcode);
+    h_prefetch(&hmap->older, hcode);
+}
+
+void hm_prefetch_nodes(HMap *hmap, uint64_t hcode) {
+    h_prefetch_nodes(&hmap->newer, hcode);
+    h_prefetch_nodes(&hmap->older, hcode);
 }
 
 void hm_clear(HMap *hmap) {
-    free(hmap->newer.tab);
-    free(hmap->older.tab);
+    free(hmap->newer.ctrl);
+    free(hmap->older.ctrl);
     *hmap = HMap{};
 }
 
@@ -124,10 +284,24 @@ size_t hm_size(HMap *hmap) {
     return hmap->newer.size + hmap->older.size;
 }
 
+bool hm_rehashing(HMap *hmap) {
+    return hmap->older.ctrl != NULL;
+}
+
+bool hm_rehash_step(HMap *hmap, size_t max_work) {
+    hm_help_rehashing(hmap, max_work);
+    return hm_rehashing(hmap);
+}
+
+size_t hm_rehash_left(HMap *hmap) {
+    return hmap->older.size;
+}
+
 static bool h_foreach(HTab *htab, bool (*f)(HNode *, void *), void *arg) {
-    for (size_t i = 0; htab->mask != 0 && i <= htab->mask; i++) {
-        for (HNode *node = htab->tab[i]; node != NULL; node = node->next) {
-            if (!f(node, arg)) {
+    for (size_t base = 0; htab->ctrl && base <= htab->mask; base += k_group) {
+        uint32_t bits = g_match_full(&htab->ctrl[base]);
+        for (; bits; bits &= bits - 1) {
+            if (!f(htab->slots[base + (size_t)__builtin_ctz(bits)], arg)) {
                 return false;
             }
         }
@@ -138,3 +312,70 @@ static bool h_foreach(HTab *htab, bool (*f)(HNode *, void *), void *arg) {
 void hm_foreach(HMap *hmap, bool (*f)(HNode *, void *), void *arg) {
     h_foreach(&hmap->newer, f, arg) && h_foreach(&hmap->older, f, arg);
 }
+
+// The scan cursor is a home group index, incremented from the high bit
+// down (reverse binary). The groups of a 2x larger table that split
+// from a group are then visited together, and when the table grows or
+// shrinks, the visited groups map to visited groups of the new size.
+static uint64_t rev_bits(uint64_t v) {
+    v = ((v >> 1) & 0x5555555555555555ull) | ((v & 0x5555555555555555ull) << 1);
+    v = ((v >> 2) & 0x3333333333333333ull) | ((v & 0x3333333333333333ull) << 2);
+    v = ((v >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((v & 0x0F0F0F0F0F0F0F0Full) << 4);
+    return __builtin_bswap64(v);
+}
+
+// increment the bits under the mask in reverse, the others are cleared
+static uint64_t rev_incr(uint64_t v, uint64_t mask) {
+    v |= ~mask;
+    return rev_bits(rev_bits(v) + 1);
+}
+
+static uint64_t h_gmask(HTab *htab) {
+    return (htab->mask + 1) / k_group - 1;
+}
+
+// The keys whose home group is `g`. They are on its probe sequence,
+// before the first group with an empty slot, since that group had an
+// empty slot when the key was inserted.
+static void h_scan(HTab *htab, uint64_t g, void (*f)(HNode *, void *), void *arg) {
+    uint64_t gmask = h_gmask(htab);
+    for (Probe p{(size_t)g, (size_t)gmask}; ; probe_next(p)) {
+        size_t base = p.group * k_group;
+        const uint8_t *ctrl = &htab->ctrl[base];
+        for (uint32_t bits = g_match_full(ctrl); bits; bits &= bits - 1) {
+            HNode *node = htab->slots[base + (size_t)__builtin_ctz(bits)];
+            if ((h1(node->hcode) & gmask) == g) {
+                f(node, arg);
+            }
+        }
+        if (g_match(ctrl, k_ctrl_empty)) {
+            return;
+        }
+    }
+}
+
+uint64_t hm_scan(HMap *hmap, uint64_t cursor, void (*f)(HNode *, void *), void *arg) {
+    HTab *small = &hmap->newer;
+    HTab *large = &hmap->older;
+    if (!small->ctrl) {
+        return 0;
+    }
+    if (!large->ctrl) {
+        uint64_t m0 = h_gmask(small);
+        h_scan(small, cursor & m0, f, arg);
+        return rev_incr(cursor, m0);
+    }
+    // rehashing: the group in the smaller table, and its splits in the
+    // larger one, where a key is in either table.
+    if (small->mask > large->mask) {
+        std::swap(small, large);
+    }
+    uint64_t m0 = h_gmask(small);
+    uint64_t m1 = h_gmask(large);
+    h_scan(small, cursor & m0, f, arg);
+    do {
+        h_scan(large, cursor & m1, f, arg);
+        cursor = rev_incr(cursor, m1);
+    } while (cursor & (m0 ^ m1));
+    return cursor;
+}
@@ -6,15 +6,19 @@
 
 // hashtable node, should be embedded into the payload
 struct HNode {
-    HNode *next = NULL;
     uint64_t hcode = 0;
 };
 
-// a simple fixed-sized hashtable
+// a fixed-sized open addressing hashtable (Swiss table).
+// Each slot has a control byte: empty, deleted, or a 7-bit tag of
+// the hash code. A probe compares a group of 16 control bytes at once,
+// and only the slots with a matching tag are dereferenced.
 struct HTab {
-    HNode **tab = NULL; // array of slots
-    size_t mask = 0;    // power of 2 array size, 2^n - 1
-    size_t size = 0;    // number of keys
+    uint8_t *ctrl = NULL;   // control bytes, 1 per slot
+    HNode **slots = NULL;   // array of slots, in the same allocation
+    size_t mask = 0;        // power of 2 array size, 2^n - 1
+    size_t size = 0;        // number of keys
+    size_t deleted = 0;     // number of tombstones
 };
 
 // the real hashtable interface.
@@ -30,5 +34,22 @@ void   hm_insert(HMap *hmap, HNode *node);
 HNode *hm_delete(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
 void   hm_clear(HMap *hmap);
 size_t hm_size(HMap *hmap);
+// Batched lookups: prefetch the first probe group of each key, then the
+// nodes with a matching tag in it, then look them up, so that the cache
+// misses of independent keys overlap instead of adding up.
+void   hm_prefetch(HMap *hmap, uint64_t hcode);
+void   hm_prefetch_nodes(HMap *hmap, uint64_t hcode);
+// whether a progressive rehash is in progress
+bool   hm_rehashing(HMap *hmap);
+// migrate up to `max_work` keys (or empty groups) without an operation,
+// returns whether it's still rehashing
+bool   hm_rehash_step(HMap *hmap, size_t max_work);
+// the keys left in the older table
+size_t hm_rehash_left(HMap *hmap);
 // invoke the callback on each node until it returns false
-void   hm_foreach(HMap *hmap, bool (*f)(HNode *, void *), void *arg);
\ No newline at end of file
+void   hm_foreach(HMap *hmap, bool (*f)(HNode *, void *), void *arg);
+// Incremental iteration: visit the keys at `cursor`, return the next
+// cursor, 0 when done. A scan starts from 0. Every key present for the
+// whole scan is visited, even if the table is resized in between,
+// though some may be visited more than once.
+uint64_t hm_scan(HMap *hmap, uint64_t cursor, void (*f)(HNode *, void *), void *arg);
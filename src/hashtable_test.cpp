@@ -0,0 +1,283 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <map>
+#include "hashtable.cpp"
+#include "common.h"
+
+struct Data {
+    HNode node;
+    uint64_t key = 0;
+};
+
+// `hash` maps a key to its hash code, to test the collisions
+struct Container {
+    HMap hmap;
+    std::map<uint64_t, Data *> ref;
+    uint64_t (*hash)(uint64_t) = NULL;
+};
+
+static bool data_eq(HNode *lhs, HNode *rhs) {
+    return container_of(lhs, Data, node)->key == container_of(rhs, Data, node)->key;
+}
+
+static HNode *find(Container &c, uint64_t key) {
+    Data probe;
+    probe.key = key;
+    probe.node.hcode = c.hash(key);
+    return hm_lookup(&c.hmap, &probe.node, &data_eq);
+}
+
+static void add(Container &c, uint64_t key) {
+    if (c.ref.count(key)) {
+        return;
+    }
+    Data *d = new Data();
+    d->key = key;
+    d->node.hcode = c.hash(key);
+    hm_insert(&c.hmap, &d->node);
+    c.ref[key] = d;
+}
+
+static void del(Container &c, uint64_t key) {
+    Data probe;
+    probe.key = key;
+    probe.node.hcode = c.hash(key);
+    HNode *node = hm_delete(&c.hmap, &probe.node, &data_eq);
+    auto it = c.ref.find(key);
+    if (it == c.ref.end()) {
+        assert(!node);
+        return;
+    }
+    assert(node == &it->second->node);
+    delete it->second;
+    c.ref.erase(it);
+}
+
+static bool cb_count(HNode *node, void *arg) {
+    std::map<uint64_t, int> &seen = *(std::map<uint64_t, int> *)arg;
+    seen[container_of(node, Data, node)->key]++;
+    return true;
+}
+
+static void htab_verify(HTab *htab) {
+    if (!htab->ctrl) {
+        assert(htab->size == 0 && htab->deleted == 0);
+        return;
+    }
+    size_t full = 0, deleted = 0, empty = 0;
+    for (size_t i = 0; i <= htab->mask; i++) {
+        uint8_t ctrl = htab->ctrl[i];
+        if (ctrl == k_ctrl_empty) {
+            empty++;
+        } else if (ctrl == k_ctrl_deleted) {
+            deleted++;
+        } else {
+            assert(ctrl == h2(htab->slots[i]->hcode));
+            full++;
+        }
+    }
+    assert(full == htab->size && deleted == htab->deleted);
+    assert(empty > 0);  // every probe ends
+}
+
+static void verify(Container &c) {
+    htab_verify(&c.hmap.newer);
+    htab_verify(&c.hmap.older);
+    assert(hm_size(&c.hmap) == c.ref.size());
+    std::map<uint64_t, int> seen;
+    hm_foreach(&c.hmap, &cb_count, &seen);
+    assert(seen.size() == c.ref.size());
+    for (auto &p : c.ref) {
+        assert(seen[p.first] == 1);
+        assert(find(c, p.first) == &p.second->node);
+    }
+}
+
+static void dispose(Container &c) {
+    for (auto &p : c.ref) {
+        delete p.second;
+    }
+    c.ref.clear();
+    hm_clear(&c.hmap);
+}
+
+static uint64_t hash_mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return x;
+}
+
+// the same tag for all, few distinct groups
+static uint64_t hash_bad(uint64_t x) {
+    return (x % 7) << 7;
+}
+
+static void test_random(uint64_t (*hash)(uint64_t), size_t nkeys, size_t nops) {
+    Container c;
+    c.hash = hash;
+    srand(1);
+    for (size_t i = 0; i < nops; i++) {
+        uint64_t key = (uint64_t)rand() % nkeys;
+        if (rand() % 3) {
+            add(c, key);
+        } else {
+            del(c, key);
+        }
+        assert(!find(c, nkeys + key));
+        if (i % 1000 == 0) {
+            verify(c);
+        }
+    }
+    verify(c);
+    dispose(c);
+}
+
+// insert then delete most keys; the tombstones are cleared by rehashing
+static void test_churn() {
+    Container c;
+    c.hash = &hash_mix;
+    for (uint64_t round = 0; round < 50; round++) {
+        for (uint64_t i = 0; i < 1000; i++) {
+            add(c, round * 1000 + i);
+        }
+        for (uint64_t i = 0; i < 990; i++) {
+            del(c, round * 1000 + i);
+        }
+        verify(c);
+    }
+    assert(c.ref.size() == 500);
+    // bounded by the live keys, not by the keys ever inserted
+    assert(c.hmap.newer.mask + 1 <= 4096);
+    dispose(c);
+}
+
+// lookups until the rehashing is done
+static void finish_rehashing(Container &c) {
+    for (uint64_t i = 0; hm_rehashing(&c.hmap); i++) {
+        find(c, i);
+    }
+}
+
+// deleting most keys shrinks the table
+static void test_shrink() {
+    Container c;
+    c.hash = &hash_mix;
+    for (uint64_t i = 0; i < 100000; i++) {
+        add(c, i);
+    }
+    finish_rehashing(c);
+    assert(c.hmap.newer.mask + 1 == 131072);
+    for (uint64_t i = 1000; i < 100000; i++) {
+        del(c, i);
+    }
+    finish_rehashing(c);
+    verify(c);
+    assert(c.hmap.newer.mask + 1 == 2048);
+    // no resizing back and forth at the threshold
+    while (c.ref.size() >= 2048 / 8) {
+        del(c, c.ref.begin()->first);
+    }
+    finish_rehashing(c);
+    size_t n = c.hmap.newer.mask + 1;
+    assert(n == 512);
+    for (uint64_t i = 0; i < 10000; i++) {
+        add(c, 1000000 + i % 2);
+        del(c, 1000000 + i % 2);
+        assert(!hm_rehashing(&c.hmap) && c.hmap.newer.mask + 1 == n);
+    }
+    // down to the minimum
+    while (!c.ref.empty()) {
+        del(c, c.ref.begin()->first);
+    }
+    finish_rehashing(c);
+    assert(c.hmap.newer.mask + 1 == k_group);
+    verify(c);
+    dispose(c);
+}
+
+// the older table is looked up until it's migrated
+static void test_rehashing() {
+    Container c;
+    c.hash = &hash_mix;
+    bool seen = false;
+    for (uint64_t i = 0; i < 100000; i++) {
+        add(c, i);
+        if (hm_rehashing(&c.hmap) && c.hmap.older.size > 0) {
+            seen = true;
+            assert(find(c, i));
+            assert(find(c, 0));
+        }
+    }
+    assert(seen);
+    verify(c);
+    // finished without lookups
+    while (!hm_rehashing(&c.hmap)) {
+        add(c, c.ref.size());
+    }
+    size_t left = hm_rehash_left(&c.hmap);
+    assert(left > 0);
+    while (hm_rehash_step(&c.hmap, 100)) {
+        assert(hm_rehash_left(&c.hmap) <= left);
+        left = hm_rehash_left(&c.hmap);
+    }
+    assert(hm_rehash_left(&c.hmap) == 0);
+    verify(c);
+    dispose(c);
+}
+
+static void cb_scan(HNode *node, void *arg) {
+    std::map<uint64_t, int> &seen = *(std::map<uint64_t, int> *)arg;
+    seen[container_of(node, Data, node)->key]++;
+}
+
+// Scan while the table grows or shrinks. The keys present for the whole
+// scan are all visited; `grow` keys are added or removed during it.
+static void test_scan(size_t nkeys, int64_t grow, size_t ops_per_step) {
+    Container c;
+    c.hash = &hash_mix;
+    for (uint64_t i = 0; i < nkeys; i++) {
+        add(c, i);
+    }
+    std::map<uint64_t, Data *> stable = c.ref;
+    std::map<uint64_t, int> seen;
+    uint64_t cursor = 0;
+    uint64_t next_key = nkeys;
+    do {
+        cursor = hm_scan(&c.hmap, cursor, &cb_scan, &seen);
+        for (size_t i = 0; i < ops_per_step; i++) {
+            if (grow > 0) {
+                add(c, next_key++);
+                grow--;
+            } else if (grow < 0 && !c.ref.empty()) {
+                // remove the unstable keys first, then the stable ones
+                auto it = c.ref.rbegin();
+                stable.erase(it->first);
+                del(c, it->first);
+                grow++;
+            }
+            find(c, i);     // migrate
+        }
+    } while (cursor != 0);
+    for (auto &p : stable) {
+        assert(seen.count(p.first));
+    }
+    verify(c);
+    dispose(c);
+}
+
+int main() {
+    test_random(&hash_mix, 100, 20000);
+    test_random(&hash_mix, 10000, 100000);
+    test_random(&hash_bad, 300, 20000);
+    test_churn();
+    test_shrink();
+    test_rehashing();
+    test_scan(0, 0, 0);
+    test_scan(10, 0, 0);
+    test_scan(100000, 0, 0);
+    test_scan(1000, 100000, 10);        // grows many times
+    test_scan(100000, -99000, 100);     // shrinks
+    test_scan(20000, 0, 0);
+    return 0;
+}
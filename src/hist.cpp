@@ -0,0 +1,77 @@
+#include <assert.h>
+#include <string.h>
+#include "hist.h"
+
+
+const uint64_t k_hist_sub = (uint64_t)1 << k_hist_sub_bits;
+const uint64_t k_hist_max = ((uint64_t)1 << k_hist_max_bits) - 1;
+
+// values below 16 have 1 bucket each; a value with the highest bit at
+// `msb` goes to the sub-bucket of its next 4 bits in group `msb - 3`.
+uint32_t hist_bucket_of(uint64_t v) {
+    if (v > k_hist_max) {
+        v = k_hist_max;
+    }
+    if (v < k_hist_sub) {
+        return (uint32_t)v;
+    }
+    uint32_t shift = 63 - __builtin_clzll(v) - k_hist_sub_bits;
+    return (uint32_t)((shift << k_hist_sub_bits) + (v >> shift));
+}
+
+uint64_t hist_bucket_low(uint32_t idx) {
+    if (idx < k_hist_sub) {
+        return idx;
+    }
+    uint32_t shift = (idx >> k_hist_sub_bits) - 1;
+    return (k_hist_sub + (idx & (k_hist_sub - 1))) << shift;
+}
+
+uint64_t hist_bucket_high(uint32_t idx) {
+    if (idx < k_hist_sub) {
+        return idx;
+    }
+    uint32_t shift = (idx >> k_hist_sub_bits) - 1;
+    return hist_bucket_low(idx) + ((uint64_t)1 << shift) - 1;
+}
+
+void hist_add(Hist *h, uint64_t v) {
+    h->counts[hist_bucket_of(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v > h->max) {
+        h->max = v;
+    }
+}
+
+void hist_reset(Hist *h) {
+    memset(h->counts, 0, sizeof(h->counts));
+    h->count = h->sum = h->max = 0;
+}
+
+uint64_t hist_quantile(const Hist *h, double q) {
+    if (h->count == 0) {
+        return 0;
+    }
+    // the rank of the value, 1-based
+    uint64_t rank = (uint64_t)(q * (double)h->count + 0.5);
+    rank = rank < 1 ? 1 : (rank > h->count ? h->count : rank);
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < k_hist_buckets; ++i) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t high = hist_bucket_high(i);
+            return high < h->max ? high : h->max;
+        }
+    }
+    assert(!"unreachable");
+    return h->max;
+}
+
+uint64_t hist_count_below(const Hist *h, uint64_t v) {
+    uint64_t n = 0;
+    for (uint32_t i = 0; i < k_hist_buckets && hist_bucket_low(i) < v; ++i) {
+        n += h->counts[i];
+    }
+    return n;
+}
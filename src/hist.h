@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// A log-bucketed latency histogram, like HdrHistogram: each power of 2 is
+// split into 16 linear sub-buckets, so a value is recorded with at most
+// 1/16 relative error in O(1) and fixed memory. Values are in ns, and
+// are clamped to 2^40 ns (18 minutes).
+const uint32_t k_hist_sub_bits = 4;
+const uint32_t k_hist_max_bits = 40;
+const uint32_t k_hist_buckets =
+    (k_hist_max_bits - k_hist_sub_bits + 1) << k_hist_sub_bits;
+
+struct Hist {
+    uint64_t counts[k_hist_buckets] = {};
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+};
+
+uint32_t hist_bucket_of(uint64_t v);
+// the range of values of a bucket
+uint64_t hist_bucket_low(uint32_t idx);
+uint64_t hist_bucket_high(uint32_t idx);
+
+void hist_add(Hist *h, uint64_t v);
+void hist_reset(Hist *h);
+// the value at the quantile `q` in [0, 1], as the upper bound of its
+// bucket but no more than the max; 0 if empty.
+uint64_t hist_quantile(const Hist *h, double q);
+// the number of values below `v`, counting each bucket by its lower bound
+uint64_t hist_count_below(const Hist *h, uint64_t v);
@@ -0,0 +1,60 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+#include "hist.cpp"
+
+
+static void test_buckets() {
+    // contiguous ranges covering all values
+    assert(hist_bucket_low(0) == 0);
+    for (uint32_t i = 0; i + 1 < k_hist_buckets; ++i) {
+        assert(hist_bucket_high(i) + 1 == hist_bucket_low(i + 1));
+        assert(hist_bucket_of(hist_bucket_low(i)) == i);
+        assert(hist_bucket_of(hist_bucket_high(i)) == i);
+        // the relative error bound
+        uint64_t low = hist_bucket_low(i);
+        assert((hist_bucket_high(i) - low) * 16 <= std::max<uint64_t>(low, 1));
+    }
+    assert(hist_bucket_high(k_hist_buckets - 1) == ((uint64_t)1 << 40) - 1);
+    assert(hist_bucket_of((uint64_t)-1) == k_hist_buckets - 1);
+}
+
+static void test_quantiles() {
+    Hist *h = new Hist();
+    assert(hist_quantile(h, 0.5) == 0);
+    std::vector<uint64_t> vals;
+    for (int i = 0; i < 100000; ++i) {
+        // log-uniform from 1ns to ~1s
+        uint64_t v = (uint64_t)1 << (rand() % 30);
+        v += (uint64_t)rand() % v;
+        vals.push_back(v);
+        hist_add(h, v);
+    }
+    std::sort(vals.begin(), vals.end());
+    assert(h->count == vals.size() && h->max == vals.back());
+    const double qs[] = {0, 0.5, 0.9, 0.99, 0.999, 1};
+    for (double q : qs) {
+        size_t rank = std::max<size_t>(1, (size_t)(q * vals.size() + 0.5));
+        uint64_t exact = vals[rank - 1];
+        uint64_t got = hist_quantile(h, q);
+        assert(got >= exact && got <= exact + exact / 16);
+    }
+    assert(hist_quantile(h, 1) == vals.back());
+    // counted by the lower bound of buckets
+    uint64_t below = hist_count_below(h, 1024);
+    uint64_t exact = std::lower_bound(vals.begin(), vals.end(), 1024) - vals.begin();
+    assert(below == exact);     // 1024 is a bucket boundary
+
+    hist_reset(h);
+    assert(h->count == 0 && hist_quantile(h, 0.99) == 0);
+    hist_add(h, 7);
+    assert(hist_quantile(h, 0.5) == 7 && hist_quantile(h, 1) == 7);
+    delete h;
+}
+
+int main() {
+    test_buckets();
+    test_quantiles();
+    return 0;
+}
@@ -0,0 +1,587 @@
+// A load generator: many connections, pipelining, mixed workloads,
+// closed-loop or rate-limited open-loop, and latency percentiles.
+// g++ -std=c++17 -O2 loadgen.cpp poller.cpp buffer.cpp hist.cpp -o loadgen
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "protocol.h"
+#include "buffer.h"
+#include "poller.h"
+#include "hist.h"
+
+
+static void die(const char *msg) {
+    fprintf(stderr, "[%d] %s\n", errno, msg);
+    exit(1);
+}
+
+static uint64_t get_monotonic_nsec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+enum {
+    OP_GET = 0,
+    OP_SET,
+    OP_ZADD,
+    OP_ZQUERY,
+    OP_PEXPIRE,
+    OP_MGET,
+    OP_INCR,
+    OP_COUNT,
+};
+
+static const char *k_op_names[OP_COUNT] = {
+    "get", "set", "zadd", "zquery", "pexpire", "mget", "incr",
+};
+
+struct Options {
+    std::string host = "127.0.0.1";
+    uint16_t port = 1234;
+    uint32_t conns = 50;
+    uint32_t pipeline = 1;          // in flight per connection, closed-loop
+    uint64_t requests = 100000;
+    double duration = 0;            // seconds, instead of `requests`
+    uint32_t mix[OP_COUNT] = {80, 20, 0, 0, 0, 0, 0};   // percentages
+    uint64_t keys = 100000;
+    uint64_t zsets = 10;
+    double zipf = 0;                // the exponent, 0 for uniform
+    size_t value_min = 16;
+    size_t value_max = 16;
+    uint64_t ttl_ms = 60000;
+    uint32_t mget_keys = 100;       // keys per mget
+    double rate = 0;                // requests/s, open-loop if set
+    bool json = false;
+};
+
+static Options g_opt;
+
+// xorshift64*
+static uint64_t g_rng = 0x9E3779B97F4A7C15ull;
+
+static uint64_t rand_u64() {
+    g_rng ^= g_rng >> 12;
+    g_rng ^= g_rng << 25;
+    g_rng ^= g_rng >> 27;
+    return g_rng * 0x2545F4914F6CDD1Dull;
+}
+
+// in [0, 1)
+static double rand_01() {
+    return (double)(rand_u64() >> 11) / (double)((uint64_t)1 << 53);
+}
+
+// Zipfian ranks in [0, n) with the exponent `theta` < 1,
+// the rejection-free method of Gray et al. used by YCSB.
+struct Zipf {
+    uint64_t n = 0;
+    double theta = 0;
+    double zetan = 0;
+    double alpha = 0;
+    double eta = 0;
+};
+
+static void zipf_init(Zipf *z, uint64_t n, double theta) {
+    z->n = n;
+    z->theta = theta;
+    double zeta2 = 1 + pow(0.5, theta);
+    z->zetan = 0;
+    for (uint64_t i = 1; i <= n; ++i) {
+        z->zetan += 1 / pow((double)i, theta);
+    }
+    z->alpha = 1 / (1 - theta);
+    z->eta = (1 - pow(2.0 / (double)n, 1 - theta)) / (1 - zeta2 / z->zetan);
+}
+
+static uint64_t zipf_next(const Zipf *z) {
+    double u = rand_01();
+    double uz = u * z->zetan;
+    if (uz < 1) {
+        return 0;
+    }
+    if (uz < 1 + pow(0.5, z->theta)) {
+        return 1;
+    }
+    uint64_t r = (uint64_t)((double)z->n * pow(z->eta * u - z->eta + 1, z->alpha));
+    return r < z->n ? r : z->n - 1;
+}
+
+static Zipf g_zipf;
+
+static uint64_t next_key() {
+    return g_opt.zipf > 0 ? zipf_next(&g_zipf) : rand_u64() % g_opt.keys;
+}
+
+static uint32_t next_op() {
+    uint32_t r = (uint32_t)(rand_u64() % 100);
+    for (uint32_t op = 0; op < OP_COUNT; ++op) {
+        if (r < g_opt.mix[op]) {
+            return op;
+        }
+        r -= g_opt.mix[op];
+    }
+    return OP_GET;
+}
+
+// a request waiting for its response
+struct Pending {
+    uint64_t start_ns;  // sent, or scheduled in the open-loop mode
+    uint32_t op;
+};
+
+struct Client {
+    int fd = -1;
+    Buffer incoming;
+    Buffer outgoing;
+    std::deque<Pending> inflight;
+    uint32_t poll_events = 0;
+};
+
+struct Stats {
+    Hist ops[OP_COUNT];
+    Hist all;
+    uint64_t errors = 0;
+};
+
+static Stats g_stats;
+static std::string g_value;     // a prefix of it is sent as the value
+
+static void client_queue_mget(Client *c) {
+    std::vector<std::string> keys(g_opt.mget_keys);
+    std::vector<std::string_view> argv(1 + keys.size());
+    argv[0] = "mget";
+    for (size_t i = 0; i < keys.size(); ++i) {
+        keys[i] = "key:" + std::to_string(next_key());
+        argv[1 + i] = keys[i];
+    }
+    std::vector<uint8_t> buf(req_size(argv.data(), argv.size()));
+    req_write(buf.data(), argv.data(), argv.size());
+    buf_append(c->outgoing, buf.data(), buf.size());
+}
+
+// serialize 1 request of `op` into the output buffer
+static void client_queue(Client *c, uint32_t op, uint64_t start_ns) {
+    if (op == OP_MGET) {
+        client_queue_mget(c);
+        c->inflight.push_back(Pending{start_ns, op});
+        return;
+    }
+    char key[32];
+    char arg2[32];
+    char arg3[32];
+    std::string_view argv[6];
+    size_t argc = 0;
+    argv[argc++] = k_op_names[op];
+    switch (op) {
+    case OP_GET:
+    case OP_SET:
+    case OP_PEXPIRE:
+        argv[argc++] = std::string_view(key,
+            (size_t)snprintf(key, sizeof(key), "key:%lu", next_key()));
+        break;
+    case OP_ZADD:
+    case OP_ZQUERY:
+        argv[argc++] = std::string_view(key, (size_t)snprintf(
+            key, sizeof(key), "zset:%lu", rand_u64() % g_opt.zsets));
+        break;
+    case OP_INCR:
+        argv[argc++] = std::string_view(key,
+            (size_t)snprintf(key, sizeof(key), "counter:%lu", next_key()));
+        break;
+    }
+    uint64_t member = next_key();
+    switch (op) {
+    case OP_SET: {
+        size_t span = g_opt.value_max - g_opt.value_min + 1;
+        argv[argc++] = std::string_view(g_value.data(),
+            g_opt.value_min + rand_u64() % span);
+        break;
+    }
+    case OP_PEXPIRE:
+        argv[argc++] = std::string_view(arg2,
+            (size_t)snprintf(arg2, sizeof(arg2), "%lu", g_opt.ttl_ms));
+        break;
+    case OP_ZADD:
+        argv[argc++] = std::string_view(arg2,
+            (size_t)snprintf(arg2, sizeof(arg2), "%lu", member));
+        argv[argc++] = std::string_view(arg3,
+            (size_t)snprintf(arg3, sizeof(arg3), "m:%lu", member));
+        break;
+    case OP_ZQUERY:
+        // 10 members from a random score
+        argv[argc++] = std::string_view(arg2,
+            (size_t)snprintf(arg2, sizeof(arg2), "%lu", member));
+        argv[argc++] = "";
+        argv[argc++] = "0";
+        argv[argc++] = "10";
+        break;
+    }
+    uint8_t buf[256];
+    size_t len = req_size(argv, argc);
+    if (len <= sizeof(buf)) {
+        req_write(buf, argv, argc);
+        buf_append(c->outgoing, buf, len);
+    } else {
+        std::vector<uint8_t> big(len);
+        req_write(big.data(), argv, argc);
+        buf_append(c->outgoing, big.data(), len);
+    }
+    c->inflight.push_back(Pending{start_ns, op});
+}
+
+static void client_update(Poller *poller, Client *c) {
+    uint32_t events = POLLIN | POLLERR;
+    if (buf_size(c->outgoing) > 0) {
+        events |= POLLOUT;
+    }
+    if (events != c->poll_events) {
+        poller_mod(poller, c->fd, events);
+        c->poll_events = events;
+    }
+}
+
+static void client_flush(Client *c) {
+    while (buf_size(c->outgoing) > 0) {
+        ssize_t rv = write(c->fd, buf_data(c->outgoing), buf_size(c->outgoing));
+        if (rv < 0 && errno == EAGAIN) {
+            return;
+        }
+        if (rv <= 0) {
+            die("write()");
+        }
+        buf_consume(c->outgoing, (size_t)rv);
+    }
+}
+
+// returns the number of responses
+static uint64_t client_read(Client *c) {
+    uint64_t done = 0;
+    while (true) {
+        uint8_t buf[64 * 1024];
+        ssize_t rv = read(c->fd, buf, sizeof(buf));
+        if (rv < 0 && errno == EAGAIN) {
+            return done;
+        }
+        if (rv <= 0) {
+            die(rv == 0 ? "server closed the connection" : "read()");
+        }
+        buf_append(c->incoming, buf, (size_t)rv);
+        // the responses in a read have the same timestamp
+        uint64_t now = get_monotonic_nsec();
+        while (buf_size(c->incoming) >= 4) {
+            uint32_t len = 0;
+            memcpy(&len, buf_data(c->incoming), 4);
+            if (buf_size(c->incoming) < 4 + (size_t)len) {
+                break;
+            }
+            const uint8_t *data = buf_data(c->incoming) + 4;
+            if (c->inflight.empty() || res_value_size(data, len) != len) {
+                die("bad response");
+            }
+            Pending p = c->inflight.front();
+            c->inflight.pop_front();
+            uint64_t ns = now > p.start_ns ? now - p.start_ns : 0;
+            hist_add(&g_stats.ops[p.op], ns);
+            hist_add(&g_stats.all, ns);
+            g_stats.errors += (data[0] == TAG_ERR) ? 1 : 0;
+            buf_consume(c->incoming, 4 + (size_t)len);
+            done++;
+        }
+    }
+}
+
+static int connect_to(const Options &opt) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        die("socket()");
+    }
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(opt.port);
+    if (inet_pton(AF_INET, opt.host.c_str(), &addr.sin_addr) != 1) {
+        die("bad host");
+    }
+    if (connect(fd, (const struct sockaddr *)&addr, sizeof(addr))) {
+        die("connect()");
+    }
+    int val = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    return fd;
+}
+
+static double ns2us(uint64_t ns) {
+    return (double)ns / 1000;
+}
+
+static void print_text(double secs, uint64_t done) {
+    printf("%lu requests in %.2fs, %.0f req/s, %lu errors\n",
+        done, secs, (double)done / secs, g_stats.errors);
+    printf("%u conns, ", g_opt.conns);
+    if (g_opt.rate > 0) {
+        printf("open-loop at %.0f req/s, ", g_opt.rate);
+    } else {
+        printf("pipeline %u, ", g_opt.pipeline);
+    }
+    printf("%lu keys %s", g_opt.keys, g_opt.zipf > 0 ? "zipf" : "uniform");
+    if (g_opt.zipf > 0) {
+        printf(":%.2f", g_opt.zipf);
+    }
+    printf(", values %zu-%zu bytes\n", g_opt.value_min, g_opt.value_max);
+    printf("%-8s %10s %9s %9s %9s %9s %9s %9s  (usec)\n",
+        "op", "count", "mean", "p50", "p90", "p99", "p999", "max");
+    for (uint32_t op = 0; op <= OP_COUNT; ++op) {
+        const Hist *h = op < OP_COUNT ? &g_stats.ops[op] : &g_stats.all;
+        if (h->count == 0) {
+            continue;
+        }
+        printf("%-8s %10lu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+            op < OP_COUNT ? k_op_names[op] : "all", h->count,
+            ns2us(h->sum) / (double)h->count,
+            ns2us(hist_quantile(h, 0.5)), ns2us(hist_quantile(h, 0.9)),
+            ns2us(hist_quantile(h, 0.99)), ns2us(hist_quantile(h, 0.999)),
+            ns2us(h->max));
+    }
+}
+
+static void print_hist_json(const Hist *h) {
+    printf("{\"count\": %lu, \"mean_us\": %.2f, \"p50_us\": %.2f, "
+        "\"p90_us\": %.2f, \"p99_us\": %.2f, \"p999_us\": %.2f, "
+        "\"max_us\": %.2f}",
+        h->count, h->count ? ns2us(h->sum) / (double)h->count : 0,
+        ns2us(hist_quantile(h, 0.5)), ns2us(hist_quantile(h, 0.9)),
+        ns2us(hist_quantile(h, 0.99)), ns2us(hist_quantile(h, 0.999)),
+        ns2us(h->max));
+}
+
+static void print_json(double secs, uint64_t done) {
+    printf("{\"requests\": %lu, \"seconds\": %.3f, \"rps\": %.0f, "
+        "\"errors\": %lu, \"conns\": %u, \"pipeline\": %u, \"rate\": %.0f, "
+        "\"keys\": %lu, \"zipf\": %.2f, \"ops\": {",
+        done, secs, (double)done / secs, g_stats.errors, g_opt.conns,
+        g_opt.pipeline, g_opt.rate, g_opt.keys, g_opt.zipf);
+    const char *sep = "";
+    for (uint32_t op = 0; op < OP_COUNT; ++op) {
+        if (g_stats.ops[op].count == 0) {
+            continue;
+        }
+        printf("%s\"%s\": ", sep, k_op_names[op]);
+        print_hist_json(&g_stats.ops[op]);
+        sep = ", ";
+    }
+    printf("}, \"all\": ");
+    print_hist_json(&g_stats.all);
+    printf("}\n");
+}
+
+static void usage() {
+    fprintf(stderr,
+        "Usage: loadgen [--host IP] [--port PORT] [-c CONNS] [-P PIPELINE]\n"
+        "    [-n REQUESTS | -d SECONDS] [--rate REQ_PER_SEC]\n"
+        "    [--mix get=80,set=20,zadd=0,zquery=0,pexpire=0,mget=0,incr=0]\n"
+        "    [--keys N] [--zsets N] [--zipf EXPONENT] [--value-size N|MIN-MAX]\n"
+        "    [--mget-keys N] [--ttl MILLISECONDS] [--json]\n");
+    exit(1);
+}
+
+// get=80,set=20
+static void parse_mix(const char *s) {
+    uint32_t mix[OP_COUNT] = {};
+    uint32_t total = 0;
+    std::string_view rest = s;
+    while (!rest.empty()) {
+        size_t end = rest.find(',');
+        std::string_view item = rest.substr(0, end);
+        rest = end == std::string_view::npos ? "" : rest.substr(end + 1);
+        size_t eq = item.find('=');
+        if (eq == std::string_view::npos) {
+            usage();
+        }
+        uint32_t op = 0;
+        while (op < OP_COUNT && item.substr(0, eq) != k_op_names[op]) {
+            op++;
+        }
+        if (op == OP_COUNT) {
+            usage();
+        }
+        mix[op] = (uint32_t)atoi(std::string(item.substr(eq + 1)).c_str());
+        total += mix[op];
+    }
+    if (total != 100) {
+        fprintf(stderr, "the mix must add up to 100\n");
+        exit(1);
+    }
+    memcpy(g_opt.mix, mix, sizeof(mix));
+}
+
+static void parse_args(int argc, char **argv) {
+    Options &opt = g_opt;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc && arg != "--json") {
+            usage();
+        }
+        if (arg == "--host") {
+            opt.host = argv[++i];
+        } else if (arg == "--port") {
+            opt.port = (uint16_t)atoi(argv[++i]);
+        } else if (arg == "-c") {
+            opt.conns = (uint32_t)atoi(argv[++i]);
+        } else if (arg == "-P") {
+            opt.pipeline = (uint32_t)atoi(argv[++i]);
+        } else if (arg == "-n") {
+            opt.requests = strtoull(argv[++i], NULL, 10);
+        } else if (arg == "-d") {
+            opt.duration = atof(argv[++i]);
+        } else if (arg == "--rate") {
+            opt.rate = atof(argv[++i]);
+        } else if (arg == "--mix") {
+            parse_mix(argv[++i]);
+        } else if (arg == "--keys") {
+            opt.keys = strtoull(argv[++i], NULL, 10);
+        } else if (arg == "--zsets") {
+            opt.zsets = strtoull(argv[++i], NULL, 10);
+        } else if (arg == "--zipf") {
+            opt.zipf = atof(argv[++i]);
+            if (opt.zipf < 0 || opt.zipf >= 1) {
+                fprintf(stderr, "the zipf exponent must be in [0, 1)\n");
+                exit(1);
+            }
+        } else if (arg == "--value-size") {
+            const char *s = argv[++i];
+            opt.value_min = opt.value_max = strtoull(s, NULL, 10);
+            if (const char *dash = strchr(s, '-')) {
+                opt.value_max = strtoull(dash + 1, NULL, 10);
+            }
+        } else if (arg == "--mget-keys") {
+            opt.mget_keys = (uint32_t)atoi(argv[++i]);
+        } else if (arg == "--ttl") {
+            opt.ttl_ms = strtoull(argv[++i], NULL, 10);
+        } else if (arg == "--json") {
+            opt.json = true;
+        } else {
+            usage();
+        }
+    }
+    if (opt.conns == 0 || opt.pipeline == 0 || opt.keys == 0 || opt.zsets == 0
+        || opt.mget_keys == 0
+        || opt.value_min > opt.value_max || opt.value_max > k_max_msg / 2)
+    {
+        usage();
+    }
+}
+
+int main(int argc, char **argv) {
+    parse_args(argc, argv);
+    Options &opt = g_opt;
+    if (opt.zipf > 0) {
+        zipf_init(&g_zipf, opt.keys, opt.zipf);
+    }
+    g_value.assign(opt.value_max, 'v');
+
+    Poller poller;
+    if (!poller_init(&poller, POLLER_EPOLL)) {
+        die("epoll");
+    }
+    std::vector<Client *> clients;
+    std::vector<Client *> fd2client;
+    for (uint32_t i = 0; i < opt.conns; ++i) {
+        Client *c = new Client();
+        c->fd = connect_to(opt);
+        c->poll_events = POLLIN | POLLERR;
+        poller_add(&poller, c->fd, c->poll_events);
+        clients.push_back(c);
+        if (fd2client.size() <= (size_t)c->fd) {
+            fd2client.resize(c->fd + 1);
+        }
+        fd2client[c->fd] = c;
+    }
+
+    uint64_t start = get_monotonic_nsec();
+    uint64_t end = opt.duration > 0 ? start + (uint64_t)(opt.duration * 1e9) : 0;
+    uint64_t limit = opt.duration > 0 ? (uint64_t)-1 : opt.requests;
+    uint64_t interval = opt.rate > 0 ? (uint64_t)(1e9 / opt.rate) : 0;
+    uint64_t sent = 0;
+    uint64_t done = 0;
+    size_t next_client = 0;     // round-robin in the open-loop mode
+    std::vector<PollEvent> events;
+    while (true) {
+        uint64_t now = get_monotonic_nsec();
+        if (end && now >= end) {
+            limit = sent;   // stop sending, wait for the responses
+        }
+        if (done >= limit) {
+            break;
+        }
+        // send what is due
+        if (interval) {
+            // open-loop: requests are sent on schedule regardless of the
+            // responses, and the latency counts from the schedule.
+            while (sent < limit && start + sent * interval <= now) {
+                Client *c = clients[next_client++ % clients.size()];
+                client_queue(c, next_op(), start + sent * interval);
+                sent++;
+            }
+        } else {
+            // closed-loop: keep `pipeline` requests in flight per connection
+            for (Client *c : clients) {
+                while (sent < limit && c->inflight.size() < opt.pipeline) {
+                    client_queue(c, next_op(), now);
+                    sent++;
+                }
+            }
+        }
+        for (Client *c : clients) {
+            client_flush(c);
+            client_update(&poller, c);
+        }
+
+        int timeout_ms = 100;
+        if (interval && sent < limit) {
+            uint64_t due = start + sent * interval;
+            timeout_ms = due > now ? (int)((due - now) / 1000000) : 0;
+        }
+        if (poller_wait(&poller, events, timeout_ms) < 0 && errno != EINTR) {
+            die("poller_wait()");
+        }
+        for (const PollEvent &ev : events) {
+            Client *c = fd2client[ev.fd];
+            if (ev.events & POLLIN) {
+                done += client_read(c);
+            }
+            if (ev.events & POLLOUT) {
+                client_flush(c);
+            }
+            if (ev.events & POLLERR) {
+                die("connection error");
+            }
+        }
+    }
+    double secs = (double)(get_monotonic_nsec() - start) / 1e9;
+    if (opt.json) {
+        print_json(secs, done);
+    } else {
+        print_text(secs, done);
+    }
+    for (Client *c : clients) {
+        close(c->fd);
+        delete c;
+    }
+    return 0;
+}
@@ -0,0 +1,146 @@
+#include <assert.h>
+#include <algorithm>
+#include <utility>
+#include "outbuf.h"
+
+
+OutBuf::~OutBuf() {
+    outbuf_clear(*this);
+}
+
+void outbuf_ref(OutBuf &ob, RcStr *val) {
+    if (val->len == 0) {
+        return;
+    }
+    OutRef ref = {ob.bytes_off + buf_size(ob.bytes), rcstr_ref(val)};
+    ob.refs.push_back(ref);
+    ob.ref_size += val->len;
+}
+
+size_t outbuf_size_since(const OutBuf &ob, size_t pos) {
+    assert(pos <= buf_size(ob.bytes));
+    size_t size = buf_size(ob.bytes) - pos;
+    // the refs at the back are in this range
+    for (auto it = ob.refs.rbegin(); it != ob.refs.rend(); ++it) {
+        if (it->pos <= ob.bytes_off + pos) {
+            break;
+        }
+        size += it->val->len;
+    }
+    return size;
+}
+
+void outbuf_truncate(OutBuf &ob, size_t pos) {
+    while (!ob.refs.empty() && ob.refs.back().pos > ob.bytes_off + pos) {
+        // not sent yet since the bytes before it are not sent
+        OutRef &ref = ob.refs.back();
+        ob.ref_size -= ref.val->len;
+        rcstr_unref(ref.val);
+        ob.refs.pop_back();
+    }
+    buf_truncate(ob.bytes, pos);
+}
+
+void outbuf_move(OutBuf &dst, OutBuf &src) {
+    assert(src.ref_off == 0);
+    if (outbuf_size(dst) == 0) {
+        std::swap(dst.bytes_off, src.bytes_off);
+        std::swap(dst.ref_size, src.ref_size);
+        std::swap(dst.refs, src.refs);
+        buf_swap(dst.bytes, src.bytes);
+        dst.ref_off = 0;
+        return;
+    }
+    uint64_t base = dst.bytes_off + buf_size(dst.bytes);
+    for (OutRef &ref : src.refs) {
+        ref.pos = base + (ref.pos - src.bytes_off);
+        dst.refs.push_back(ref);
+    }
+    dst.ref_size += src.ref_size;
+    buf_append(dst.bytes, buf_data(src.bytes), buf_size(src.bytes));
+    src.refs.clear();
+    src.ref_size = 0;
+    src.bytes_off += buf_size(src.bytes);
+    buf_clear(src.bytes);
+}
+
+void outbuf_flatten(OutBuf &ob, Buffer &dst) {
+    struct iovec iov[64];
+    size_t n = 0;
+    while ((n = outbuf_iov(ob, iov, 64)) > 0) {
+        size_t total = 0;
+        for (size_t i = 0; i < n; ++i) {
+            buf_append(dst, (const uint8_t *)iov[i].iov_base, iov[i].iov_len);
+            total += iov[i].iov_len;
+        }
+        outbuf_consume(ob, total);
+    }
+}
+
+size_t outbuf_iov(const OutBuf &ob, struct iovec *iov, size_t max) {
+    uint8_t *data = ob.bytes.data_begin;
+    size_t n = 0;
+    size_t start = 0;   // in `bytes`
+    size_t ref_off = ob.ref_off;
+    for (const OutRef &ref : ob.refs) {
+        size_t end = (size_t)(ref.pos - ob.bytes_off);
+        if (end > start && n < max) {
+            iov[n].iov_base = data + start;
+            iov[n].iov_len = end - start;
+            n++;
+        }
+        if (n >= max) {
+            return n;
+        }
+        iov[n].iov_base = ref.val->data + ref_off;
+        iov[n].iov_len = ref.val->len - ref_off;
+        n++;
+        start = end;
+        ref_off = 0;
+    }
+    if (buf_size(ob.bytes) > start && n < max) {
+        iov[n].iov_base = data + start;
+        iov[n].iov_len = buf_size(ob.bytes) - start;
+        n++;
+    }
+    return n;
+}
+
+void outbuf_consume(OutBuf &ob, size_t n) {
+    assert(n <= outbuf_size(ob));
+    while (n > 0) {
+        if (!ob.refs.empty() && ob.refs.front().pos == ob.bytes_off) {
+            // the next segment is a ref
+            RcStr *val = ob.refs.front().val;
+            size_t take = std::min(n, val->len - ob.ref_off);
+            ob.ref_off += take;
+            ob.ref_size -= take;
+            n -= take;
+            if (ob.ref_off == val->len) {
+                rcstr_unref(val);
+                ob.refs.pop_front();
+                ob.ref_off = 0;
+            }
+            continue;
+        }
+        size_t avail = buf_size(ob.bytes);
+        if (!ob.refs.empty()) {
+            avail = (size_t)(ob.refs.front().pos - ob.bytes_off);
+        }
+        size_t take = std::min(n, avail);
+        buf_consume(ob.bytes, take);
+        ob.bytes_off += take;
+        n -= take;
+    }
+}
+
+void outbuf_clear(OutBuf &ob) {
+    for (OutRef &ref : ob.refs) {
+        rcstr_unref(ref.val);
+    }
+    ob.refs.clear();
+    ob.bytes_off += buf_size(ob.bytes);
+    buf_clear(ob.bytes);
+    ob.ref_off = 0;
+    ob.ref_size = 0;
+}
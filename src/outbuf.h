@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <deque>
+#include "buffer.h"
+#include "rcstr.h"
+
+
+// a value referenced by the output, it goes after the byte at
+// the absolute offset `pos - 1` of `OutBuf::bytes`.
+struct OutRef {
+    uint64_t pos;
+    RcStr *val;
+};
+
+// Outgoing data as a sequence of segments: serialized bytes are copied into
+// `bytes`, large values are referenced in place and sent with writev().
+struct OutBuf {
+    Buffer bytes;
+    std::deque<OutRef> refs;
+    uint64_t bytes_off = 0;     // the absolute offset of the first byte
+    size_t ref_off = 0;         // bytes of `refs.front()` already sent
+    size_t ref_size = 0;        // unsent bytes in `refs`
+
+    OutBuf() {}
+    ~OutBuf();
+    OutBuf(const OutBuf &) = delete;
+    OutBuf &operator=(const OutBuf &) = delete;
+};
+
+// the number of unsent bytes
+inline size_t outbuf_size(const OutBuf &ob) {
+    return buf_size(ob.bytes) + ob.ref_size;
+}
+
+// copy to the back
+inline void outbuf_append(OutBuf &ob, const uint8_t *data, size_t len) {
+    buf_append(ob.bytes, data, len);
+}
+// reference the value instead of copying it
+void outbuf_ref(OutBuf &ob, RcStr *val);
+// the size of the data after the first `pos` bytes of `bytes`
+size_t outbuf_size_since(const OutBuf &ob, size_t pos);
+// keep the data up to the first `pos` bytes of `bytes`
+void outbuf_truncate(OutBuf &ob, size_t pos);
+// move all data from `src` to the back of `dst`
+void outbuf_move(OutBuf &dst, OutBuf &src);
+// copy all data into a contiguous buffer
+void outbuf_flatten(OutBuf &ob, Buffer &dst);
+// the unsent data as iovecs, returns the number of iovecs
+size_t outbuf_iov(const OutBuf &ob, struct iovec *iov, size_t max);
+// remove sent data from the front
+void outbuf_consume(OutBuf &ob, size_t n);
+void outbuf_clear(OutBuf &ob);
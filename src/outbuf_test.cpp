@@ -0,0 +1,90 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string>
+#include "buffer.cpp"
+#include "outbuf.cpp"
+
+// the expected unsent data
+struct Container {
+    OutBuf ob;
+    std::string ref;
+};
+
+static void verify(Container &c) {
+    assert(outbuf_size(c.ob) == c.ref.size());
+    struct iovec iov[4];    // small, to test the truncation
+    size_t n = outbuf_iov(c.ob, iov, 4);
+    size_t pos = 0;
+    for (size_t i = 0; i < n; ++i) {
+        assert(iov[i].iov_len > 0);
+        assert(pos + iov[i].iov_len <= c.ref.size());
+        assert(memcmp(iov[i].iov_base, &c.ref[pos], iov[i].iov_len) == 0);
+        pos += iov[i].iov_len;
+    }
+    assert(n == 4 || pos == c.ref.size());
+    Buffer flat;
+    OutBuf copy;
+    outbuf_move(copy, c.ob);
+    outbuf_flatten(copy, flat);
+    assert(std::string((char *)buf_data(flat), buf_size(flat)) == c.ref);
+    // restore
+    outbuf_append(c.ob, buf_data(flat), buf_size(flat));
+}
+
+static void add_bytes(Container &c, size_t len) {
+    std::string s(len, 'a' + rand() % 26);
+    outbuf_append(c.ob, (const uint8_t *)s.data(), s.size());
+    c.ref += s;
+}
+
+static void add_ref(Container &c, size_t len) {
+    std::string s(len, 'A' + rand() % 26);
+    RcStr *val = rcstr_new(s.data(), s.size());
+    outbuf_ref(c.ob, val);
+    rcstr_unref(val);   // still referenced by the output
+    c.ref += s;
+}
+
+static void consume(Container &c, size_t n) {
+    outbuf_consume(c.ob, n);
+    c.ref.erase(0, n);
+}
+
+static void test_truncate() {
+    Container c;
+    add_bytes(c, 3);
+    add_ref(c, 5);
+    size_t pos = buf_size(c.ob.bytes);
+    add_bytes(c, 2);
+    add_ref(c, 7);
+    add_bytes(c, 1);
+    assert(outbuf_size_since(c.ob, pos) == 2 + 7 + 1);
+    outbuf_truncate(c.ob, pos);
+    c.ref.resize(8);
+    assert(outbuf_size(c.ob) == 8);
+    consume(c, 4);
+    assert(c.ob.ref_off == 1);
+    assert(outbuf_size_since(c.ob, 0) == 0);    // the ref is before it
+    add_bytes(c, 2);
+    consume(c, 4);
+    assert(c.ob.refs.empty());
+    assert(outbuf_size(c.ob) == 2);
+}
+
+static void test_random() {
+    Container c;
+    for (uint32_t i = 0; i < 5000; ++i) {
+        switch (rand() % 4) {
+        case 0: add_bytes(c, rand() % 20); break;
+        case 1: add_ref(c, 1 + rand() % 20); break;
+        default: consume(c, c.ref.empty() ? 0 : rand() % (c.ref.size() + 1));
+        }
+        verify(c);
+    }
+}
+
+int main() {
+    test_truncate();
+    test_random();
+    return 0;
+}
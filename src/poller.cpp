@@ -0,0 +1,128 @@
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include "poller.h"
+
+
+const size_t k_max_events = 1024;   // per epoll_wait()
+
+static uint32_t to_epoll(uint32_t events) {
+    uint32_t ev = EPOLLET;
+    if (events & POLLIN) {
+        ev |= EPOLLIN;
+    }
+    if (events & POLLOUT) {
+        ev |= EPOLLOUT;
+    }
+    return ev;  // EPOLLERR and EPOLLHUP are always reported
+}
+
+static uint32_t from_epoll(uint32_t ev) {
+    uint32_t events = 0;
+    if (ev & EPOLLIN) {
+        events |= POLLIN;
+    }
+    if (ev & EPOLLOUT) {
+        events |= POLLOUT;
+    }
+    if (ev & EPOLLERR) {
+        events |= POLLERR;
+    }
+    if (ev & EPOLLHUP) {
+        events |= POLLHUP;
+    }
+    return events;
+}
+
+bool poller_init(Poller *p, int backend) {
+    p->backend = backend;
+    if (backend == POLLER_EPOLL) {
+        p->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (p->epfd < 0) {
+            return false;
+        }
+        p->ep_events.resize(k_max_events);
+    }
+    return true;
+}
+
+bool poller_edge_triggered(Poller *p) {
+    return p->backend == POLLER_EPOLL;
+}
+
+void poller_add(Poller *p, int fd, uint32_t events) {
+    if (p->backend == POLLER_EPOLL) {
+        struct epoll_event ev = {};
+        ev.events = to_epoll(events);
+        ev.data.fd = fd;
+        int rv = epoll_ctl(p->epfd, EPOLL_CTL_ADD, fd, &ev);
+        assert(rv == 0);
+        (void)rv;
+        return;
+    }
+    if (p->fd2idx.size() <= (size_t)fd) {
+        p->fd2idx.resize(fd + 1, -1);
+    }
+    assert(p->fd2idx[fd] < 0);
+    p->fd2idx[fd] = (int)p->pfds.size();
+    struct pollfd pfd = {fd, (short)events, 0};
+    p->pfds.push_back(pfd);
+}
+
+void poller_mod(Poller *p, int fd, uint32_t events) {
+    if (p->backend == POLLER_EPOLL) {
+        // this also re-arms the edge-triggered readiness
+        struct epoll_event ev = {};
+        ev.events = to_epoll(events);
+        ev.data.fd = fd;
+        int rv = epoll_ctl(p->epfd, EPOLL_CTL_MOD, fd, &ev);
+        assert(rv == 0);
+        (void)rv;
+        return;
+    }
+    assert((size_t)fd < p->fd2idx.size() && p->fd2idx[fd] >= 0);
+    p->pfds[p->fd2idx[fd]].events = (short)events;
+}
+
+void poller_del(Poller *p, int fd) {
+    if (p->backend == POLLER_EPOLL) {
+        (void)epoll_ctl(p->epfd, EPOLL_CTL_DEL, fd, NULL);
+        return;
+    }
+    assert((size_t)fd < p->fd2idx.size() && p->fd2idx[fd] >= 0);
+    // swap with the last item
+    size_t idx = (size_t)p->fd2idx[fd];
+    p->pfds[idx] = p->pfds.back();
+    p->fd2idx[p->pfds[idx].fd] = (int)idx;
+    p->pfds.pop_back();
+    p->fd2idx[fd] = -1;
+}
+
+int poller_wait(Poller *p, std::vector<PollEvent> &out, int timeout_ms) {
+    out.clear();
+    if (p->backend == POLLER_EPOLL) {
+        int rv = epoll_wait(
+            p->epfd, p->ep_events.data(), (int)p->ep_events.size(), timeout_ms);
+        for (int i = 0; i < rv; ++i) {
+            PollEvent ev;
+            ev.fd = p->ep_events[i].data.fd;
+            ev.events = from_epoll(p->ep_events[i].events);
+            out.push_back(ev);
+        }
+        return rv;
+    }
+    int rv = poll(p->pfds.data(), (nfds_t)p->pfds.size(), timeout_ms);
+    for (size_t i = 0; rv > 0 && i < p->pfds.size(); ++i) {
+        if (p->pfds[i].revents) {
+            PollEvent ev;
+            ev.fd = p->pfds[i].fd;
+            ev.events = (uint16_t)p->pfds[i].revents;
+            out.push_back(ev);
+        }
+    }
+    return rv < 0 ? rv : (int)out.size();
+}
+
+const char *poller_name(Poller *p) {
+    return p->backend == POLLER_EPOLL ? "epoll" : "poll";
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <vector>
+
+
+// event loop backends
+enum {
+    POLLER_POLL  = 0,   // poll(), level-triggered
+    POLLER_EPOLL = 1,   // epoll, edge-triggered
+};
+
+// a ready fd. `events` uses the poll() flags: POLLIN, POLLOUT, POLLERR, ...
+struct PollEvent {
+    int fd = -1;
+    uint32_t events = 0;
+};
+
+// The interest set is kept by the backend, so the event loop only
+// touches an fd when its interest changes, and only ready fds are returned.
+struct Poller {
+    int backend = POLLER_POLL;
+    // epoll
+    int epfd = -1;
+    std::vector<struct epoll_event> ep_events;
+    // poll(): a persistent array instead of rebuilding it per iteration
+    std::vector<struct pollfd> pfds;
+    std::vector<int> fd2idx;    // fd -> index into `pfds`, -1 if absent
+};
+
+// returns false if the backend is not available
+bool poller_init(Poller *p, int backend);
+// with the epoll backend, fds are edge-triggered: the caller must drain
+// the fd (until EAGAIN or a short read/write) before waiting again.
+bool poller_edge_triggered(Poller *p);
+void poller_add(Poller *p, int fd, uint32_t events);
+void poller_mod(Poller *p, int fd, uint32_t events);
+void poller_del(Poller *p, int fd);
+// returns the number of ready fds, or -1 with `errno` set
+int  poller_wait(Poller *p, std::vector<PollEvent> &out, int timeout_ms);
+const char *poller_name(Poller *p);
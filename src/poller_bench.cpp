@@ -0,0 +1,144 @@
+// Event loop cost versus the number of idle connections.
+// g++ -std=c++11 -O2 poller_bench.cpp poller.cpp -o poller_bench
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <vector>
+#include "poller.h"
+
+
+static uint64_t get_monotonic_nsec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+struct Pair {
+    int fds[2];
+};
+
+// 1 active connection + `idle` idle connections
+static std::vector<Pair> make_pairs(size_t idle) {
+    std::vector<Pair> pairs(idle + 1);
+    for (Pair &p : pairs) {
+        int rv = socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, p.fds);
+        assert(rv == 0);
+        (void)rv;
+    }
+    return pairs;
+}
+
+static void close_pairs(std::vector<Pair> &pairs) {
+    for (Pair &p : pairs) {
+        close(p.fds[0]);
+        close(p.fds[1]);
+    }
+}
+
+// 1 round trip on the active connection
+static void ping(const Pair &active) {
+    char c = 'x';
+    ssize_t rv = write(active.fds[1], &c, 1);
+    assert(rv == 1);
+    (void)rv;
+}
+
+static void pong(int fd) {
+    char c = 0;
+    ssize_t rv = read(fd, &c, 1);
+    assert(rv == 1);
+    (void)rv;
+}
+
+// the old event loop: rebuild the pollfd array and scan it every iteration
+static double bench_rebuild(std::vector<Pair> &pairs, size_t iters) {
+    std::vector<int> fd2conn;   // stands for `g_data.fd2conn`
+    for (Pair &p : pairs) {
+        if (fd2conn.size() <= (size_t)p.fds[0]) {
+            fd2conn.resize(p.fds[0] + 1, -1);
+        }
+        fd2conn[p.fds[0]] = p.fds[0];
+    }
+    std::vector<struct pollfd> poll_args;
+    uint64_t start = get_monotonic_nsec();
+    for (size_t i = 0; i < iters; ++i) {
+        ping(pairs[0]);
+        poll_args.clear();
+        for (int fd : fd2conn) {
+            if (fd < 0) {
+                continue;
+            }
+            struct pollfd pfd = {fd, POLLIN | POLLERR, 0};
+            poll_args.push_back(pfd);
+        }
+        int rv = poll(poll_args.data(), (nfds_t)poll_args.size(), -1);
+        assert(rv == 1);
+        (void)rv;
+        for (const struct pollfd &pfd : poll_args) {
+            if (pfd.revents) {
+                pong(pfd.fd);
+            }
+        }
+    }
+    return double(get_monotonic_nsec() - start) / iters;
+}
+
+static double bench_poller(int backend, std::vector<Pair> &pairs, size_t iters) {
+    Poller p;
+    bool ok = poller_init(&p, backend);
+    assert(ok);
+    (void)ok;
+    for (Pair &pair : pairs) {
+        poller_add(&p, pair.fds[0], POLLIN | POLLERR);
+    }
+    std::vector<PollEvent> events;
+    uint64_t start = get_monotonic_nsec();
+    for (size_t i = 0; i < iters; ++i) {
+        ping(pairs[0]);
+        int rv = poller_wait(&p, events, -1);
+        assert(rv == 1);
+        (void)rv;
+        for (const PollEvent &ev : events) {
+            pong(ev.fd);
+        }
+    }
+    double ns = double(get_monotonic_nsec() - start) / iters;
+    for (Pair &pair : pairs) {
+        poller_del(&p, pair.fds[0]);
+    }
+    if (p.epfd >= 0) {
+        close(p.epfd);
+    }
+    return ns;
+}
+
+int main() {
+    // 2 fds per connection
+    struct rlimit lim = {};
+    getrlimit(RLIMIT_NOFILE, &lim);
+    lim.rlim_cur = lim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &lim);
+    size_t max_idle = (lim.rlim_cur - 64) / 2;
+
+    const size_t sizes[] = {0, 100, 1000, 5000, 10000, 50000};
+    printf("%10s %16s %16s %16s\n",
+        "idle", "poll-rebuild ns", "poll ns", "epoll ns");
+    for (size_t idle : sizes) {
+        if (idle > max_idle) {
+            fprintf(stderr, "skipping %zu idle connections (RLIMIT_NOFILE)\n",
+                idle);
+            continue;
+        }
+        std::vector<Pair> pairs = make_pairs(idle);
+        size_t iters = idle >= 1000 ? 2000 : 20000;
+        double rebuild = bench_rebuild(pairs, iters);
+        double polled = bench_poller(POLLER_POLL, pairs, iters);
+        double epolled = bench_poller(POLLER_EPOLL, pairs, iters);
+        printf("%10zu %16.0f %16.0f %16.0f\n", idle, rebuild, polled, epolled);
+        close_pairs(pairs);
+    }
+    return 0;
+}
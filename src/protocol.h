@@ -0,0 +1,103 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+
+// The wire protocol, little endian. Each message has a 4-byte length.
+// A request is a list of strings:
+// +-----+------+-----+------+-----+-----+------+
+// | len | nstr | len | str1 | ... | len | strn |
+// +-----+------+-----+------+-----+-----+------+
+// A response is 1 tagged value, an array nests other values.
+const size_t k_max_msg = 32 << 20;  // likely larger than the kernel buffer
+
+// error code for TAG_ERR
+enum {
+    ERR_UNKNOWN = 1,    // unknown command
+    ERR_TOO_BIG = 2,    // response too big
+    ERR_BAD_TYP = 3,    // unexpected value type
+    ERR_BAD_ARG = 4,    // bad arguments
+};
+
+// data types of serialized data
+enum {
+    TAG_NIL = 0,    // nil
+    TAG_ERR = 1,    // error code + msg
+    TAG_STR = 2,    // string
+    TAG_INT = 3,    // int64
+    TAG_DBL = 4,    // double
+    TAG_ARR = 5,    // array
+};
+
+// the size of a request message, including the length;
+// `S` is anything with data() and size()
+template <class S>
+size_t req_size(const S *argv, size_t argc) {
+    size_t len = 4 + 4;
+    for (size_t i = 0; i < argc; ++i) {
+        len += 4 + argv[i].size();
+    }
+    return len;
+}
+
+// serialize a request of req_size() bytes
+template <class S>
+void req_write(uint8_t *dst, const S *argv, size_t argc) {
+    uint32_t len = (uint32_t)(req_size(argv, argc) - 4);
+    uint32_t n = (uint32_t)argc;
+    memcpy(&dst[0], &len, 4);
+    memcpy(&dst[4], &n, 4);
+    dst += 8;
+    for (size_t i = 0; i < argc; ++i) {
+        uint32_t sz = (uint32_t)argv[i].size();
+        memcpy(dst, &sz, 4);
+        memcpy(dst + 4, argv[i].data(), sz);
+        dst += 4 + sz;
+    }
+}
+
+// the size of the serialized value at `data`, or -1 if it's incomplete
+inline int64_t res_value_size(const uint8_t *data, size_t size) {
+    if (size < 1) {
+        return -1;
+    }
+    uint32_t len = 0;
+    switch (data[0]) {
+    case TAG_NIL:
+        return 1;
+    case TAG_INT:
+    case TAG_DBL:
+        return size < 1 + 8 ? -1 : 1 + 8;
+    case TAG_ERR:
+        if (size < 1 + 8) {
+            return -1;
+        }
+        memcpy(&len, &data[1 + 4], 4);
+        return size < 1 + 8 + (size_t)len ? -1 : 1 + 8 + (int64_t)len;
+    case TAG_STR:
+        if (size < 1 + 4) {
+            return -1;
+        }
+        memcpy(&len, &data[1], 4);
+        return size < 1 + 4 + (size_t)len ? -1 : 1 + 4 + (int64_t)len;
+    case TAG_ARR: {
+        if (size < 1 + 4) {
+            return -1;
+        }
+        memcpy(&len, &data[1], 4);
+        size_t pos = 1 + 4;
+        for (uint32_t i = 0; i < len; ++i) {
+            int64_t n = res_value_size(&data[pos], size - pos);
+            if (n < 0) {
+                return -1;
+            }
+            pos += (size_t)n;
+        }
+        return (int64_t)pos;
+    }
+    default:
+        return -1;
+    }
+}
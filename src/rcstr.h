@@ -0,0 +1,41 @@
+#pragma once
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <new>
+
+
+// A reference-counted immutable string.
+// The keyspace holds 1 reference and the responses being sent hold the
+// others, so an overwritten or deleted value lives until it's sent.
+// The count is atomic since I/O threads drop the references of sent data.
+struct RcStr {
+    std::atomic<uint32_t> refs;
+    uint32_t len;
+    char data[0];   // flexible array
+};
+
+inline RcStr *rcstr_new(const char *data, size_t len) {
+    assert(len <= UINT32_MAX);
+    RcStr *s = (RcStr *)malloc(sizeof(RcStr) + len);
+    assert(s);
+    new (&s->refs) std::atomic<uint32_t>(1);
+    s->len = (uint32_t)len;
+    memcpy(s->data, data, len);
+    return s;
+}
+
+inline RcStr *rcstr_ref(RcStr *s) {
+    s->refs.fetch_add(1, std::memory_order_relaxed);
+    return s;
+}
+
+inline void rcstr_unref(RcStr *s) {
+    if (s->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        free(s);
+    }
+}
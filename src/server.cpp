@@ -5,25 +5,44 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
-#include <math.h>   // isnan
+#include <math.h>
+#include <stdarg.h>
+#include <malloc.h>
 // system
 #include <time.h>
 #include <fcntl.h>
-#include <poll.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/ip.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/random.h>
 // C++
+#include <charconv>
 #include <string>
+#include <string_view>
 #include <vector>
 // proj
 #include "common.h"
 #include "hashtable.h"
 #include "zset.h"
 #include "list.h"
-#include "heap.h"
+#include "timer_wheel.h"
+#include "buffer.h"
+#include "outbuf.h"
 #include "thread_pool.h"
+#include "poller.h"
+#include "uring.h"
+#include "spsc.h"
+#include "protocol.h"
+#include "command.h"
+#include "hist.h"
+#include "slowlog.h"
 
 
 static void msg(const char *msg) {
@@ -39,10 +58,16 @@ static void die(const char *msg) {
     abort();
 }
 
-static uint64_t get_monotonic_msec() {
+static uint64_t get_monotonic_nsec() {
     struct timespec tv = {0, 0};
     clock_gettime(CLOCK_MONOTONIC, &tv);
-    return uint64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000 / 1000;
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+static uint64_t get_monotonic_usec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
 }
 
 static void fd_set_nb(int fd) {
@@ -62,88 +87,347 @@ static void fd_set_nb(int fd) {
     }
 }
 
-const size_t k_max_msg = 32 << 20;  // likely larger than the kernel buffer
+const size_t k_max_iov = 64;        // per writev()
 
-typedef std::vector<uint8_t> Buffer;
+struct Loop;
+struct IOThread;
+struct ReqBatch;
 
-// append to the back
-static void buf_append(Buffer &buf, const uint8_t *data, size_t len) {
-    buf.insert(buf.end(), data, data + len);
-}
-// remove from the front
-static void buf_consume(Buffer &buf, size_t n) {
-    buf.erase(buf.begin(), buf.begin() + n);
-}
+// connection classes, each with its own idle timeout
+enum {
+    CONN_REMOTE = 0,
+    CONN_LOCAL = 1,     // from a loopback address
+    CONN_CLASSES,
+};
 
 struct Conn {
     int fd = -1;
+    uint32_t id = 0;            // tells apart connections reusing an fd
+    Loop *loop = NULL;          // the event loop that owns this connection
+    uint32_t conn_class = CONN_REMOTE;
+    IOThread *io = NULL;        // the owner in the threaded I/O mode
+    ReqBatch *batch = NULL;     // requests being executed by the main thread
     // application's intention, for the event loop
     bool want_read = false;
     bool want_write = false;
     bool want_close = false;
+    // the interest currently registered in the event loop
+    uint32_t poll_events = 0;
+    // io_uring backend
+    OutBuf sending;             // the in-flight send; must not move
+    std::vector<struct iovec> send_iov;
+    struct msghdr send_msg = {};
+    uint32_t inflight = 0;      // submitted ops that haven't completed
+    bool send_queued = false;   // in the batch of sends
+    bool cancelled = false;     // all ops are cancelled; closing
+    bool recv_active = false;   // the multishot recv hasn't terminated
+    bool recv_cancelled = false;
+    // multi-shard: replies from other shards for the current request
+    uint32_t waiting = 0;       // don't process more requests until 0
+    bool gather = false;        // merge the array replies of all shards
+    uint32_t gather_n = 0;
+    Buffer gather_buf;
+    bool split = false;         // a multi-key request split by shard
+    std::vector<uint32_t> split_owners; // the shard of each key
+    std::vector<Buffer> split_res;      // the reply of each shard
+    // output buffer limits
+    bool read_paused = false;   // over the watermark, see conn_resume()
+    uint64_t soft_since_ms = 0; // when it went over the soft limit
     // buffered input and output
     Buffer incoming;    // data to be parsed by the application
-    Buffer outgoing;    // responses generated by the application
-    // timer
+    uint64_t read_ns = 0;   // the loop time of the last read, for the queue time
+    Args args;          // the current request, reused to avoid allocations
+    OutBuf outgoing;    // responses generated by the application
+    // timer; touching only updates `last_active_ms`, the wheel timer is
+    // moved lazily when it fires.
     uint64_t last_active_ms = 0;
-    DList idle_node;
+    uint64_t idle_timeout_ms = 0;   // 0 means no timeout
+    WheelTimer idle_timer;
+    // in `Loop::write_list`; self-linked if not
+    DList write_node;
 };
 
-// global states
-static struct {
-    HMap db;
+// the per event loop states. The main thread has one, and each I/O thread
+// has its own in the threaded I/O mode.
+struct Loop {
+    // the event loop backend
+    Poller poller;
     // a map of all client connections, keyed by fd
     std::vector<Conn *> fd2conn;
+    // the cached clock, see loop_update_time()
+    uint64_t now_ms = 0;
+    uint64_t now_ns = 0;
     // timers for idle connections
-    DList idle_list;
+    TimerWheel idle_wheel;
+    // connections with responses to flush at the end of the iteration
+    DList write_list;
+    uint32_t next_conn_id = 0;
+};
+
+// the calls of a command, and the latency of the sampled calls
+struct CmdStats {
+    uint64_t calls = 0;
+    uint64_t rejected = 0;  // bad arguments
+    Hist exec;              // the handler
+    Hist queue;             // from reading the request to executing it
+};
+
+// requests framed and parsed by an I/O thread, executed by the main thread
+struct ReqBatch {
+    Conn *conn = NULL;  // only touched by the I/O thread
+    // the arguments of all requests back to back, pointing into
+    // `conn->incoming`, which is consumed when the batch is finished.
+    Args args;
+    std::vector<uint32_t> nargs;    // the number of arguments per request
+    std::vector<size_t> ends;       // the end of each request in `incoming`
+    uint64_t read_ns = 0;           // see `Conn::read_ns`
+    int fd = -1;                    // the client, for the slowlog
+    // the main thread stops early above the output watermark
+    size_t executed = 0;
+    OutBuf out;         // responses from the main thread
+};
+
+// The keyspace stays single-writer: I/O threads only own the sockets,
+// and exchange batches with the main thread through lock-free queues.
+// buffer memory of the clients in a loop
+struct ClientStats {
+    uint64_t clients = 0;
+    uint64_t paused = 0;
+    uint64_t in_bytes = 0;
+    uint64_t in_cap = 0;
+    uint64_t out_bytes = 0;     // unsent, including referenced values
+    uint64_t out_cap = 0;
+    uint64_t max_out = 0;
+};
+
+// a socket accepted by the main thread
+struct NewConn {
+    int fd = -1;
+    uint32_t conn_class = CONN_REMOTE;
+};
+
+struct IOThread {
+    pthread_t thread;
+    Loop loop;
+    int efd = -1;                       // wakes up this thread
+    SPSCQueue<NewConn> accepted;        // main -> I/O: new sockets
+    SPSCQueue<ReqBatch *> requests;     // I/O -> main
+    SPSCQueue<ReqBatch *> responses;    // main -> I/O
+    bool submitted = false;             // the main thread needs a wake up
+    // a snapshot of `loop` for the main thread
+    pthread_mutex_t stats_mu = PTHREAD_MUTEX_INITIALIZER;
+    ClientStats stats;
+    uint64_t stats_ms = 0;
+};
+
+// global states
+static struct {
+    HMap db;
+    // the main event loop
+    Loop loop;
+    Uring uring;    // used instead of `loop.poller` if initialized
     // timers for TTLs
-    std::vector<HeapItem> heap;
+    HTimerWheel ttl_wheel;
+    // active expiry, see process_ttl_timers()
+    uint32_t expire_cpu_pct = 25;       // the target share of the event loop
+    uint64_t expire_cycle_end_us = 0;
+    double expire_ns_per_key = 1000;    // measured, a moving average
+    uint64_t expired_keys = 0;          // by the timers
+    uint64_t expired_on_access = 0;
+    uint64_t expire_lag_ms = 0;         // the oldest key waiting for deletion
+    uint64_t expire_max_lag_ms = 0;
+    // background rehashing, see process_rehashing()
+    DList rehash_zsets;                 // zsets whose hashtable is rehashing
+    size_t rehash_nzsets = 0;
+    uint64_t rehash_step_end_us = 0;
+    uint64_t rehash_bg_keys = 0;        // migrated by the event loop
+    uint64_t rehash_bg_us = 0;
+    // reused by requests that don't come from a connection
+    Args args;
+    // per-command statistics by the index in `k_commands`
+    std::vector<CmdStats> cmd_stats;
+    // time 1 of every N fast commands, 0 for none; slow ones are always timed
+    uint32_t latency_sample = 16;
+    uint32_t latency_countdown = 0;
+    Slowlog slowlog;
+    // idle timeouts in milliseconds by connection class, 0 means no timeout
+    uint64_t idle_timeout_ms[CONN_CLASSES] = {5 * 1000, 5 * 1000};
+    // output buffer limits in bytes, 0 means no limit
+    size_t out_watermark = 1 << 20;     // stop reading and parsing above it
+    size_t out_hard_limit = 64 << 20;   // disconnect above it
+    size_t out_soft_limit = 16 << 20;   // disconnect if above it for too long
+    uint64_t out_soft_ms = 10 * 1000;
+    std::atomic<uint64_t> closed_hard{0};
+    std::atomic<uint64_t> closed_soft{0};
     // the thread pool
     TheadPool thread_pool;
+    // threaded I/O
+    std::vector<IOThread *> io_threads;
+    size_t next_io_thread = 0;  // round-robin assignment
+    int efd = -1;               // wakes up the main thread
+    // multi-shard: 1 process per shard, the keyspace is partitioned
+    uint32_t shard_id = 0;
+    uint32_t nshards = 1;
+    std::vector<int> shard_efds;        // wakes up each shard
+    std::vector<SPSCBytes *> rings;     // [src * nshards + dst]
+    std::vector<Buffer> outbox;         // unsent bytes to each shard
+    std::vector<Buffer> inbox;          // incomplete messages from each shard
 } g_data;
 
-// application callback when the listening socket is ready
-static int32_t handle_accept(int fd) {
-    // accept
-    struct sockaddr_in client_addr = {};
-    socklen_t addrlen = sizeof(client_addr);
-    int connfd = accept(fd, (struct sockaddr *)&client_addr, &addrlen);
-    if (connfd < 0) {
-        msg_errno("accept() error");
-        return -1;
+// sync the application's intention to the event loop, only when changed
+static void conn_update_events(Conn *conn) {
+    uint32_t events = POLLERR;  // always poll() for error
+    if (conn->want_read) {
+        events |= POLLIN;
+    }
+    if (conn->want_write) {
+        events |= POLLOUT;
     }
+    if (events != conn->poll_events) {
+        poller_mod(&conn->loop->poller, conn->fd, events);
+        conn->poll_events = events;
+    }
+}
+
+// idle timers: 100ms resolution, 1 rotation is 25.6s
+const size_t k_idle_wheel_slots = 256;
+const uint64_t k_idle_wheel_tick_ms = 100;
+
+// the clock is read once per event loop iteration instead of once per event
+static void loop_update_time(Loop *loop) {
+    loop->now_ns = get_monotonic_nsec();
+    loop->now_ms = loop->now_ns / 1000000;
+}
+
+static void loop_init(Loop *loop) {
+    dlist_init(&loop->write_list);
+    loop_update_time(loop);
+    wheel_init(&loop->idle_wheel,
+        k_idle_wheel_slots, k_idle_wheel_tick_ms, loop->now_ms);
+}
+
+static uint32_t conn_class_of(const struct sockaddr_in &client_addr) {
+    uint32_t ip = ntohl(client_addr.sin_addr.s_addr);
+    return (ip >> 24) == 127 ? CONN_LOCAL : CONN_REMOTE;
+}
+
+static void log_new_client(const struct sockaddr_in &client_addr) {
     uint32_t ip = client_addr.sin_addr.s_addr;
     fprintf(stderr, "new client from %u.%u.%u.%u:%u\n",
         ip & 255, (ip >> 8) & 255, (ip >> 16) & 255, ip >> 24,
         ntohs(client_addr.sin_port)
     );
+}
 
-    // set the new connection fd to nonblocking mode
-    fd_set_nb(connfd);
-
-    // create a `struct Conn`
+// create a `struct Conn` for an accepted socket
+static Conn *conn_new(Loop *loop, int connfd, uint32_t conn_class) {
     Conn *conn = new Conn();
     conn->fd = connfd;
+    conn->id = ++loop->next_conn_id;
+    conn->loop = loop;
+    conn->conn_class = conn_class;
     conn->want_read = true;
-    conn->last_active_ms = get_monotonic_msec();
-    dlist_insert_before(&g_data.idle_list, &conn->idle_node);
+    conn->last_active_ms = loop->now_ms;
+    conn->idle_timeout_ms = g_data.idle_timeout_ms[conn_class];
+    wheel_timer_init(&conn->idle_timer);
+    if (conn->idle_timeout_ms) {
+        conn->idle_timer.expire_ms = conn->last_active_ms + conn->idle_timeout_ms;
+        wheel_add(&loop->idle_wheel, &conn->idle_timer);
+    }
+    dlist_init(&conn->write_node);
 
     // put it into the map
-    if (g_data.fd2conn.size() <= (size_t)conn->fd) {
-        g_data.fd2conn.resize(conn->fd + 1);
+    if (loop->fd2conn.size() <= (size_t)conn->fd) {
+        loop->fd2conn.resize(conn->fd + 1);
+    }
+    assert(!loop->fd2conn[conn->fd]);
+    loop->fd2conn[conn->fd] = conn;
+    return conn;
+}
+
+// register it in the event loop
+static void conn_register(Conn *conn) {
+    conn->poll_events = POLLERR | POLLIN;
+    poller_add(&conn->loop->poller, conn->fd, conn->poll_events);
+}
+
+static void wake_up(int efd) {
+    (void)eventfd_write(efd, 1);
+}
+
+// the queues are sized for the number of connections, spin if full
+template <class T>
+static void spsc_push_wait(SPSCQueue<T> *q, const T &item) {
+    while (!spsc_push(q, item)) {
+        sched_yield();
+    }
+}
+
+// accept 1 connection
+static int32_t accept_one(int fd) {
+    // accept
+    struct sockaddr_in client_addr = {};
+    socklen_t addrlen = sizeof(client_addr);
+    int connfd = accept(fd, (struct sockaddr *)&client_addr, &addrlen);
+    if (connfd < 0) {
+        if (errno != EAGAIN) {
+            msg_errno("accept() error");
+        }
+        return -1;
+    }
+    log_new_client(client_addr);
+
+    // set the new connection fd to nonblocking mode
+    fd_set_nb(connfd);
+
+    if (!g_data.io_threads.empty()) {
+        // hand it to an I/O thread
+        size_t idx = g_data.next_io_thread++ % g_data.io_threads.size();
+        IOThread *t = g_data.io_threads[idx];
+        NewConn nc;
+        nc.fd = connfd;
+        nc.conn_class = conn_class_of(client_addr);
+        spsc_push_wait(&t->accepted, nc);
+        wake_up(t->efd);
+        return 0;
     }
-    assert(!g_data.fd2conn[conn->fd]);
-    g_data.fd2conn[conn->fd] = conn;
+    conn_register(conn_new(&g_data.loop, connfd, conn_class_of(client_addr)));
     return 0;
 }
 
-static void conn_destroy(Conn *conn) {
+// application callback when the listening socket is ready
+static void handle_accept(int fd) {
+    // drain the backlog; required by the edge-triggered backend
+    while (accept_one(fd) == 0) {}
+}
+
+static void conn_free(Conn *conn) {
     (void)close(conn->fd);
-    g_data.fd2conn[conn->fd] = NULL;
-    dlist_detach(&conn->idle_node);
+    conn->loop->fd2conn[conn->fd] = NULL;
     delete conn;
 }
 
+static void uring_conn_close(Conn *conn);
+
+static void conn_destroy(Conn *conn) {
+    if (g_data.uring.fd >= 0) {
+        return uring_conn_close(conn);  // deferred until all ops complete
+    }
+    poller_del(&conn->loop->poller, conn->fd);
+    wheel_del(&conn->loop->idle_wheel, &conn->idle_timer);
+    dlist_detach(&conn->write_node);
+    if (conn->batch) {
+        conn->want_close = true;    // freed when the batch comes back
+        return;
+    }
+    conn_free(conn);
+}
+
+// update the idle timer; the wheel is updated when the old timer fires
+static void conn_touch(Conn *conn) {
+    conn->last_active_ms = conn->loop->now_ms;
+}
+
 const size_t k_max_args = 200 * 1000;
 
 static bool read_u32(const uint8_t *&cur, const uint8_t *end, uint32_t &out) {
@@ -155,12 +439,13 @@ static bool read_u32(const uint8_t *&cur, const uint8_t *end, uint32_t &out) {
     return true;
 }
 
-static bool
-read_str(const uint8_t *&cur, const uint8_t *end, size_t n, std::string &out) {
+static bool read_str(
+    const uint8_t *&cur, const uint8_t *end, size_t n, std::string_view &out)
+{
     if (cur + n > end) {
         return false;
     }
-    out.assign(cur, cur + n);
+    out = std::string_view((const char *)cur, n);
     cur += n;
     return true;
 }
@@ -169,8 +454,8 @@ read_str(const uint8_t *&cur, const uint8_t *end, size_t n, std::string &out) {
 // | nstr | len | str1 | len | str2 | ... | len | strn |
 // +------+-----+------+-----+------+-----+-----+------+
 
-static int32_t
-parse_req(const uint8_t *data, size_t size, std::vector<std::string> &out) {
+// appends the arguments to `out`, they point into `data` without copying.
+static int32_t parse_req(const uint8_t *data, size_t size, Args &out) {
     const uint8_t *end = data + size;
     uint32_t nstr = 0;
     if (!read_u32(data, end, nstr)) {
@@ -180,12 +465,12 @@ parse_req(const uint8_t *data, size_t size, std::vector<std::string> &out) {
         return -1;  // safety limit
     }
 
-    while (out.size() < nstr) {
+    for (uint32_t i = 0; i < nstr; ++i) {
         uint32_t len = 0;
         if (!read_u32(data, end, len)) {
             return -1;
         }
-        out.push_back(std::string());
+        out.push_back(std::string_view());
         if (!read_str(data, end, len, out.back())) {
             return -1;
         }
@@ -196,27 +481,60 @@ parse_req(const uint8_t *data, size_t size, std::vector<std::string> &out) {
     return 0;
 }
 
-// error code for TAG_ERR
-enum {
-    ERR_UNKNOWN = 1,    // unknown command
-    ERR_TOO_BIG = 2,    // response too big
-    ERR_BAD_TYP = 3,    // unexpected value type
-    ERR_BAD_ARG = 4,    // bad arguments
-};
+// the unsent output, including the in-flight io_uring send
+static size_t conn_out_size(Conn *conn) {
+    return outbuf_size(conn->outgoing) + outbuf_size(conn->sending);
+}
 
-// data types of serialized data
-enum {
-    TAG_NIL = 0,    // nil
-    TAG_ERR = 1,    // error code + msg
-    TAG_STR = 2,    // string
-    TAG_INT = 3,    // int64
-    TAG_DBL = 4,    // double
-    TAG_ARR = 5,    // array
-};
+// read backpressure: don't read or parse requests above the watermark
+static bool conn_over_watermark(Conn *conn) {
+    return g_data.out_watermark && conn_out_size(conn) >= g_data.out_watermark;
+}
+
+// disconnect a client that is over the hard limit,
+// or has stayed over the soft limit for too long.
+static void conn_check_limits(Conn *conn) {
+    size_t size = conn_out_size(conn);
+    if (g_data.out_hard_limit && size > g_data.out_hard_limit) {
+        msg("output buffer over the hard limit");
+        g_data.closed_hard++;
+        conn->want_close = true;
+        return;
+    }
+    if (!g_data.out_soft_limit || size <= g_data.out_soft_limit) {
+        conn->soft_since_ms = 0;
+        return;
+    }
+    uint64_t now_ms = conn->loop->now_ms;
+    if (conn->soft_since_ms == 0) {
+        conn->soft_since_ms = now_ms;
+    } else if (now_ms - conn->soft_since_ms >= g_data.out_soft_ms) {
+        msg("output buffer over the soft limit for too long");
+        g_data.closed_soft++;
+        conn->want_close = true;
+    }
+}
+
+static void loop_client_stats(Loop *loop, ClientStats &stats) {
+    for (Conn *conn : loop->fd2conn) {
+        if (!conn) {
+            continue;
+        }
+        size_t out = conn_out_size(conn);
+        stats.clients++;
+        stats.paused += conn->read_paused ? 1 : 0;
+        stats.in_bytes += buf_size(conn->incoming);
+        stats.in_cap += buf_capacity(conn->incoming);
+        stats.out_bytes += out;
+        stats.out_cap += buf_capacity(conn->outgoing.bytes)
+            + buf_capacity(conn->sending.bytes);
+        stats.max_out = std::max<uint64_t>(stats.max_out, out);
+    }
+}
 
 // help functions for the serialization
 static void buf_append_u8(Buffer &buf, uint8_t data) {
-    buf.push_back(data);
+    buf_append(buf, &data, 1);
 }
 static void buf_append_u32(Buffer &buf, uint32_t data) {
     buf_append(buf, (const uint8_t *)&data, 4);
@@ -228,41 +546,62 @@ static void buf_append_dbl(Buffer &buf, double data) {
     buf_append(buf, (const uint8_t *)&data, 8);
 }
 
+// values smaller than this are copied into the output
+const size_t k_out_ref_min = 4096;
+
 // append serialized data types to the back
-static void out_nil(Buffer &out) {
-    buf_append_u8(out, TAG_NIL);
+static void out_nil(OutBuf &out) {
+    buf_append_u8(out.bytes, TAG_NIL);
 }
-static void out_str(Buffer &out, const char *s, size_t size) {
-    buf_append_u8(out, TAG_STR);
-    buf_append_u32(out, (uint32_t)size);
-    buf_append(out, (const uint8_t *)s, size);
+static void out_str(OutBuf &out, const char *s, size_t size) {
+    buf_append_u8(out.bytes, TAG_STR);
+    buf_append_u32(out.bytes, (uint32_t)size);
+    buf_append(out.bytes, (const uint8_t *)s, size);
+}
+// a string that is referenced instead of copied if it's large
+static void out_val(OutBuf &out, RcStr *val) {
+    if (val->len < k_out_ref_min) {
+        return out_str(out, val->data, val->len);
+    }
+    buf_append_u8(out.bytes, TAG_STR);
+    buf_append_u32(out.bytes, val->len);
+    outbuf_ref(out, val);
+}
+static void out_int(OutBuf &out, int64_t val) {
+    buf_append_u8(out.bytes, TAG_INT);
+    buf_append_i64(out.bytes, val);
 }
-static void out_int(Buffer &out, int64_t val) {
-    buf_append_u8(out, TAG_INT);
-    buf_append_i64(out, val);
+static void out_dbl(OutBuf &out, double val) {
+    buf_append_u8(out.bytes, TAG_DBL);
+    buf_append_dbl(out.bytes, val);
 }
-static void out_dbl(Buffer &out, double val) {
-    buf_append_u8(out, TAG_DBL);
-    buf_append_dbl(out, val);
+static void out_err(OutBuf &out, uint32_t code, const std::string &msg) {
+    buf_append_u8(out.bytes, TAG_ERR);
+    buf_append_u32(out.bytes, code);
+    buf_append_u32(out.bytes, (uint32_t)msg.size());
+    buf_append(out.bytes, (const uint8_t *)msg.data(), msg.size());
 }
-static void out_err(Buffer &out, uint32_t code, const std::string &msg) {
-    buf_append_u8(out, TAG_ERR);
-    buf_append_u32(out, code);
-    buf_append_u32(out, (uint32_t)msg.size());
-    buf_append(out, (const uint8_t *)msg.data(), msg.size());
+static void out_arr(OutBuf &out, uint32_t n) {
+    buf_append_u8(out.bytes, TAG_ARR);
+    buf_append_u32(out.bytes, n);
 }
-static void out_arr(Buffer &out, uint32_t n) {
-    buf_append_u8(out, TAG_ARR);
-    buf_append_u32(out, n);
+static size_t out_begin_arr(OutBuf &out) {
+    buf_append_u8(out.bytes, TAG_ARR);
+    buf_append_u32(out.bytes, 0);   // filled by out_end_arr()
+    return buf_size(out.bytes) - 4; // the `ctx` arg
 }
-static size_t out_begin_arr(Buffer &out) {
-    out.push_back(TAG_ARR);
-    buf_append_u32(out, 0);     // filled by out_end_arr()
-    return out.size() - 4;      // the `ctx` arg
+static void out_end_arr(OutBuf &out, size_t ctx, uint32_t n) {
+    assert(buf_data(out.bytes)[ctx - 1] == TAG_ARR);
+    memcpy(buf_data(out.bytes) + ctx, &n, 4);
 }
-static void out_end_arr(Buffer &out, size_t ctx, uint32_t n) {
-    assert(out[ctx - 1] == TAG_ARR);
-    memcpy(&out[ctx], &n, 4);
+// an int that is known after the values that follow it
+static size_t out_begin_int(OutBuf &out) {
+    out_int(out, 0);    // filled by out_end_int()
+    return buf_size(out.bytes) - 8;
+}
+static void out_end_int(OutBuf &out, size_t ctx, int64_t val) {
+    assert(buf_data(out.bytes)[ctx - 1] == TAG_INT);
+    memcpy(buf_data(out.bytes) + ctx, &val, 8);
 }
 
 // value types
@@ -272,22 +611,70 @@ enum {
     T_ZSET  = 2,    // sorted set
 };
 
-// KV pair for the top-level hashtable
+// string value encodings
+enum {
+    ENC_RAW = 0,    // a separate RcStr
+    ENC_EMB = 1,    // embedded after the key
+    ENC_INT = 2,    // an int64, formatted only when the bytes are needed
+};
+
+// the zset state, only allocated for zset keys
+struct ZSetVal {
+    ZSet zset;
+    // in `g_data.rehash_zsets` while the zset's hashtable is rehashing
+    DList rehash_node;
+};
+
+// KV pair for the top-level hashtable, in a single variable-size
+// allocation: the header, the key bytes, then the room for a small
+// string value. A small value is copied to the output anyway (see
+// out_val()), so it's overwritten in place.
 struct Entry {
     struct HNode node;      // hashtable node
-    std::string key;
     // for TTL
-    size_t heap_idx = -1;   // array index to the heap item
-    // value
-    uint32_t type = 0;
-    // one of the following
-    std::string str;
-    ZSet zset;
+    WheelTimer ttl_timer;
+    // the value, by `type` and `enc`
+    union {
+        RcStr *str;         // ENC_RAW
+        uint32_t emb_len;   // ENC_EMB
+        int64_t ival;       // ENC_INT
+        ZSetVal *zset;      // T_ZSET
+    };
+    uint8_t type;
+    uint8_t enc;
+    uint16_t emb_cap;       // room for an embedded value
+    uint32_t klen;
+    char data[0];           // the key, then the embedded value
 };
+static_assert(sizeof(Entry) == 48, "the entry header");
+
+// values up to this size are embedded
+const size_t k_emb_max = 64;
+
+static std::string_view entry_key(const Entry *ent) {
+    return std::string_view(ent->data, ent->klen);
+}
+
+static char *entry_emb(Entry *ent) {
+    return ent->data + ent->klen;
+}
 
-static Entry *entry_new(uint32_t type) {
-    Entry *ent = new Entry();
+// `emb_size` is the room for a string value, rounded up to the allocation
+static Entry *entry_new(std::string_view key, uint64_t hcode, uint8_t type, size_t emb_size) {
+    size_t size = sizeof(Entry) + key.size() + emb_size;
+    if (emb_size) {
+        size = (size + 15) & ~(size_t)15;
+    }
+    Entry *ent = (Entry *)malloc(size);
+    assert(ent);
+    ent->node.hcode = hcode;
+    wheel_timer_init(&ent->ttl_timer);
+    ent->str = NULL;
     ent->type = type;
+    ent->enc = ENC_RAW;
+    ent->emb_cap = (uint16_t)(size - sizeof(Entry) - key.size());
+    ent->klen = (uint32_t)key.size();
+    memcpy(ent->data, key.data(), key.size());
     return ent;
 }
 
@@ -295,9 +682,12 @@ static void entry_set_ttl(Entry *ent, int64_t ttl_ms);
 
 static void entry_del_sync(Entry *ent) {
     if (ent->type == T_ZSET) {
-        zset_clear(&ent->zset);
+        zset_clear(&ent->zset->zset);
+        delete ent->zset;
+    } else if (ent->type == T_STR && ent->enc == ENC_RAW && ent->str) {
+        rcstr_unref(ent->str);  // may still be referenced by the outputs
     }
-    delete ent;
+    free(ent);
 }
 
 static void entry_del_func(void *arg) {
@@ -306,9 +696,13 @@ static void entry_del_func(void *arg) {
 
 static void entry_del(Entry *ent) {
     // unlink it from any data structures
-    entry_set_ttl(ent, -1); // remove from the heap data structure
+    entry_set_ttl(ent, -1); // remove from the timing wheel
+    if (ent->type == T_ZSET && !dlist_empty(&ent->zset->rehash_node)) {
+        dlist_detach(&ent->zset->rehash_node);
+        g_data.rehash_nzsets--;
+    }
     // run the destructor in a thread pool for large data structures
-    size_t set_size = (ent->type == T_ZSET) ? hm_size(&ent->zset.hmap) : 0;
+    size_t set_size = (ent->type == T_ZSET) ? hm_size(&ent->zset->zset.hmap) : 0;
     const size_t k_large_container_size = 1000;
     if (set_size > k_large_container_size) {
         thread_pool_queue(&g_data.thread_pool, &entry_del_func, ent);
@@ -319,258 +713,478 @@ static void entry_del(Entry *ent) {
 
 struct LookupKey {
     struct HNode node;  // hashtable node
-    std::string key;
+    std::string_view key;
 };
 
 // equality comparison for the top-level hashstable
 static bool entry_eq(HNode *node, HNode *key) {
     struct Entry *ent = container_of(node, struct Entry, node);
     struct LookupKey *keydata = container_of(key, struct LookupKey, node);
-    return ent->key == keydata->key;
+    return entry_key(ent) == keydata->key;
+}
+
+static bool hnode_same(HNode *node, HNode *key) {
+    return node == key;
+}
+
+static bool entry_expired(Entry *ent) {
+    return !dlist_empty(&ent->ttl_timer.node)
+        && ent->ttl_timer.expire_ms <= g_data.loop.now_ms;
+}
+
+// hashtable lookup. An expired key is deleted on access, so it's never
+// visible even if the active expiry is behind.
+static Entry *entry_lookup(LookupKey *key) {
+    HNode *node = hm_lookup(&g_data.db, &key->node, &entry_eq);
+    if (!node) {
+        return NULL;
+    }
+    Entry *ent = container_of(node, Entry, node);
+    if (entry_expired(ent)) {
+        hm_delete(&g_data.db, node, &hnode_same);
+        entry_del(ent);
+        g_data.expired_on_access++;
+        return NULL;
+    }
+    return ent;
+}
+
+// "-9223372036854775808"
+const size_t k_int_str_max = 20;
+
+// the bytes of a string value; an int is formatted into `buf`
+static std::string_view entry_str(Entry *ent, char (&buf)[k_int_str_max]) {
+    if (ent->enc == ENC_INT) {
+        char *end = std::to_chars(buf, buf + k_int_str_max, ent->ival).ptr;
+        return std::string_view(buf, (size_t)(end - buf));
+    } else if (ent->enc == ENC_EMB) {
+        return std::string_view(entry_emb(ent), ent->emb_len);
+    } else {
+        return std::string_view(ent->str->data, ent->str->len);
+    }
 }
 
-static void do_get(std::vector<std::string> &cmd, Buffer &out) {
+// reference a separate value, copy the others
+static void out_entry_str(OutBuf &out, Entry *ent) {
+    if (ent->enc == ENC_RAW) {
+        return out_val(out, ent->str);
+    }
+    char buf[k_int_str_max];
+    std::string_view val = entry_str(ent, buf);
+    return out_str(out, val.data(), val.size());
+}
+
+// an int that formats back to the same bytes, so it can be stored as int
+static bool str_is_int(std::string_view sv, int64_t &out) {
+    if (sv.empty() || sv.size() > k_int_str_max) {
+        return false;
+    }
+    const char *end = sv.data() + sv.size();
+    std::from_chars_result r = std::from_chars(sv.data(), end, out);
+    if (r.ec != std::errc() || r.ptr != end) {
+        return false;
+    }
+    char buf[k_int_str_max];
+    char *fmt_end = std::to_chars(buf, buf + k_int_str_max, out).ptr;
+    return std::string_view(buf, (size_t)(fmt_end - buf)) == sv;
+}
+
+static void do_get(Req &req, OutBuf &out) {
     // a dummy struct just for the lookup
     LookupKey key;
-    key.key.swap(cmd[1]);
+    key.key = req.args[1];
     key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    // hashtable lookup
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (!node) {
+    Entry *ent = entry_lookup(&key);
+    if (!ent) {
         return out_nil(out);
     }
-    // copy the value
-    Entry *ent = container_of(node, Entry, node);
     if (ent->type != T_STR) {
         return out_err(out, ERR_BAD_TYP, "not a string value");
     }
-    return out_str(out, ent->str.data(), ent->str.size());
+    return out_entry_str(out, ent);
+}
+
+// update or insert an int value; `ent` is from entry_lookup(key)
+static void entry_set_int(LookupKey *key, Entry *ent, int64_t val) {
+    if (!ent) {
+        ent = entry_new(key->key, key->node.hcode, T_STR, 0);
+        hm_insert(&g_data.db, &ent->node);
+    }
+    assert(ent->type == T_STR);
+    if (ent->enc == ENC_RAW && ent->str) {
+        rcstr_unref(ent->str);
+    }
+    ent->enc = ENC_INT;
+    ent->ival = val;
 }
 
-static void do_set(std::vector<std::string> &cmd, Buffer &out) {
+// update or insert a string value; `ent` is from entry_lookup(key)
+static void entry_set_str(LookupKey *key, Entry *ent, std::string_view val) {
+    int64_t ival = 0;
+    if (str_is_int(val, ival)) {
+        return entry_set_int(key, ent, ival);
+    }
+    if (!ent) {
+        // not found, allocate & insert a new pair with room for the value
+        size_t emb_size = val.size() <= k_emb_max ? val.size() : 0;
+        ent = entry_new(key->key, key->node.hcode, T_STR, emb_size);
+        hm_insert(&g_data.db, &ent->node);
+    }
+    assert(ent->type == T_STR);
+    if (ent->enc == ENC_RAW && ent->str) {
+        rcstr_unref(ent->str);  // the pending outputs keep the old value
+    }
+    // a value that outgrows the room goes to a separate allocation
+    if (val.size() <= ent->emb_cap) {
+        ent->enc = ENC_EMB;
+        ent->emb_len = (uint32_t)val.size();
+        memcpy(entry_emb(ent), val.data(), val.size());
+    } else {
+        ent->enc = ENC_RAW;
+        ent->str = rcstr_new(val.data(), val.size());
+    }
+}
+
+static void do_set(Req &req, OutBuf &out) {
     // a dummy struct just for the lookup
     LookupKey key;
-    key.key.swap(cmd[1]);
+    key.key = req.args[1];
     key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    // hashtable lookup
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (node) {
-        // found, update the value
-        Entry *ent = container_of(node, Entry, node);
-        if (ent->type != T_STR) {
-            return out_err(out, ERR_BAD_TYP, "a non-string value exists");
-        }
-        ent->str.swap(cmd[2]);
-    } else {
-        // not found, allocate & insert a new pair
-        Entry *ent = entry_new(T_STR);
-        ent->key.swap(key.key);
-        ent->node.hcode = key.node.hcode;
-        ent->str.swap(cmd[2]);
-        hm_insert(&g_data.db, &ent->node);
+    Entry *ent = entry_lookup(&key);
+    if (ent && ent->type != T_STR) {
+        return out_err(out, ERR_BAD_TYP, "a non-string value exists");
     }
+    entry_set_str(&key, ent, req.args[2]);
     return out_nil(out);
 }
 
-static void do_del(std::vector<std::string> &cmd, Buffer &out) {
-    // a dummy struct just for the lookup
+// incr/incrby/decrby: add to an int value; a missing key starts from 0
+static void entry_incr(Req &req, OutBuf &out, int64_t delta) {
+    LookupKey key;
+    key.key = req.args[1];
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    Entry *ent = entry_lookup(&key);
+    int64_t val = 0;
+    if (ent && ent->type != T_STR) {
+        return out_err(out, ERR_BAD_TYP, "not a string value");
+    } else if (ent && ent->enc == ENC_INT) {
+        val = ent->ival;    // the common case, no parsing
+    } else if (ent) {
+        char buf[k_int_str_max];
+        if (!str2int(entry_str(ent, buf), val)) {
+            return out_err(out, ERR_BAD_TYP, "value is not an integer");
+        }
+    }
+    if (__builtin_add_overflow(val, delta, &val)) {
+        return out_err(out, ERR_BAD_ARG, "increment would overflow");
+    }
+    entry_set_int(&key, ent, val);
+    return out_int(out, val);
+}
+
+static void do_incr(Req &req, OutBuf &out) {
+    return entry_incr(req, out, 1);
+}
+
+static void do_incrby(Req &req, OutBuf &out) {
+    return entry_incr(req, out, req.num[2].i);
+}
+
+static void do_decrby(Req &req, OutBuf &out) {
+    if (req.num[2].i == INT64_MIN) {
+        return out_err(out, ERR_BAD_ARG, "increment would overflow");
+    }
+    return entry_incr(req, out, -req.num[2].i);
+}
+
+// incrbyfloat key delta; the result is stored as a string
+static void do_incrbyfloat(Req &req, OutBuf &out) {
     LookupKey key;
-    key.key.swap(cmd[1]);
+    key.key = req.args[1];
     key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    // hashtable delete
-    HNode *node = hm_delete(&g_data.db, &key.node, &entry_eq);
+    Entry *ent = entry_lookup(&key);
+    double val = 0;
+    if (ent && ent->type != T_STR) {
+        return out_err(out, ERR_BAD_TYP, "not a string value");
+    } else if (ent && ent->enc == ENC_INT) {
+        val = (double)ent->ival;
+    } else if (ent) {
+        char buf[k_int_str_max];
+        if (!str2dbl(entry_str(ent, buf), val)) {
+            return out_err(out, ERR_BAD_TYP, "value is not a float");
+        }
+    }
+    val += req.num[2].d;
+    if (!isfinite(val)) {
+        return out_err(out, ERR_BAD_ARG, "increment would produce NaN or Infinity");
+    }
+    // the shortest form that reads back the same
+    char buf[32];
+    char *end = std::to_chars(buf, buf + sizeof(buf), val).ptr;
+    entry_set_str(&key, ent, std::string_view(buf, (size_t)(end - buf)));
+    return out_dbl(out, val);
+}
+
+// hashtable delete, returns whether a live key is deleted
+static bool entry_del_key(LookupKey *key) {
+    HNode *node = hm_delete(&g_data.db, &key->node, &entry_eq);
+    bool found = false;
     if (node) { // deallocate the pair
-        entry_del(container_of(node, Entry, node));
+        Entry *ent = container_of(node, Entry, node);
+        found = !entry_expired(ent);
+        g_data.expired_on_access += found ? 0 : 1;
+        entry_del(ent);
     }
-    return out_int(out, node ? 1 : 0);
+    return found;
+}
+
+static void do_del(Req &req, OutBuf &out) {
+    // a dummy struct just for the lookup
+    LookupKey key;
+    key.key = req.args[1];
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    return out_int(out, entry_del_key(&key) ? 1 : 0);
 }
 
-static void heap_delete(std::vector<HeapItem> &a, size_t pos) {
-    // swap the erased item with the last item
-    a[pos] = a.back();
-    a.pop_back();
-    // update the swapped item
-    if (pos < a.size()) {
-        heap_update(a.data(), pos, a.size());
+// Multi-key commands look up the keys in batches: hash them all and
+// prefetch their hashtable groups, then the entries with a matching
+// tag, then resolve them. The cache misses of a batch overlap, instead
+// of 2-3 dependent misses per key one after another.
+const size_t k_batch_keys = 16;
+
+// `n` keys from args[first], every `step` args
+static void batch_prefetch(LookupKey *keys, Req &req, size_t first, size_t n, size_t step) {
+    for (size_t i = 0; i < n; ++i) {
+        LookupKey &key = keys[i];
+        key.key = req.args[first + i * step];
+        key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+        hm_prefetch(&g_data.db, key.node.hcode);
+    }
+    for (size_t i = 0; i < n; ++i) {
+        hm_prefetch_nodes(&g_data.db, keys[i].node.hcode);
     }
 }
 
-static void heap_upsert(std::vector<HeapItem> &a, size_t pos, HeapItem t) {
-    if (pos < a.size()) {
-        a[pos] = t;         // update an existing item
-    } else {
-        pos = a.size();
-        a.push_back(t);     // or add a new item
+// MGET key... -> [value or nil...]; nil for a non-string value
+static void do_mget(Req &req, OutBuf &out) {
+    size_t nkeys = req.args.size() - 1;
+    out_arr(out, (uint32_t)nkeys);
+    LookupKey keys[k_batch_keys];
+    Entry *ents[k_batch_keys];
+    for (size_t b = 0; b < nkeys; b += k_batch_keys) {
+        size_t n = std::min(k_batch_keys, nkeys - b);
+        batch_prefetch(keys, req, 1 + b, n, 1);
+        for (size_t i = 0; i < n; ++i) {
+            Entry *ent = entry_lookup(&keys[i]);
+            ents[i] = (ent && ent->type == T_STR) ? ent : NULL;
+            if (ents[i] && ents[i]->enc == ENC_RAW) {
+                __builtin_prefetch(ents[i]->str);
+            }
+        }
+        for (size_t i = 0; i < n; ++i) {
+            ents[i] ? out_entry_str(out, ents[i]) : out_nil(out);
+        }
     }
-    heap_update(a.data(), pos, a.size());
 }
 
-// set or remove the TTL
-static void entry_set_ttl(Entry *ent, int64_t ttl_ms) {
-    if (ttl_ms < 0 && ent->heap_idx != (size_t)-1) {
-        // setting a negative TTL means removing the TTL
-        heap_delete(g_data.heap, ent->heap_idx);
-        ent->heap_idx = -1;
-    } else if (ttl_ms >= 0) {
-        // add or update the heap data structure
-        uint64_t expire_at = get_monotonic_msec() + (uint64_t)ttl_ms;
-        HeapItem item = {expire_at, &ent->heap_idx};
-        heap_upsert(g_data.heap, ent->heap_idx, item);
+// MSET key value [key value...]; all or nothing if a value isn't a string
+static void do_mset(Req &req, OutBuf &out) {
+    if (req.args.size() % 2 == 0) {
+        return out_err(out, ERR_BAD_ARG, "wrong number of arguments");
+    }
+    size_t nkeys = req.args.size() / 2;
+    LookupKey keys[k_batch_keys];
+    for (size_t b = 0; b < nkeys; b += k_batch_keys) {
+        size_t n = std::min(k_batch_keys, nkeys - b);
+        batch_prefetch(keys, req, 1 + 2 * b, n, 2);
+        for (size_t i = 0; i < n; ++i) {
+            Entry *ent = entry_lookup(&keys[i]);
+            if (ent && ent->type != T_STR) {
+                return out_err(out, ERR_BAD_TYP, "a non-string value exists");
+            }
+        }
+    }
+    // the lookups are in the cache now; a key may repeat, so 1 by 1
+    for (size_t b = 0; b < nkeys; b += k_batch_keys) {
+        size_t n = std::min(k_batch_keys, nkeys - b);
+        batch_prefetch(keys, req, 1 + 2 * b, n, 2);
+        for (size_t i = 0; i < n; ++i) {
+            entry_set_str(&keys[i], entry_lookup(&keys[i]), req.args[2 + 2 * (b + i)]);
+        }
     }
+    return out_nil(out);
 }
 
-static bool str2int(const std::string &s, int64_t &out) {
-    char *endp = NULL;
-    out = strtoll(s.c_str(), &endp, 10);
-    return endp == s.c_str() + s.size();
+// MDEL key... -> the number of keys deleted
+static void do_mdel(Req &req, OutBuf &out) {
+    size_t nkeys = req.args.size() - 1;
+    int64_t deleted = 0;
+    LookupKey keys[k_batch_keys];
+    for (size_t b = 0; b < nkeys; b += k_batch_keys) {
+        size_t n = std::min(k_batch_keys, nkeys - b);
+        batch_prefetch(keys, req, 1 + b, n, 1);
+        for (size_t i = 0; i < n; ++i) {
+            deleted += entry_del_key(&keys[i]) ? 1 : 0;
+        }
+    }
+    return out_int(out, deleted);
 }
 
-// PEXPIRE key ttl_ms
-static void do_expire(std::vector<std::string> &cmd, Buffer &out) {
-    int64_t ttl_ms = 0;
-    if (!str2int(cmd[2], ttl_ms)) {
-        return out_err(out, ERR_BAD_ARG, "expect int64");
+// set or remove the TTL, O(1) in the timing wheel
+static void entry_set_ttl(Entry *ent, int64_t ttl_ms) {
+    hwheel_del(&g_data.ttl_wheel, &ent->ttl_timer);
+    // setting a negative TTL means removing the TTL
+    if (ttl_ms >= 0) {
+        ent->ttl_timer.expire_ms = g_data.loop.now_ms + (uint64_t)ttl_ms;
+        hwheel_add(&g_data.ttl_wheel, &ent->ttl_timer);
     }
+}
+
+// PEXPIRE key ttl_ms
+static void do_expire(Req &req, OutBuf &out) {
+    int64_t ttl_ms = req.num[2].i;
 
     LookupKey key;
-    key.key.swap(cmd[1]);
+    key.key = req.args[1];
     key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
 
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (node) {
-        Entry *ent = container_of(node, Entry, node);
+    Entry *ent = entry_lookup(&key);
+    if (ent) {
         entry_set_ttl(ent, ttl_ms);
     }
-    return out_int(out, node ? 1: 0);
+    return out_int(out, ent ? 1: 0);
 }
 
 // PTTL key
-static void do_ttl(std::vector<std::string> &cmd, Buffer &out) {
+static void do_ttl(Req &req, OutBuf &out) {
     LookupKey key;
-    key.key.swap(cmd[1]);
+    key.key = req.args[1];
     key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
 
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (!node) {
+    Entry *ent = entry_lookup(&key);
+    if (!ent) {
         return out_int(out, -2);    // not found
     }
 
-    Entry *ent = container_of(node, Entry, node);
-    if (ent->heap_idx == (size_t)-1) {
+    if (dlist_empty(&ent->ttl_timer.node)) {
         return out_int(out, -1);    // no TTL
     }
 
-    uint64_t expire_at = g_data.heap[ent->heap_idx].val;
-    uint64_t now_ms = get_monotonic_msec();
+    uint64_t expire_at = ent->ttl_timer.expire_ms;
+    uint64_t now_ms = g_data.loop.now_ms;
     return out_int(out, expire_at > now_ms ? (expire_at - now_ms) : 0);
 }
 
+struct KeysCtx {
+    OutBuf *out = NULL;
+    uint32_t n = 0;
+};
+
 static bool cb_keys(HNode *node, void *arg) {
-    Buffer &out = *(Buffer *)arg;
-    const std::string &key = container_of(node, Entry, node)->key;
-    out_str(out, key.data(), key.size());
+    KeysCtx *ctx = (KeysCtx *)arg;
+    Entry *ent = container_of(node, Entry, node);
+    if (entry_expired(ent)) {
+        return true;    // can't be deleted while iterating
+    }
+    out_str(*ctx->out, ent->data, ent->klen);
+    ctx->n++;
     return true;
 }
 
-static void do_keys(std::vector<std::string> &, Buffer &out) {
-    out_arr(out, (uint32_t)hm_size(&g_data.db));
-    hm_foreach(&g_data.db, &cb_keys, (void *)&out);
+static void do_keys(Req &, OutBuf &out) {
+    KeysCtx ctx;
+    ctx.out = &out;
+    size_t arr = out_begin_arr(out);
+    hm_foreach(&g_data.db, &cb_keys, (void *)&ctx);
+    out_end_arr(out, arr, ctx.n);
 }
 
-static bool str2dbl(const std::string &s, double &out) {
-    char *endp = NULL;
-    out = strtod(s.c_str(), &endp);
-    return endp == s.c_str() + s.size() && !isnan(out);
+// let the event loop finish the rehashing of a zset, see process_rehashing()
+static void entry_track_rehashing(ZSetVal *zv) {
+    if (dlist_empty(&zv->rehash_node) && hm_rehashing(&zv->zset.hmap)) {
+        dlist_insert_before(&g_data.rehash_zsets, &zv->rehash_node);
+        g_data.rehash_nzsets++;
+    }
 }
 
 // zadd zset score name
-static void do_zadd(std::vector<std::string> &cmd, Buffer &out) {
-    double score = 0;
-    if (!str2dbl(cmd[2], score)) {
-        return out_err(out, ERR_BAD_ARG, "expect float");
-    }
+static void do_zadd(Req &req, OutBuf &out) {
+    double score = req.num[2].d;
 
     // look up or create the zset
     LookupKey key;
-    key.key.swap(cmd[1]);
+    key.key = req.args[1];
     key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
-
-    Entry *ent = NULL;
-    if (!hnode) {   // insert a new key
-        ent = entry_new(T_ZSET);
-        ent->key.swap(key.key);
-        ent->node.hcode = key.node.hcode;
+    Entry *ent = entry_lookup(&key);
+    if (!ent) {     // insert a new key
+        ent = entry_new(key.key, key.node.hcode, T_ZSET, 0);
+        ent->zset = new ZSetVal();
+        dlist_init(&ent->zset->rehash_node);
         hm_insert(&g_data.db, &ent->node);
     } else {        // check the existing key
-        ent = container_of(hnode, Entry, node);
         if (ent->type != T_ZSET) {
             return out_err(out, ERR_BAD_TYP, "expect zset");
         }
     }
 
     // add or update the tuple
-    const std::string &name = cmd[3];
-    bool added = zset_insert(&ent->zset, name.data(), name.size(), score);
+    std::string_view name = req.args[3];
+    bool added = zset_insert(&ent->zset->zset, name.data(), name.size(), score);
+    entry_track_rehashing(ent->zset);
     return out_int(out, (int64_t)added);
 }
 
 static const ZSet k_empty_zset;
 
-static ZSet *expect_zset(std::string &s) {
+static ZSet *expect_zset(std::string_view s) {
     LookupKey key;
-    key.key.swap(s);
+    key.key = s;
     key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (!hnode) {   // a non-existent key is treated as an empty zset
+    Entry *ent = entry_lookup(&key);
+    if (!ent) {     // a non-existent key is treated as an empty zset
         return (ZSet *)&k_empty_zset;
     }
-    Entry *ent = container_of(hnode, Entry, node);
-    return ent->type == T_ZSET ? &ent->zset : NULL;
+    return ent->type == T_ZSET ? &ent->zset->zset : NULL;
 }
 
 // zrem zset name
-static void do_zrem(std::vector<std::string> &cmd, Buffer &out) {
-    ZSet *zset = expect_zset(cmd[1]);
+static void do_zrem(Req &req, OutBuf &out) {
+    ZSet *zset = expect_zset(req.args[1]);
     if (!zset) {
         return out_err(out, ERR_BAD_TYP, "expect zset");
     }
 
-    const std::string &name = cmd[2];
+    std::string_view name = req.args[2];
     ZNode *znode = zset_lookup(zset, name.data(), name.size());
     if (znode) {
         zset_delete(zset, znode);
+        entry_track_rehashing(container_of(zset, ZSetVal, zset));
     }
     return out_int(out, znode ? 1 : 0);
 }
 
 // zscore zset name
-static void do_zscore(std::vector<std::string> &cmd, Buffer &out) {
-    ZSet *zset = expect_zset(cmd[1]);
+static void do_zscore(Req &req, OutBuf &out) {
+    ZSet *zset = expect_zset(req.args[1]);
     if (!zset) {
         return out_err(out, ERR_BAD_TYP, "expect zset");
     }
 
-    const std::string &name = cmd[2];
+    std::string_view name = req.args[2];
     ZNode *znode = zset_lookup(zset, name.data(), name.size());
     return znode ? out_dbl(out, znode->score) : out_nil(out);
 }
 
 // zquery zset score name offset limit
-static void do_zquery(std::vector<std::string> &cmd, Buffer &out) {
-    // parse args
-    double score = 0;
-    if (!str2dbl(cmd[2], score)) {
-        return out_err(out, ERR_BAD_ARG, "expect fp number");
-    }
-    const std::string &name = cmd[3];
-    int64_t offset = 0, limit = 0;
-    if (!str2int(cmd[4], offset) || !str2int(cmd[5], limit)) {
-        return out_err(out, ERR_BAD_ARG, "expect int");
-    }
+static void do_zquery(Req &req, OutBuf &out) {
+    // decoded by the schema
+    double score = req.num[2].d;
+    std::string_view name = req.args[3];
+    int64_t offset = req.num[4].i;
+    int64_t limit = req.num[5].i;
 
     // get the zset
-    ZSet *zset = expect_zset(cmd[1]);
+    ZSet *zset = expect_zset(req.args[1]);
     if (!zset) {
         return out_err(out, ERR_BAD_TYP, "expect zset");
     }
@@ -594,81 +1208,910 @@ static void do_zquery(std::vector<std::string> &cmd, Buffer &out) {
     out_end_arr(out, ctx, (uint32_t)n);
 }
 
-static void do_request(std::vector<std::string> &cmd, Buffer &out) {
-    if (cmd.size() == 2 && cmd[0] == "get") {
-        return do_get(cmd, out);
-    } else if (cmd.size() == 3 && cmd[0] == "set") {
-        return do_set(cmd, out);
-    } else if (cmd.size() == 2 && cmd[0] == "del") {
-        return do_del(cmd, out);
-    } else if (cmd.size() == 3 && cmd[0] == "pexpire") {
-        return do_expire(cmd, out);
-    } else if (cmd.size() == 2 && cmd[0] == "pttl") {
-        return do_ttl(cmd, out);
-    } else if (cmd.size() == 1 && cmd[0] == "keys") {
-        return do_keys(cmd, out);
-    } else if (cmd.size() == 4 && cmd[0] == "zadd") {
-        return do_zadd(cmd, out);
-    } else if (cmd.size() == 3 && cmd[0] == "zrem") {
-        return do_zrem(cmd, out);
-    } else if (cmd.size() == 3 && cmd[0] == "zscore") {
-        return do_zscore(cmd, out);
-    } else if (cmd.size() == 6 && cmd[0] == "zquery") {
-        return do_zquery(cmd, out);
-    } else {
-        return out_err(out, ERR_UNKNOWN, "unknown command.");
+// glob-style matching: * ? [abc] [a-z] [^abc] and \ escapes
+static bool glob_match(std::string_view pat, std::string_view str) {
+    size_t p = 0, s = 0;
+    size_t star_p = std::string_view::npos, star_s = 0;    // for backtracking
+    while (s < str.size()) {
+        if (p < pat.size() && pat[p] == '*') {
+            star_p = p++;
+            star_s = s;
+            continue;
+        }
+        bool ok = false;
+        size_t next = p + 1;
+        if (p < pat.size() && pat[p] == '?') {
+            ok = true;
+        } else if (p < pat.size() && pat[p] == '[') {
+            size_t i = p + 1;
+            bool negate = i < pat.size() && pat[i] == '^';
+            i += negate ? 1 : 0;
+            bool in = false;
+            for (; i < pat.size() && pat[i] != ']'; i++) {
+                if (pat[i] == '\\' && i + 1 < pat.size()) {
+                    i++;
+                    in |= pat[i] == str[s];
+                } else if (i + 2 < pat.size() && pat[i + 1] == '-' && pat[i + 2] != ']') {
+                    char lo = std::min(pat[i], pat[i + 2]);
+                    char hi = std::max(pat[i], pat[i + 2]);
+                    in |= lo <= str[s] && str[s] <= hi;
+                    i += 2;
+                } else {
+                    in |= pat[i] == str[s];
+                }
+            }
+            ok = in != negate;
+            next = std::min(i + 1, pat.size());
+        } else if (p < pat.size()) {
+            if (pat[p] == '\\' && p + 1 < pat.size()) {
+                next = ++p + 1;
+            }
+            ok = pat[p] == str[s];
+        }
+        if (ok) {
+            p = next;
+            s++;
+        } else if (star_p != std::string_view::npos) {
+            p = star_p + 1;     // let the last * match 1 more char
+            s = ++star_s;
+        } else {
+            return false;
+        }
     }
+    while (p < pat.size() && pat[p] == '*') {
+        p++;
+    }
+    return p == pat.size();
 }
 
-static void response_begin(Buffer &out, size_t *header) {
-    *header = out.size();       // messege header position
-    buf_append_u32(out, 0);     // reserve space
-}
-static size_t response_size(Buffer &out, size_t header) {
-    return out.size() - header - 4;
-}
-static void response_end(Buffer &out, size_t header) {
-    size_t msg_size = response_size(out, header);
-    if (msg_size > k_max_msg) {
-        out.resize(header + 4);
-        out_err(out, ERR_TOO_BIG, "response is too big.");
-        msg_size = response_size(out, header);
+// scan cursor [match pattern] [count n]
+struct ScanOpts {
+    std::string_view pattern;
+    bool match = false;
+    int64_t count = 10;
+};
+
+// returns NULL or the error message
+static const char *scan_opts(Req &req, size_t pos, ScanOpts &opts) {
+    for (; pos < req.args.size(); pos += 2) {
+        if (pos + 1 >= req.args.size()) {
+            return "syntax error";
+        }
+        std::string_view opt = req.args[pos];
+        if (opt == "match") {
+            opts.pattern = req.args[pos + 1];
+            opts.match = opts.pattern != "*";
+        } else if (opt == "count") {
+            if (!str2int(req.args[pos + 1], opts.count) || opts.count < 1) {
+                return "expect positive int";
+            }
+        } else {
+            return "syntax error";
+        }
     }
-    // message header
-    uint32_t len = (uint32_t)msg_size;
-    memcpy(&out[header], &len, 4);
+    return NULL;
 }
 
-// process 1 request if there is enough data
-static bool try_one_request(Conn *conn) {
+// A scan step visits a group of 16 slots; an empty group still counts,
+// so a sparse table isn't scanned in 1 call.
+const int64_t k_scan_max_steps_per_count = 4;
+
+struct ScanCtx {
+    OutBuf *out = NULL;
+    const ScanOpts *opts = NULL;
+    uint32_t n = 0;         // output values
+    int64_t visited = 0;    // keys before filtering
+};
+
+static void cb_scan(HNode *node, void *arg) {
+    ScanCtx *ctx = (ScanCtx *)arg;
+    Entry *ent = container_of(node, Entry, node);
+    ctx->visited++;
+    if (entry_expired(ent)) {
+        return;     // can't be deleted while iterating
+    }
+    if (ctx->opts->match && !glob_match(ctx->opts->pattern, entry_key(ent))) {
+        return;
+    }
+    out_str(*ctx->out, ent->data, ent->klen);
+    ctx->n++;
+}
+
+static void cb_zscan(HNode *node, void *arg) {
+    ScanCtx *ctx = (ScanCtx *)arg;
+    ZNode *znode = container_of(node, ZNode, hmap);
+    ctx->visited++;
+    std::string_view name(znode->name, znode->len);
+    if (ctx->opts->match && !glob_match(ctx->opts->pattern, name)) {
+        return;
+    }
+    out_str(*ctx->out, znode->name, znode->len);
+    out_dbl(*ctx->out, znode->score);
+    ctx->n += 2;
+}
+
+// the next cursor and the array from `cb`, for about `count` keys
+static void scan_hmap(HMap *hmap, uint64_t &cursor, const ScanOpts &opts,
+    void (*cb)(HNode *, void *), OutBuf &out)
+{
+    ScanCtx ctx;
+    ctx.out = &out;
+    ctx.opts = &opts;
+    size_t arr = out_begin_arr(out);
+    int64_t max_steps = opts.count * k_scan_max_steps_per_count;
+    for (int64_t step = 0; step < max_steps && ctx.visited < opts.count; step++) {
+        cursor = hm_scan(hmap, cursor, cb, &ctx);
+        if (cursor == 0) {
+            break;
+        }
+    }
+    out_end_arr(out, arr, ctx.n);
+}
+
+// SCAN cursor [match pattern] [count n] -> [next_cursor, [keys...]]
+// With shards, the cursor is `local_cursor * nshards + shard`, and the
+// shards are scanned one after another.
+static void do_scan(Req &req, OutBuf &out) {
+    ScanOpts opts;
+    if (const char *err = scan_opts(req, 2, opts)) {
+        return out_err(out, ERR_BAD_ARG, err);
+    }
+    uint64_t cursor = (uint64_t)req.num[1].i;
+    uint64_t nshards = g_data.nshards;
+    cursor /= nshards;      // routed by shard_forward()
+
+    out_arr(out, 2);
+    size_t next_ctx = out_begin_int(out);
+    scan_hmap(&g_data.db, cursor, opts, &cb_scan, out);
+    uint64_t next = cursor * nshards + g_data.shard_id;
+    if (cursor == 0) {
+        // this shard is done, start the next one
+        next = g_data.shard_id + 1 < nshards ? g_data.shard_id + 1 : 0;
+    }
+    out_end_int(out, next_ctx, (int64_t)next);
+}
+
+// ZSCAN zset cursor [match pattern] [count n] -> [next_cursor, [name, score, ...]]
+static void do_zscan(Req &req, OutBuf &out) {
+    ScanOpts opts;
+    if (const char *err = scan_opts(req, 3, opts)) {
+        return out_err(out, ERR_BAD_ARG, err);
+    }
+    ZSet *zset = expect_zset(req.args[1]);
+    if (!zset) {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+    uint64_t cursor = (uint64_t)req.num[2].i;
+    out_arr(out, 2);
+    size_t next_ctx = out_begin_int(out);
+    scan_hmap(&zset->hmap, cursor, opts, &cb_zscan, out);
+    out_end_int(out, next_ctx, (int64_t)cursor);
+}
+
+static void str_appendf(std::string &s, const char *fmt, ...) {
+    char buf[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    s.append(buf, std::min<size_t>((size_t)n, sizeof(buf) - 1));
+}
+
+// info keyspace
+static void do_info_keyspace(OutBuf &out) {
+    std::string s = "# Keyspace\r\n";
+    str_appendf(s, "keys:%zu\r\n", hm_size(&g_data.db));
+    str_appendf(s, "keys_with_ttl:%zu\r\n", g_data.ttl_wheel.size);
+    str_appendf(s, "expired_keys:%lu\r\n", g_data.expired_keys);
+    str_appendf(s, "expired_on_access:%lu\r\n", g_data.expired_on_access);
+    str_appendf(s, "expire_lag_ms:%lu\r\n", g_data.expire_lag_ms);
+    str_appendf(s, "expire_max_lag_ms:%lu\r\n", g_data.expire_max_lag_ms);
+    str_appendf(s, "expire_cpu_pct:%u\r\n", g_data.expire_cpu_pct);
+    str_appendf(s, "expire_ns_per_key:%.0f\r\n", g_data.expire_ns_per_key);
+    // rehashing progress: the keyspace and the zsets
+    size_t left = hm_rehash_left(&g_data.db);
+    for (DList *node = g_data.rehash_zsets.next; node != &g_data.rehash_zsets; node = node->next) {
+        left += hm_rehash_left(&container_of(node, ZSetVal, rehash_node)->zset.hmap);
+    }
+    str_appendf(s, "rehashing_db:%d\r\n", hm_rehashing(&g_data.db) ? 1 : 0);
+    str_appendf(s, "rehashing_zsets:%zu\r\n", g_data.rehash_nzsets);
+    str_appendf(s, "rehash_keys_left:%zu\r\n", left);
+    str_appendf(s, "rehash_bg_keys:%lu\r\n", g_data.rehash_bg_keys);
+    str_appendf(s, "rehash_bg_usec:%lu\r\n", g_data.rehash_bg_us);
+    return out_str(out, s.data(), s.size());
+}
+
+// info memory; the heap of this process, including large blocks from mmap()
+static void do_info_memory(OutBuf &out) {
+    struct mallinfo2 mi = mallinfo2();
+    size_t used = mi.uordblks + mi.hblkhd;
+    size_t keys = hm_size(&g_data.db);
+    std::string s = "# Memory\r\n";
+    str_appendf(s, "used_memory:%zu\r\n", used);
+    str_appendf(s, "keys:%zu\r\n", keys);
+    str_appendf(s, "bytes_per_key:%.1f\r\n", keys ? (double)used / (double)keys : 0.0);
+    str_appendf(s, "entry_header_bytes:%zu\r\n", sizeof(Entry));
+    return out_str(out, s.data(), s.size());
+}
+
+// info clients
+static void do_info_clients(OutBuf &out) {
+    ClientStats stats;
+    loop_client_stats(&g_data.loop, stats);
+    for (IOThread *t : g_data.io_threads) {
+        // refreshed every second by each I/O thread
+        pthread_mutex_lock(&t->stats_mu);
+        ClientStats ts = t->stats;
+        pthread_mutex_unlock(&t->stats_mu);
+        stats.clients += ts.clients;
+        stats.paused += ts.paused;
+        stats.in_bytes += ts.in_bytes;
+        stats.in_cap += ts.in_cap;
+        stats.out_bytes += ts.out_bytes;
+        stats.out_cap += ts.out_cap;
+        stats.max_out = std::max(stats.max_out, ts.max_out);
+    }
+
+    std::string s = "# Clients\r\n";
+    str_appendf(s, "connected_clients:%lu\r\n", stats.clients);
+    str_appendf(s, "paused_clients:%lu\r\n", stats.paused);
+    str_appendf(s, "input_buffer_bytes:%lu\r\n", stats.in_bytes);
+    str_appendf(s, "input_buffer_capacity:%lu\r\n", stats.in_cap);
+    str_appendf(s, "output_buffer_bytes:%lu\r\n", stats.out_bytes);
+    str_appendf(s, "output_buffer_capacity:%lu\r\n", stats.out_cap);
+    str_appendf(s, "max_output_buffer:%lu\r\n", stats.max_out);
+    str_appendf(s, "output_watermark:%zu\r\n", g_data.out_watermark);
+    str_appendf(s, "output_hard_limit:%zu\r\n", g_data.out_hard_limit);
+    str_appendf(s, "output_soft_limit:%zu\r\n", g_data.out_soft_limit);
+    str_appendf(s, "output_soft_seconds:%lu\r\n", g_data.out_soft_ms / 1000);
+    str_appendf(s, "closed_by_hard_limit:%lu\r\n", g_data.closed_hard.load());
+    str_appendf(s, "closed_by_soft_limit:%lu\r\n", g_data.closed_soft.load());
+    // per-client lines; the clients of I/O threads are only in the totals
+    for (Conn *conn : g_data.loop.fd2conn) {
+        if (!conn) {
+            continue;
+        }
+        str_appendf(s, "client:id=%u fd=%d in=%zu in_cap=%zu out=%zu"
+            " out_cap=%zu out_ref=%zu paused=%d class=%s idle=%lu\r\n",
+            conn->id, conn->fd, buf_size(conn->incoming),
+            buf_capacity(conn->incoming), conn_out_size(conn),
+            buf_capacity(conn->outgoing.bytes) + buf_capacity(conn->sending.bytes),
+            conn->outgoing.ref_size + conn->sending.ref_size,
+            (int)conn->read_paused,
+            conn->conn_class == CONN_LOCAL ? "local" : "remote",
+            g_data.loop.now_ms - conn->last_active_ms);
+    }
+    return out_str(out, s.data(), s.size());
+}
+
+// these need the command table
+static void do_info(Req &req, OutBuf &out);
+static void do_latency(Req &req, OutBuf &out);
+static void do_slowlog(Req &req, OutBuf &out);
+
+// name, handler, arity, flags, schema, first key, last key, key step
+static constexpr Command k_commands[] = {
+    {"get", &do_get, 2, CMD_READ | CMD_FAST, "k", 1, 1, 1},
+    {"set", &do_set, 3, CMD_WRITE | CMD_FAST, "ks", 1, 1, 1},
+    {"del", &do_del, 2, CMD_WRITE | CMD_SLOW, "k", 1, 1, 1},
+    {"incr", &do_incr, 2, CMD_WRITE | CMD_FAST, "k", 1, 1, 1},
+    {"incrby", &do_incrby, 3, CMD_WRITE | CMD_FAST, "ki", 1, 1, 1},
+    {"decrby", &do_decrby, 3, CMD_WRITE | CMD_FAST, "ki", 1, 1, 1},
+    {"incrbyfloat", &do_incrbyfloat, 3, CMD_WRITE | CMD_FAST, "kd", 1, 1, 1},
+    {"mget", &do_mget, -2, CMD_READ | CMD_FAST, "k", 1, -1, 1},
+    {"mset", &do_mset, -3, CMD_WRITE | CMD_SLOW, "ks", 1, -2, 2},
+    {"mdel", &do_mdel, -2, CMD_WRITE | CMD_SLOW, "k", 1, -1, 1},
+    {"pexpire", &do_expire, 3, CMD_WRITE | CMD_FAST, "ki", 1, 1, 1},
+    {"pttl", &do_ttl, 2, CMD_READ | CMD_FAST, "k", 1, 1, 1},
+    {"keys", &do_keys, 1, CMD_READ | CMD_SLOW | CMD_ALL_SHARDS, "", 0, 0, 0},
+    {"scan", &do_scan, -2, CMD_READ | CMD_FAST | CMD_CURSOR, "i", 0, 0, 0},
+    {"zadd", &do_zadd, 4, CMD_WRITE | CMD_FAST, "kds", 1, 1, 1},
+    {"zrem", &do_zrem, 3, CMD_WRITE | CMD_FAST, "ks", 1, 1, 1},
+    {"zscore", &do_zscore, 3, CMD_READ | CMD_FAST, "ks", 1, 1, 1},
+    {"zquery", &do_zquery, 6, CMD_READ | CMD_SLOW, "kdsii", 1, 1, 1},
+    {"zscan", &do_zscan, -3, CMD_READ | CMD_FAST, "ki", 1, 1, 1},
+    {"info", &do_info, 2, CMD_ADMIN | CMD_SLOW, "s", 0, 0, 0},
+    {"latency", &do_latency, 3, CMD_ADMIN | CMD_SLOW, "ss", 0, 0, 0},
+    {"slowlog", &do_slowlog, -2, CMD_ADMIN | CMD_SLOW, "s", 0, 0, 0},
+};
+static constexpr CmdIndex k_cmd_index = cmd_index_build(k_commands);
+const size_t k_ncommands = sizeof(k_commands) / sizeof(k_commands[0]);
+
+static const Command *cmd_find(std::string_view name) {
+    return cmd_lookup(k_cmd_index, k_commands, name);
+}
+
+static CmdStats &cmd_stats(const Command *cmd) {
+    return g_data.cmd_stats[cmd - k_commands];
+}
+
+static double ns2us(uint64_t ns) {
+    return (double)ns / 1000;
+}
+
+// info commandstats
+static void do_info_commandstats(OutBuf &out) {
+    std::string s = "# Commandstats\r\n";
+    str_appendf(s, "latency_sample:%u\r\n", g_data.latency_sample);
+    for (size_t i = 0; i < k_ncommands; ++i) {
+        const CmdStats &st = g_data.cmd_stats[i];
+        if (st.calls == 0 && st.rejected == 0) {
+            continue;
+        }
+        // the total is estimated from the samples
+        double per_call = st.exec.count ? ns2us(st.exec.sum) / st.exec.count : 0;
+        str_appendf(s, "cmdstat_%.*s:calls=%lu,rejected_calls=%lu,usec=%.0f,"
+            "usec_per_call=%.2f,p50=%.2f,p99=%.2f,p999=%.2f,max=%.2f,"
+            "queue_p50=%.2f,queue_p99=%.2f,queue_max=%.2f\r\n",
+            (int)k_commands[i].name.size(), k_commands[i].name.data(),
+            st.calls, st.rejected, per_call * (double)st.calls, per_call,
+            ns2us(hist_quantile(&st.exec, 0.5)),
+            ns2us(hist_quantile(&st.exec, 0.99)),
+            ns2us(hist_quantile(&st.exec, 0.999)), ns2us(st.exec.max),
+            ns2us(hist_quantile(&st.queue, 0.5)),
+            ns2us(hist_quantile(&st.queue, 0.99)), ns2us(st.queue.max));
+    }
+    return out_str(out, s.data(), s.size());
+}
+
+// info clients|keyspace|memory|commandstats
+static void do_info(Req &req, OutBuf &out) {
+    if (req.args[1] == "clients") {
+        return do_info_clients(out);
+    } else if (req.args[1] == "keyspace") {
+        return do_info_keyspace(out);
+    } else if (req.args[1] == "memory") {
+        return do_info_memory(out);
+    } else if (req.args[1] == "commandstats") {
+        return do_info_commandstats(out);
+    } else {
+        return out_err(out, ERR_BAD_ARG, "unknown info section");
+    }
+}
+
+// the cumulative counts by power of 2 microseconds up to the max
+static void hist_append(std::string &s, const char *name, const Hist *h) {
+    str_appendf(s, "%s_samples:%lu\r\n", name, h->count);
+    str_appendf(s, "%s_usec:p50=%.2f,p99=%.2f,p999=%.2f,max=%.2f\r\n", name,
+        ns2us(hist_quantile(h, 0.5)), ns2us(hist_quantile(h, 0.99)),
+        ns2us(hist_quantile(h, 0.999)), ns2us(h->max));
+    str_appendf(s, "%s_histogram_usec:", name);
+    uint64_t prev = 0;
+    for (uint64_t us = 1; h->count && prev < h->count; us *= 2) {
+        uint64_t n = hist_count_below(h, us * 1000);
+        if (n != prev || n == h->count) {
+            str_appendf(s, "%s%lu=%lu", prev ? "," : "", us, n);
+        }
+        prev = n;
+    }
+    s += "\r\n";
+}
+
+// latency histogram cmd
+static void do_latency(Req &req, OutBuf &out) {
+    if (req.args[1] != "histogram") {
+        return out_err(out, ERR_BAD_ARG, "unknown latency subcommand");
+    }
+    const Command *cmd = cmd_find(req.args[2]);
+    if (!cmd) {
+        return out_err(out, ERR_BAD_ARG, "unknown command");
+    }
+    const CmdStats &st = cmd_stats(cmd);
+    std::string s;
+    str_appendf(s, "# %.*s\r\n", (int)cmd->name.size(), cmd->name.data());
+    str_appendf(s, "calls:%lu\r\n", st.calls);
+    hist_append(s, "exec", &st.exec);
+    hist_append(s, "queue", &st.queue);
+    return out_str(out, s.data(), s.size());
+}
+
+static void slowlog_out(OutBuf &out, const SlowlogEntry *ent) {
+    out_arr(out, 5);
+    out_int(out, (int64_t)ent->id);
+    out_int(out, (int64_t)(ent->unix_us / 1000000));
+    out_int(out, (int64_t)ent->duration_us);
+    bool more = ent->argc > ent->nargs;
+    out_arr(out, ent->nargs + (more ? 1 : 0));
+    for (size_t i = 0; i < ent->nargs; ++i) {
+        std::string_view arg = slowlog_arg(ent, i);
+        if (arg.size() == ent->arg_lens[i]) {
+            out_str(out, arg.data(), arg.size());
+            continue;
+        }
+        std::string s(arg);
+        str_appendf(s, "... (%zu more bytes)", ent->arg_lens[i] - arg.size());
+        out_str(out, s.data(), s.size());
+    }
+    if (more) {
+        std::string s;
+        str_appendf(s, "... (%u more arguments)", ent->argc - ent->nargs);
+        out_str(out, s.data(), s.size());
+    }
+    out_int(out, ent->fd);
+}
+
+// slowlog get [n] | len | reset | threshold [usec]
+static void do_slowlog(Req &req, OutBuf &out) {
+    Args &cmd = req.args;
+    Slowlog &log = g_data.slowlog;
+    int64_t n = 10;
+    if (cmd[1] == "get" && cmd.size() <= 3) {
+        if (cmd.size() == 3 && (!str2int(cmd[2], n) || n < 0)) {
+            return out_err(out, ERR_BAD_ARG, "expect int");
+        }
+        size_t len = std::min((size_t)n, log.size);
+        out_arr(out, (uint32_t)len);
+        for (size_t i = 0; i < len; ++i) {
+            slowlog_out(out, slowlog_at(&log, i));
+        }
+    } else if (cmd[1] == "len" && cmd.size() == 2) {
+        out_int(out, (int64_t)log.size);
+    } else if (cmd[1] == "reset" && cmd.size() == 2) {
+        slowlog_reset(&log);
+        out_nil(out);
+    } else if (cmd[1] == "threshold" && cmd.size() <= 3) {
+        if (cmd.size() == 3 && !str2int(cmd[2], log.threshold_us)) {
+            return out_err(out, ERR_BAD_ARG, "expect int");
+        }
+        out_int(out, log.threshold_us);
+    } else {
+        out_err(out, ERR_BAD_ARG, "unknown slowlog subcommand");
+    }
+}
+
+// a random hash seed, so that the clients can't predict collisions
+static void hash_seed_init() {
+    uint64_t seed = 0;
+    if (getrandom(&seed, sizeof(seed), 0) != (ssize_t)sizeof(seed)) {
+        msg_errno("getrandom()");
+        seed = get_monotonic_nsec() ^ ((uint64_t)getpid() << 32);
+    }
+    g_hash_seed = seed;
+}
+
+static uint64_t get_realtime_usec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
+}
+
+// 1 of every `latency_sample` requests is timed
+static bool latency_sampled() {
+    if (g_data.latency_sample == 0) {
+        return false;
+    }
+    if (g_data.latency_countdown == 0) {
+        g_data.latency_countdown = g_data.latency_sample;
+    }
+    return --g_data.latency_countdown == 0;
+}
+
+// `read_ns` is when the request was read, 0 if unknown
+static void do_request(Args &cmd, OutBuf &out, int fd, uint64_t read_ns) {
+    Req req(cmd);
+    req.cmd = cmd.empty() ? NULL : cmd_find(cmd[0]);
+    if (!req.cmd) {
+        return out_err(out, ERR_UNKNOWN, "unknown command.");
+    }
+    CmdStats &st = cmd_stats(req.cmd);
+    if (const char *err = cmd_decode(req)) {
+        st.rejected++;
+        return out_err(out, ERR_BAD_ARG, err);
+    }
+    st.calls++;
+    if (!(req.cmd->flags & CMD_SLOW) && !latency_sampled()) {
+        return req.cmd->func(req, out);
+    }
+    uint64_t start_ns = get_monotonic_nsec();
+    req.cmd->func(req, out);
+    uint64_t exec_ns = get_monotonic_nsec() - start_ns;
+    hist_add(&st.exec, exec_ns);
+    if (read_ns && read_ns <= start_ns) {
+        hist_add(&st.queue, start_ns - read_ns);
+    }
+    if (slowlog_wants(&g_data.slowlog, exec_ns / 1000)) {
+        slowlog_push(&g_data.slowlog, cmd.data(), cmd.size(),
+            fd, exec_ns / 1000, get_realtime_usec());
+    }
+}
+
+static void response_begin(OutBuf &out, size_t *header) {
+    *header = buf_size(out.bytes);  // messege header position
+    buf_append_u32(out.bytes, 0);   // reserve space
+}
+static size_t response_size(OutBuf &out, size_t header) {
+    return outbuf_size_since(out, header + 4);
+}
+static void response_end(OutBuf &out, size_t header) {
+    size_t msg_size = response_size(out, header);
+    if (msg_size > k_max_msg) {
+        outbuf_truncate(out, header + 4);
+        out_err(out, ERR_TOO_BIG, "response is too big.");
+        msg_size = response_size(out, header);
+    }
+    // message header
+    uint32_t len = (uint32_t)msg_size;
+    memcpy(buf_data(out.bytes) + header, &len, 4);
+}
+
+// the length-prefixed message framing, starting at `pos` of `incoming`.
+// returns the body size if there is a complete message, otherwise -1.
+static int64_t frame_request(Conn *conn, size_t pos) {
     // try to parse the protocol: message header
-    if (conn->incoming.size() < 4) {
-        return false;   // want read
+    if (buf_size(conn->incoming) < pos + 4) {
+        return -1;      // want read
     }
     uint32_t len = 0;
-    memcpy(&len, conn->incoming.data(), 4);
+    memcpy(&len, buf_data(conn->incoming) + pos, 4);
     if (len > k_max_msg) {
         msg("too long");
         conn->want_close = true;
-        return false;   // want close
+        return -1;      // want close
     }
     // message body
-    if (4 + len > conn->incoming.size()) {
-        return false;   // want read
+    if (pos + 4 + len > buf_size(conn->incoming)) {
+        return -1;      // want read
     }
-    const uint8_t *request = &conn->incoming[4];
+    return len;
+}
+
+static void execute_request(
+    Args &cmd, OutBuf &out, int fd, uint64_t read_ns)
+{
+    size_t header_pos = 0;
+    response_begin(out, &header_pos);
+    do_request(cmd, out, fd, read_ns);
+    response_end(out, header_pos);
+}
+
+// messages between shard processes
+enum {
+    SHARD_REQ = 1,  // a request for the owner of the key
+    SHARD_RES = 2,  // the response back to the origin connection
+};
+
+// +-----+------+----+----+---------+
+// | len | type | fd | id | payload |
+// +-----+------+----+----+---------+
+const size_t k_shard_msg_header = 16;
+const size_t k_shard_ring_size = 1 << 20;   // per shard pair
+
+static void shard_send(uint32_t dst, uint32_t type, uint32_t fd, uint32_t id,
+    const uint8_t *data, size_t size)
+{
+    Buffer &out = g_data.outbox[dst];   // flushed once per loop iteration
+    buf_append_u32(out, (uint32_t)size);
+    buf_append_u32(out, type);
+    buf_append_u32(out, fd);
+    buf_append_u32(out, id);
+    buf_append(out, data, size);
+}
+
+// the shard that owns a key
+static uint32_t shard_of(std::string_view key) {
+    uint64_t h = str_hash((uint8_t *)key.data(), key.size());
+    // remix; the low bits are used by the hashtable in each shard
+    return (uint32_t)((h * 0x9E3779B97F4A7C15ull) >> 32) % g_data.nshards;
+}
+
+// merge an array response (| len | TAG_ARR | n | elements |) from a shard
+static void shard_gather(Conn *conn, const uint8_t *data, size_t size) {
+    if (size >= 4 + 1 + 4 && data[4] == TAG_ARR) {
+        uint32_t n = 0;
+        memcpy(&n, &data[5], 4);
+        conn->gather_n += n;
+        buf_append(conn->gather_buf, &data[9], size - 9);
+    }
+}
+
+static void shard_gather_end(Conn *conn) {
+    size_t header_pos = 0;
+    response_begin(conn->outgoing, &header_pos);
+    out_arr(conn->outgoing, conn->gather_n);
+    outbuf_append(conn->outgoing, buf_data(conn->gather_buf), buf_size(conn->gather_buf));
+    response_end(conn->outgoing, header_pos);
+    conn->gather = false;
+    conn->gather_n = 0;
+    buf_free(conn->gather_buf);
+}
+
+// The keys of a multi-key command may be on several shards. It's split
+// into 1 request per shard with its keys (and their values), and the
+// replies are merged: arrays by the key order, ints are added up, and an
+// error wins. Each part is atomic on its shard, but not the whole.
+static bool shard_split(Conn *conn, const Command *c, Args &cmd) {
+    size_t first = (size_t)c->first_key;
+    size_t last = cmd_last_key(c, cmd.size());
+    size_t step = (size_t)c->key_step;
+    if (last < first || last + step > cmd.size() || (last - first) % step) {
+        return false;   // the error is local
+    }
+    uint32_t self = g_data.shard_id;
+    std::vector<uint32_t> &owners = conn->split_owners;
+    owners.clear();
+    bool remote = false;
+    for (size_t i = first; i <= last; i += step) {
+        owners.push_back(shard_of(cmd[i]));
+        remote = remote || owners.back() != self;
+    }
+    if (!remote) {
+        return false;
+    }
+
+    conn->split = true;
+    conn->split_res.resize(g_data.nshards);
+    conn->waiting = 0;
+    Args sub;
+    std::vector<uint8_t> msg;
+    for (uint32_t dst = 0; dst < g_data.nshards; ++dst) {
+        // the args before, the keys of this shard, the args after
+        sub.assign(cmd.begin(), cmd.begin() + first);
+        for (size_t k = 0; k < owners.size(); ++k) {
+            if (owners[k] == dst) {
+                size_t i = first + k * step;
+                sub.insert(sub.end(), cmd.begin() + i, cmd.begin() + i + step);
+            }
+        }
+        if (sub.size() == first) {
+            continue;   // no keys
+        }
+        sub.insert(sub.end(), cmd.begin() + last + step, cmd.end());
+        if (dst == self) {
+            OutBuf local;
+            execute_request(sub, local, conn->fd, conn->read_ns);
+            outbuf_flatten(local, conn->split_res[dst]);
+            continue;
+        }
+        msg.resize(req_size(sub.data(), sub.size()));
+        req_write(msg.data(), sub.data(), sub.size());
+        // without the length, like the `req` of shard_forward()
+        shard_send(dst, SHARD_REQ, conn->fd, conn->id, msg.data() + 4, msg.size() - 4);
+        conn->waiting++;
+    }
+    return true;
+}
+
+static void shard_split_end(Conn *conn) {
+    std::vector<Buffer> &res = conn->split_res;
+    // the replies are | len | value |
+    const size_t k_hdr = 4;
+    Buffer *any = NULL;
+    for (Buffer &r : res) {
+        if (buf_size(r) > k_hdr) {
+            any = any ? any : &r;
+            if (buf_data(r)[k_hdr] == TAG_ERR) {
+                any = &r;
+                break;
+            }
+        }
+    }
+    assert(any);
+    uint8_t tag = buf_data(*any)[k_hdr];
+    if (tag == TAG_ARR) {
+        // 1 element per key, taken from each shard in the key order
+        size_t header_pos = 0;
+        response_begin(conn->outgoing, &header_pos);
+        out_arr(conn->outgoing, (uint32_t)conn->split_owners.size());
+        std::vector<size_t> pos(res.size(), k_hdr + 1 + 4);
+        for (uint32_t dst : conn->split_owners) {
+            const uint8_t *data = buf_data(res[dst]);
+            size_t size = buf_size(res[dst]);
+            int64_t n = res_value_size(data + pos[dst], size - pos[dst]);
+            assert(n > 0);
+            outbuf_append(conn->outgoing, data + pos[dst], (size_t)n);
+            pos[dst] += (size_t)n;
+        }
+        response_end(conn->outgoing, header_pos);
+    } else if (tag == TAG_INT) {
+        int64_t sum = 0;
+        for (Buffer &r : res) {
+            if (buf_size(r) >= k_hdr + 1 + 8) {
+                int64_t v = 0;
+                memcpy(&v, buf_data(r) + k_hdr + 1, 8);
+                sum += v;
+            }
+        }
+        size_t header_pos = 0;
+        response_begin(conn->outgoing, &header_pos);
+        out_int(conn->outgoing, sum);
+        response_end(conn->outgoing, header_pos);
+    } else {
+        outbuf_append(conn->outgoing, buf_data(*any), buf_size(*any));
+    }
+    conn->split = false;
+    for (Buffer &r : res) {
+        buf_free(r);
+    }
+}
+
+// send the request to the shard that owns the key.
+// returns false if the request should be executed locally.
+static bool shard_forward(
+    Conn *conn, Args &cmd, const uint8_t *req, size_t len)
+{
+    if (g_data.nshards <= 1) {
+        return false;
+    }
+    const Command *c = cmd.empty() ? NULL : cmd_find(cmd[0]);
+    if (!c || !cmd_arity_ok(c, cmd.size())) {
+        return false;   // the error is local
+    }
+    uint32_t self = g_data.shard_id;
+    if (c->flags & CMD_ALL_SHARDS) {
+        // scatter-gather over all shards
+        conn->gather = true;
+        for (uint32_t dst = 0; dst < g_data.nshards; ++dst) {
+            if (dst != self) {
+                shard_send(dst, SHARD_REQ, conn->fd, conn->id, req, len);
+            }
+        }
+        conn->waiting = g_data.nshards - 1;
+        OutBuf local;
+        execute_request(cmd, local, conn->fd, conn->read_ns);
+        Buffer flat;
+        outbuf_flatten(local, flat);
+        shard_gather(conn, buf_data(flat), buf_size(flat));
+        return true;
+    }
+    if (c->flags & CMD_CURSOR) {
+        // by the shard in the cursor, see do_scan()
+        int64_t cursor = 0;
+        if (!str2int(cmd[1], cursor)) {
+            return false;   // the error is local
+        }
+        uint32_t dst = (uint32_t)((uint64_t)cursor % g_data.nshards);
+        if (dst == self) {
+            return false;
+        }
+        shard_send(dst, SHARD_REQ, conn->fd, conn->id, req, len);
+        conn->waiting = 1;
+        return true;
+    }
+    if (c->first_key == 0) {
+        return false;   // no key
+    }
+    if (cmd_last_key(c, cmd.size()) != (size_t)c->first_key) {
+        return shard_split(conn, c, cmd);
+    }
+    // by the key
+    uint32_t dst = shard_of(cmd[c->first_key]);
+    if (dst == self) {
+        return false;
+    }
+    shard_send(dst, SHARD_REQ, conn->fd, conn->id, req, len);
+    conn->waiting = 1;
+    return true;
+}
+
+static bool try_one_request(Conn *conn);
+static void handle_responses(Conn *conn);
+static void conn_update(Conn *conn);
+static void conn_resume(Conn *conn);
+
+static void shard_handle_msg(uint32_t src, uint32_t type, uint32_t fd,
+    uint32_t id, const uint8_t *data, size_t size)
+{
+    if (type == SHARD_REQ) {
+        // execute it for the origin shard
+        Args &cmd = g_data.args;
+        cmd.clear();
+        OutBuf out;
+        if (parse_req(data, size, cmd) < 0) {
+            msg("bad request");     // already validated by the origin
+            return;
+        }
+        execute_request(cmd, out, (int)fd, g_data.loop.now_ns);
+        Buffer flat;    // values are copied between processes
+        outbuf_flatten(out, flat);
+        shard_send(src, SHARD_RES, fd, id, buf_data(flat), buf_size(flat));
+        return;
+    }
+
+    assert(type == SHARD_RES);
+    std::vector<Conn *> &fd2conn = g_data.loop.fd2conn;
+    Conn *conn = fd < fd2conn.size() ? fd2conn[fd] : NULL;
+    if (!conn || conn->id != id || conn->waiting == 0) {
+        return;     // closed in the meantime
+    }
+    if (conn->gather) {
+        shard_gather(conn, data, size);
+    } else if (conn->split) {
+        buf_append(conn->split_res[src], data, size);
+    } else {
+        outbuf_append(conn->outgoing, data, size);
+    }
+    if (--conn->waiting > 0) {
+        return;
+    }
+    if (conn->gather) {
+        shard_gather_end(conn);
+    }
+    if (conn->split) {
+        shard_split_end(conn);
+    }
+    // resume the pipelined requests
+    while (try_one_request(conn)) {}
+    handle_responses(conn);
+    conn_update(conn);
+}
+
+// read the messages from other shards
+static void shard_poll_inbox() {
+    uint8_t buf[64 * 1024];
+    uint32_t self = g_data.shard_id;
+    for (uint32_t src = 0; src < g_data.nshards; ++src) {
+        if (src == self) {
+            continue;
+        }
+        SPSCBytes *ring = g_data.rings[src * g_data.nshards + self];
+        Buffer &in = g_data.inbox[src];
+        while (size_t n = spsc_bytes_read(ring, buf, sizeof(buf))) {
+            buf_append(in, buf, n);
+        }
+        // handle complete messages
+        size_t pos = 0;
+        while (buf_size(in) - pos >= k_shard_msg_header) {
+            uint32_t hdr[4];
+            memcpy(hdr, buf_data(in) + pos, sizeof(hdr));
+            if (buf_size(in) - pos < k_shard_msg_header + hdr[0]) {
+                break;
+            }
+            const uint8_t *payload = buf_data(in) + pos + k_shard_msg_header;
+            shard_handle_msg(src, hdr[1], hdr[2], hdr[3], payload, hdr[0]);
+            pos += k_shard_msg_header + hdr[0];
+        }
+        buf_consume(in, pos);
+    }
+}
+
+// write the queued messages to other shards, returns false if not all sent
+static bool shard_flush_outbox() {
+    bool done = true;
+    uint32_t self = g_data.shard_id;
+    for (uint32_t dst = 0; dst < g_data.nshards; ++dst) {
+        Buffer &out = g_data.outbox[dst];
+        if (buf_size(out) == 0) {
+            continue;
+        }
+        SPSCBytes *ring = g_data.rings[self * g_data.nshards + dst];
+        size_t n = spsc_bytes_write(ring, buf_data(out), buf_size(out));
+        if (n > 0) {
+            buf_consume(out, n);
+            wake_up(g_data.shard_efds[dst]);
+        }
+        done = done && buf_size(out) == 0;
+    }
+    return done;
+}
+
+// process 1 request if there is enough data
+static bool try_one_request(Conn *conn) {
+    if (conn->waiting) {
+        return false;   // wait for other shards to keep the order
+    }
+    if (conn_over_watermark(conn)) {
+        conn->read_paused = true;
+        return false;   // until the output is drained
+    }
+    int64_t len = frame_request(conn, 0);
+    if (len < 0) {
+        return false;
+    }
+    const uint8_t *request = buf_data(conn->incoming) + 4;
 
     // got one request, do some application logic
-    std::vector<std::string> cmd;
-    if (parse_req(request, len, cmd) < 0) {
+    Args &cmd = conn->args;
+    cmd.clear();
+    if (parse_req(request, (size_t)len, cmd) < 0) {
         msg("bad request");
         conn->want_close = true;
         return false;   // want close
     }
-    size_t header_pos = 0;
-    response_begin(conn->outgoing, &header_pos);
-    do_request(cmd, conn->outgoing);
-    response_end(conn->outgoing, header_pos);
+    if (shard_forward(conn, cmd, request, (size_t)len)) {
+        buf_consume(conn->incoming, 4 + len);
+        return false;   // wait for the response
+    }
+    execute_request(cmd, conn->outgoing, conn->fd, conn->read_ns);
 
     // application logic done! remove the request message.
     buf_consume(conn->incoming, 4 + len);
@@ -678,8 +2121,10 @@ static bool try_one_request(Conn *conn) {
 
 // application callback when the socket is writable
 static void handle_write(Conn *conn) {
-    assert(conn->outgoing.size() > 0);
-    ssize_t rv = write(conn->fd, &conn->outgoing[0], conn->outgoing.size());
+    assert(outbuf_size(conn->outgoing) > 0);
+    struct iovec iov[k_max_iov];
+    size_t n = outbuf_iov(conn->outgoing, iov, k_max_iov);
+    ssize_t rv = writev(conn->fd, iov, (int)n);
     if (rv < 0 && errno == EAGAIN) {
         return; // actually not ready
     }
@@ -690,71 +2135,213 @@ static void handle_write(Conn *conn) {
     }
 
     // remove written data from `outgoing`
-    buf_consume(conn->outgoing, (size_t)rv);
+    outbuf_consume(conn->outgoing, (size_t)rv);
+    conn_check_limits(conn);
 
     // update the readiness intention
-    if (conn->outgoing.size() == 0) {   // all data written
-        conn->want_read = true;
+    if (outbuf_size(conn->outgoing) == 0) {   // all data written
+        conn->want_read = !conn->batch;     // threaded I/O: 1 batch at a time
         conn->want_write = false;
     } // else: want write
 }
 
-// application callback when the socket is readable
-static void handle_read(Conn *conn) {
+// queue the connection after generating responses. The socket is likely
+// ready to write in a request-response protocol, so the responses are written
+// without waiting for POLLOUT, but only once at the end of the loop iteration
+// to coalesce the responses of all the reads in this iteration.
+static void handle_responses(Conn *conn) {
+    conn_check_limits(conn);
+    if (outbuf_size(conn->outgoing) > 0 && dlist_empty(&conn->write_node)) {
+        dlist_insert_before(&conn->loop->write_list, &conn->write_node);
+    }
+}
+
+// close the connection, or update its interest unless it will be flushed
+static void conn_update(Conn *conn) {
+    if (conn->want_close) {
+        conn_destroy(conn);
+    } else if (dlist_empty(&conn->write_node)) {
+        conn_update_events(conn);
+    }
+}
+
+// 1 write per connection that has new responses
+static void flush_writes(Loop *loop) {
+    while (!dlist_empty(&loop->write_list)) {
+        Conn *conn = container_of(loop->write_list.next, Conn, write_node);
+        dlist_detach(&conn->write_node);
+        dlist_init(&conn->write_node);
+        handle_write(conn);
+        if (outbuf_size(conn->outgoing) > 0) {
+            // the socket is full, stop reading until it's drained
+            conn->want_read = false;
+            conn->want_write = true;
+        } else if (!conn->want_close) {
+            conn_resume(conn);  // may queue it again
+        }
+        conn_update(conn);
+    }
+}
+
+// threaded I/O: frame and parse all buffered requests into a batch
+static void io_submit_requests(Conn *conn) {
+    if (conn->batch) {
+        return;     // 1 batch at a time to keep the responses in order
+    }
+    if (conn_over_watermark(conn)) {
+        conn->read_paused = true;
+        return;     // until the output is drained
+    }
+    ReqBatch *batch = new ReqBatch();
+    batch->conn = conn;
+    batch->read_ns = conn->read_ns;
+    batch->fd = conn->fd;
+    size_t pos = 0;
+    while (true) {
+        int64_t len = frame_request(conn, pos);
+        if (len < 0) {
+            break;
+        }
+        const uint8_t *request = buf_data(conn->incoming) + pos + 4;
+        size_t nargs = batch->args.size();
+        if (parse_req(request, (size_t)len, batch->args) < 0) {
+            msg("bad request");
+            conn->want_close = true;
+            batch->args.resize(nargs);
+            break;
+        }
+        batch->nargs.push_back((uint32_t)(batch->args.size() - nargs));
+        pos += 4 + (size_t)len;
+        batch->ends.push_back(pos);
+    }
+    if (batch->nargs.empty()) {
+        delete batch;
+        return;
+    }
+    // stop reading until the responses are written
+    conn->batch = batch;
+    conn->want_read = false;
+    spsc_push_wait(&conn->io->requests, batch);
+    conn->io->submitted = true;
+}
+
+// threaded I/O: got the responses of a batch from the main thread
+static void io_finish_batch(ReqBatch *batch) {
+    Conn *conn = batch->conn;
+    assert(conn->batch == batch);
+    conn->batch = NULL;
+    if (conn->want_close) {
+        // destroyed while the batch was being executed
+        delete batch;
+        conn_free(conn);
+        return;
+    }
+    // the arguments are no longer referenced
+    assert(batch->executed > 0);
+    buf_consume(conn->incoming, batch->ends[batch->executed - 1]);
+    if (batch->executed < batch->nargs.size()) {
+        conn->read_paused = true;   // the rest after the output is drained
+    }
+    outbuf_move(conn->outgoing, batch->out);
+    delete batch;
+    handle_responses(conn);
+    if (outbuf_size(conn->outgoing) == 0) {
+        conn->want_read = true;
+    }   // else: resumed by handle_write()
+    conn_update(conn);
+}
+
+// parse the buffered requests and generate responses
+static void handle_requests(Conn *conn) {
+    if (conn->io) {
+        // threaded I/O: the main thread will execute them
+        io_submit_requests(conn);
+    } else {
+        while (try_one_request(conn)) {}
+        // Q: Why calling this in a loop? See the explanation of "pipelining".
+    }
+    handle_responses(conn);
+}
+
+// read once, returns true if the socket may have more data
+static bool read_once(Conn *conn) {
     // read some data
     uint8_t buf[64 * 1024];
     ssize_t rv = read(conn->fd, buf, sizeof(buf));
     if (rv < 0 && errno == EAGAIN) {
-        return; // actually not ready
+        return false;   // actually not ready
     }
     // handle IO error
     if (rv < 0) {
         msg_errno("read() error");
         conn->want_close = true;
-        return; // want close
+        return false;   // want close
     }
     // handle EOF
     if (rv == 0) {
-        if (conn->incoming.size() == 0) {
+        if (buf_size(conn->incoming) == 0) {
             msg("client closed");
         } else {
             msg("unexpected EOF");
         }
         conn->want_close = true;
-        return; // want close
+        return false;   // want close
     }
     // got some new data
     buf_append(conn->incoming, buf, (size_t)rv);
+    conn->read_ns = conn->loop->now_ns;
+    handle_requests(conn);
 
-    // parse requests and generate responses
-    while (try_one_request(conn)) {}
-    // Q: Why calling this in a loop? See the explanation of "pipelining".
+    // a short read means the socket buffer is drained
+    return (size_t)rv == sizeof(buf);
+}
 
-    // update the readiness intention
-    if (conn->outgoing.size() > 0) {    // has a response
-        conn->want_read = false;
-        conn->want_write = true;
-        // The socket is likely ready to write in a request-response protocol,
-        // try to write it without waiting for the next iteration.
-        return handle_write(conn);
-    }   // else: want read
-}
-
-const uint64_t k_idle_timeout_ms = 5 * 1000;
-
-static uint32_t next_timer_ms() {
-    uint64_t now_ms = get_monotonic_msec();
-    uint64_t next_ms = (uint64_t)-1;
-    // idle timers using a linked list
-    if (!dlist_empty(&g_data.idle_list)) {
-        Conn *conn = container_of(g_data.idle_list.next, Conn, idle_node);
-        next_ms = conn->last_active_ms + k_idle_timeout_ms;
-    }
-    // TTL timers using a heap
-    if (!g_data.heap.empty() && g_data.heap[0].val < next_ms) {
-        next_ms = g_data.heap[0].val;
-    }
-    // timeout value
+// application callback when the socket is readable
+static void handle_read(Conn *conn) {
+    // The edge-triggered backend won't report the remaining data again,
+    // so keep reading as long as the application wants to read.
+    while (!conn->read_paused && read_once(conn)
+        && conn->want_read && !conn->want_close) {}
+}
+
+// continue with a connection paused by the watermark once it's drained
+static void conn_resume(Conn *conn) {
+    if (!conn->read_paused || conn_over_watermark(conn)) {
+        return;
+    }
+    conn->read_paused = false;
+    handle_requests(conn);  // the buffered requests first
+    if (conn->want_read && !conn->want_close) {
+        // the edge-triggered backend won't report the unread data again
+        handle_read(conn);
+    }
+}
+
+// handle the readiness of a connection socket
+static void handle_conn_event(Conn *conn, uint32_t ready) {
+    conn_touch(conn);
+
+    // handle IO
+    if ((ready & POLLIN) && conn->want_read) {
+        handle_read(conn);  // application logic
+    }
+    if ((ready & POLLOUT) && conn->want_write) {
+        handle_write(conn); // application logic
+        if (!conn->want_write && !conn->want_close) {
+            conn_resume(conn);
+        }
+    }
+
+    // close the socket from socket error or application logic
+    if (ready & POLLERR) {
+        conn->want_close = true;
+    }
+    conn_update(conn);
+}
+
+// the poll() timeout value
+static int32_t timeout_until(Loop *loop, uint64_t next_ms) {
+    uint64_t now_ms = loop->now_ms;
     if (next_ms == (uint64_t)-1) {
         return -1;  // no timers, no timeouts
     }
@@ -764,45 +2351,665 @@ static uint32_t next_timer_ms() {
     return (int32_t)(next_ms - now_ms);
 }
 
-static bool hnode_same(HNode *node, HNode *key) {
-    return node == key;
+static bool rehash_pending() {
+    return hm_rehashing(&g_data.db) || !dlist_empty(&g_data.rehash_zsets);
 }
 
-static void process_timers() {
-    uint64_t now_ms = get_monotonic_msec();
-    // idle timers using a linked list
-    while (!dlist_empty(&g_data.idle_list)) {
-        Conn *conn = container_of(g_data.idle_list.next, Conn, idle_node);
-        uint64_t next_ms = conn->last_active_ms + k_idle_timeout_ms;
-        if (next_ms >= now_ms) {
-            break;  // not expired
+static int32_t next_timer_ms() {
+    if (rehash_pending()) {
+        return 0;   // rehash while idle, see process_rehashing()
+    }
+    uint64_t next_ms = wheel_next_ms(&g_data.loop.idle_wheel);
+    // TTL timers using a timing wheel
+    next_ms = std::min(next_ms, hwheel_next_ms(&g_data.ttl_wheel));
+    return timeout_until(&g_data.loop, next_ms);
+}
+
+static void process_idle_timers(Loop *loop) {
+    DList expired;
+    dlist_init(&expired);
+    wheel_advance(&loop->idle_wheel, loop->now_ms, &expired);
+    while (!dlist_empty(&expired)) {
+        Conn *conn = container_of(expired.next, Conn, idle_timer.node);
+        dlist_detach(&conn->idle_timer.node);
+        dlist_init(&conn->idle_timer.node);
+        uint64_t next_ms = conn->last_active_ms + conn->idle_timeout_ms;
+        if (next_ms > loop->now_ms) {
+            // touched since the timer was added
+            conn->idle_timer.expire_ms = next_ms;
+            wheel_add(&loop->idle_wheel, &conn->idle_timer);
+            continue;
         }
 
         fprintf(stderr, "removing idle connection: %d\n", conn->fd);
         conn_destroy(conn);
     }
-    // TTL timers using a heap
-    const size_t k_max_works = 2000;
-    size_t nworks = 0;
-    const std::vector<HeapItem> &heap = g_data.heap;
-    while (!heap.empty() && heap[0].val < now_ms) {
-        Entry *ent = container_of(heap[0].ref, Entry, heap_idx);
+}
+
+// the time limits of an active expiry cycle
+const uint64_t k_expire_min_us = 100;           // always make progress
+const uint64_t k_expire_max_us = 5 * 1000;      // bound the stall
+
+// Active expiry. Expired keys are deleted slot by slot from the timing wheel,
+// for up to `expire_cpu_pct` of the event loop time: the budget is the time
+// since the last cycle scaled to the target share, converted to a number of
+// keys by the measured cost per key. The rest stay in the wheel's expired
+// list, and the loop doesn't block until they are deleted.
+static void process_ttl_timers() {
+    HTimerWheel *w = &g_data.ttl_wheel;
+    hwheel_advance(w, g_data.loop.now_ms);
+    uint64_t start_us = get_monotonic_usec();
+    if (!hwheel_peek(w)) {
+        g_data.expire_lag_ms = 0;
+        g_data.expire_cycle_end_us = start_us;
+        return;
+    }
+
+    uint64_t pct = g_data.expire_cpu_pct;
+    uint64_t budget_us = (start_us - g_data.expire_cycle_end_us) * pct / (100 - pct);
+    budget_us = std::max(budget_us, k_expire_min_us);
+    budget_us = std::min(budget_us, k_expire_max_us);
+    size_t budget = (size_t)(budget_us * 1000 / g_data.expire_ns_per_key) + 1;
+
+    size_t nkeys = 0;
+    while (nkeys < budget) {
+        WheelTimer *t = hwheel_pop(w);
+        if (!t) {
+            break;
+        }
+        Entry *ent = container_of(t, Entry, ttl_timer);
         HNode *node = hm_delete(&g_data.db, &ent->node, &hnode_same);
         assert(node == &ent->node);
-        // fprintf(stderr, "key expired: %s\n", ent->key.c_str());
         // delete the key
         entry_del(ent);
-        if (nworks++ >= k_max_works) {
-            // don't stall the server if too many keys are expiring at once
+        nkeys++;
+    }
+    uint64_t end_us = get_monotonic_usec();
+    g_data.expire_cycle_end_us = end_us;
+    g_data.expired_keys += nkeys;
+
+    // the cost per key, ignoring small samples that are mostly the clock
+    if (nkeys >= 32) {
+        double ns = double(end_us - start_us) * 1000 / nkeys;
+        g_data.expire_ns_per_key = 0.8 * g_data.expire_ns_per_key + 0.2 * ns;
+    }
+    // the expired list is in expiration order
+    WheelTimer *oldest = hwheel_peek(w);
+    g_data.expire_lag_ms = oldest ? g_data.loop.now_ms - oldest->expire_ms : 0;
+    g_data.expire_max_lag_ms = std::max(g_data.expire_max_lag_ms, g_data.expire_lag_ms);
+}
+
+// the time limits of a background rehashing step
+const uint64_t k_rehash_idle_us = 1000;     // the loop is idle
+const uint64_t k_rehash_busy_pct = 10;      // the share of a busy loop
+const uint64_t k_rehash_min_us = 20;        // less is mostly the clock
+const size_t k_rehash_chunk = 128;          // keys between the clock reads
+
+// Background rehashing. Without it, a table that goes quiet stays split,
+// so its lookups probe both tables and both slot arrays are kept. The
+// keyspace and then each rehashing zset are migrated in chunks, for up
+// to 1ms if the last poll found no events (the poll doesn't block while
+// anything is rehashing), or a small share of the loop time otherwise.
+static void process_rehashing(bool idle) {
+    if (!rehash_pending()) {
+        g_data.rehash_step_end_us = g_data.loop.now_ns / 1000;  // cached
+        return;
+    }
+    uint64_t start_us = get_monotonic_usec();
+    uint64_t budget_us = k_rehash_idle_us;
+    if (!idle) {
+        uint64_t busy_us = start_us - g_data.rehash_step_end_us;
+        budget_us = std::min(budget_us, busy_us * k_rehash_busy_pct / 100);
+        if (budget_us < k_rehash_min_us) {
+            return;     // accumulate the loop time
+        }
+    }
+
+    uint64_t now_us = start_us;
+    do {
+        HMap *hmap = &g_data.db;
+        ZSetVal *zv = NULL;
+        if (!hm_rehashing(hmap)) {
+            zv = container_of(g_data.rehash_zsets.next, ZSetVal, rehash_node);
+            hmap = &zv->zset.hmap;
+        }
+        size_t left = hm_rehash_left(hmap);
+        bool more = hm_rehash_step(hmap, k_rehash_chunk);
+        g_data.rehash_bg_keys += left - hm_rehash_left(hmap);
+        if (!more && zv) {
+            dlist_detach(&zv->rehash_node);
+            dlist_init(&zv->rehash_node);
+            g_data.rehash_nzsets--;
+        }
+        now_us = get_monotonic_usec();
+    } while (now_us - start_us < budget_us && rehash_pending());
+    g_data.rehash_bg_us += now_us - start_us;
+    g_data.rehash_step_end_us = now_us;
+}
+
+static void process_timers(bool idle) {
+    process_idle_timers(&g_data.loop);
+    process_ttl_timers();
+    process_rehashing(idle);
+}
+
+// io_uring ops, encoded in the low bits of the user_data
+enum {
+    UOP_ACCEPT  = 0,
+    UOP_RECV    = 1,
+    UOP_SEND    = 2,
+    UOP_CANCEL  = 3,
+    UOP_MASK    = 3,
+};
+
+const uint32_t k_uring_entries = 1024;
+const uint32_t k_uring_nbufs = 256;
+const uint32_t k_uring_buf_size = 16 * 1024;
+
+static uint64_t uring_ud(Conn *conn, uint64_t op) {
+    return (uint64_t)(uintptr_t)conn | op;
+}
+
+static void uring_arm_recv(Conn *conn) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&g_data.uring);
+    uring_prep_recv_multishot(sqe, conn->fd, uring_ud(conn, UOP_RECV));
+    conn->inflight++;
+    conn->recv_active = true;
+    conn->recv_cancelled = false;
+}
+
+// read backpressure: stop the multishot recv, re-armed by uring_resume()
+static void uring_pause_recv(Conn *conn) {
+    if (!conn->recv_active || conn->recv_cancelled) {
+        return;
+    }
+    conn->recv_cancelled = true;
+    struct io_uring_sqe *sqe = uring_get_sqe(&g_data.uring);
+    uring_prep_cancel(sqe, uring_ud(conn, UOP_RECV), uring_ud(conn, UOP_CANCEL));
+    conn->inflight++;
+}
+
+static void uring_resume(Conn *conn) {
+    if (!conn->read_paused || conn_over_watermark(conn)) {
+        return;
+    }
+    conn->read_paused = false;
+    while (try_one_request(conn)) {}
+    if (!conn->recv_active && !conn->read_paused && !conn->want_close) {
+        uring_arm_recv(conn);   // otherwise re-armed when it terminates
+    }
+}
+
+// submit `sending`; the iovecs live in `conn` until the send completes
+static void uring_sendmsg(Conn *conn) {
+    conn->send_iov.resize(k_max_iov);
+    size_t n = outbuf_iov(conn->sending, conn->send_iov.data(), k_max_iov);
+    conn->send_msg.msg_iov = conn->send_iov.data();
+    conn->send_msg.msg_iovlen = n;
+    struct io_uring_sqe *sqe = uring_get_sqe(&g_data.uring);
+    uring_prep_sendmsg(sqe, conn->fd, &conn->send_msg, uring_ud(conn, UOP_SEND));
+    conn->inflight++;
+}
+
+// at most 1 send in flight per connection, new responses wait in `outgoing`
+static void uring_send(Conn *conn) {
+    if (conn->cancelled || outbuf_size(conn->sending) > 0) {
+        return;
+    }
+    if (outbuf_size(conn->outgoing) == 0) {
+        return;
+    }
+    outbuf_move(conn->sending, conn->outgoing);
+    uring_sendmsg(conn);
+}
+
+// free the connection once the kernel is done with it
+static void uring_conn_try_free(Conn *conn) {
+    if (conn->cancelled && conn->inflight == 0 && !conn->send_queued) {
+        conn_free(conn);
+    }
+}
+
+static void uring_conn_close(Conn *conn) {
+    if (conn->cancelled) {
+        return;
+    }
+    conn->cancelled = true;
+    wheel_del(&conn->loop->idle_wheel, &conn->idle_timer);
+    struct io_uring_sqe *sqe = uring_get_sqe(&g_data.uring);
+    uring_prep_cancel_fd(sqe, conn->fd, uring_ud(conn, UOP_CANCEL));
+    conn->inflight++;
+}
+
+static void uring_handle_accept(int fd, struct io_uring_cqe *cqe) {
+    if (cqe->res < 0) {
+        errno = -cqe->res;
+        msg_errno("accept() error");
+    } else {
+        int connfd = cqe->res;
+        struct sockaddr_in client_addr = {};
+        socklen_t addrlen = sizeof(client_addr);
+        (void)getpeername(connfd, (struct sockaddr *)&client_addr, &addrlen);
+        log_new_client(client_addr);
+        uring_arm_recv(conn_new(&g_data.loop, connfd, conn_class_of(client_addr)));
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        // the multishot accept is terminated, re-arm it
+        struct io_uring_sqe *sqe = uring_get_sqe(&g_data.uring);
+        uring_prep_accept_multishot(sqe, fd, UOP_ACCEPT);
+    }
+}
+
+static void uring_handle_recv(
+    Conn *conn, struct io_uring_cqe *cqe, std::vector<Conn *> &send_batch)
+{
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+    if (!more) {
+        conn->inflight--;
+        conn->recv_active = false;
+    }
+    // got some new data in a provided buffer
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        if (cqe->res > 0 && !conn->cancelled) {
+            buf_append(conn->incoming,
+                uring_buf(&g_data.uring, bid), (size_t)cqe->res);
+            conn->read_ns = conn->loop->now_ns;
+        }
+        uring_buf_recycle(&g_data.uring, bid);
+    }
+    if (conn->cancelled) {
+        return;
+    }
+
+    if (cqe->res == 0) {
+        if (buf_size(conn->incoming) == 0) {
+            msg("client closed");
+        } else {
+            msg("unexpected EOF");
+        }
+        conn->want_close = true;
+        return;
+    }
+    if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+        errno = -cqe->res;
+        msg_errno("recv() error");
+        conn->want_close = true;
+        return;
+    }
+    if (cqe->res > 0) {
+        conn_touch(conn);
+        // parse requests and generate responses
+        while (try_one_request(conn)) {}
+        if (conn->read_paused) {
+            uring_pause_recv(conn);
+        }
+        conn_check_limits(conn);
+        // the sends are submitted in batch after all completions
+        if (outbuf_size(conn->outgoing) > 0 && !conn->send_queued) {
+            conn->send_queued = true;
+            send_batch.push_back(conn);
+        }
+    }
+    if (!more && !conn->want_close && !conn->read_paused) {
+        uring_arm_recv(conn);   // terminated, e.g., ran out of buffers
+    }
+}
+
+static void uring_handle_send(Conn *conn, struct io_uring_cqe *cqe) {
+    conn->inflight--;
+    if (conn->cancelled) {
+        return;
+    }
+    if (cqe->res < 0) {
+        errno = -cqe->res;
+        msg_errno("send() error");
+        conn->want_close = true;
+        return;
+    }
+    // remove written data from `sending`
+    outbuf_consume(conn->sending, (size_t)cqe->res);
+    conn_check_limits(conn);
+    if (outbuf_size(conn->sending) > 0) {
+        uring_sendmsg(conn);    // a short send, send the rest
+    } else {
+        uring_resume(conn);
+        uring_send(conn);   // responses generated in the meantime
+    }
+}
+
+// the completion-based event loop: 1 io_uring_enter() per iteration
+// submits the batch of sends and collects all the completions.
+static void uring_loop(int fd) {
+    Uring *r = &g_data.uring;
+    uring_prep_accept_multishot(uring_get_sqe(r), fd, UOP_ACCEPT);
+    std::vector<Conn *> send_batch;
+    while (true) {
+        // submit and wait for completions
+        int32_t timeout_ms = next_timer_ms();
+        int rv = uring_submit_and_wait(r, timeout_ms);
+        if (rv < 0 && rv != -ETIME && rv != -EINTR) {
+            errno = -rv;
+            die("io_uring_enter");
+        }
+        loop_update_time(&g_data.loop);
+
+        // handle completions
+        bool idle = true;
+        while (struct io_uring_cqe *cqe = uring_peek_cqe(r)) {
+            idle = false;
+            uint64_t op = cqe->user_data & UOP_MASK;
+            Conn *conn = (Conn *)(uintptr_t)(cqe->user_data & ~(uint64_t)UOP_MASK);
+            if (op == UOP_ACCEPT) {
+                uring_handle_accept(fd, cqe);
+            } else if (op == UOP_RECV) {
+                uring_handle_recv(conn, cqe, send_batch);
+            } else if (op == UOP_SEND) {
+                uring_handle_send(conn, cqe);
+            } else {
+                assert(op == UOP_CANCEL);
+                conn->inflight--;
+            }
+            uring_cqe_seen(r);
+
+            if (conn) {
+                // close the socket from socket error or application logic
+                if (conn->want_close) {
+                    conn_destroy(conn);
+                }
+                uring_conn_try_free(conn);
+            }
+        }
+
+        // batched sends
+        for (Conn *conn : send_batch) {
+            conn->send_queued = false;
+            uring_send(conn);
+            uring_conn_try_free(conn);
+        }
+        send_batch.clear();
+
+        // handle timers
+        process_timers(idle);
+    }
+}
+
+const size_t k_io_queue_size = 64 * 1024;
+
+static void eventfd_drain(int efd) {
+    eventfd_t val = 0;
+    (void)eventfd_read(efd, &val);
+}
+
+// the main thread: execute the requests from the I/O threads
+static void io_execute_batches() {
+    Args &cmd = g_data.args;
+    for (IOThread *t : g_data.io_threads) {
+        ReqBatch *batch = NULL;
+        bool done = false;
+        while (spsc_pop(&t->requests, batch)) {
+            size_t pos = 0;
+            for (uint32_t n : batch->nargs) {
+                if (batch->executed > 0 && g_data.out_watermark
+                    && outbuf_size(batch->out) >= g_data.out_watermark)
+                {
+                    break;  // read backpressure, like try_one_request()
+                }
+                cmd.assign(&batch->args[pos], &batch->args[pos] + n);
+                execute_request(cmd, batch->out, batch->fd, batch->read_ns);
+                pos += n;
+                batch->executed++;
+            }
+            spsc_push_wait(&t->responses, batch);
+            done = true;
+        }
+        if (done) {
+            wake_up(t->efd);
+        }
+    }
+}
+
+// an I/O thread: socket IO and request framing, no keyspace access
+static void *io_thread_main(void *arg) {
+    IOThread *t = (IOThread *)arg;
+    Loop *loop = &t->loop;
+    poller_add(&loop->poller, t->efd, POLLIN);
+    std::vector<PollEvent> events;
+    while (true) {
+        // wait for readiness
+        int32_t timeout_ms = timeout_until(loop, wheel_next_ms(&loop->idle_wheel));
+        int rv = poller_wait(&loop->poller, events, timeout_ms);
+        loop_update_time(loop);
+        if (rv < 0 && errno == EINTR) {
+            continue;   // not an error
+        }
+        if (rv < 0) {
+            die("poll");
+        }
+
+        for (const PollEvent &ev : events) {
+            if (ev.fd == t->efd) {
+                eventfd_drain(t->efd);  // the queues are checked below
+                continue;
+            }
+            handle_conn_event(loop->fd2conn[ev.fd], ev.events);
+        }
+        // new connections from the main thread
+        NewConn nc;
+        while (spsc_pop(&t->accepted, nc)) {
+            Conn *conn = conn_new(loop, nc.fd, nc.conn_class);
+            conn->io = t;
+            conn_register(conn);
+        }
+        // responses from the main thread
+        ReqBatch *batch = NULL;
+        while (spsc_pop(&t->responses, batch)) {
+            io_finish_batch(batch);
+        }
+        flush_writes(loop);
+        if (t->submitted) {
+            t->submitted = false;
+            wake_up(g_data.efd);
+        }
+        process_idle_timers(loop);
+        // for `info clients`
+        uint64_t now_ms = loop->now_ms;
+        if (now_ms - t->stats_ms >= 1000) {
+            ClientStats stats;
+            loop_client_stats(loop, stats);
+            pthread_mutex_lock(&t->stats_mu);
+            t->stats = stats;
+            pthread_mutex_unlock(&t->stats_mu);
+            t->stats_ms = now_ms;
+        }
+    }
+    return NULL;
+}
+
+static void io_threads_init(size_t n, int backend) {
+    g_data.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (g_data.efd < 0) {
+        die("eventfd()");
+    }
+    poller_add(&g_data.loop.poller, g_data.efd, POLLIN);
+    for (size_t i = 0; i < n; ++i) {
+        IOThread *t = new IOThread();
+        loop_init(&t->loop);
+        if (!poller_init(&t->loop.poller, backend)) {
+            poller_init(&t->loop.poller, POLLER_POLL);
+        }
+        t->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (t->efd < 0) {
+            die("eventfd()");
+        }
+        spsc_init(&t->accepted, k_io_queue_size);
+        spsc_init(&t->requests, k_io_queue_size);
+        spsc_init(&t->responses, k_io_queue_size);
+        g_data.io_threads.push_back(t);
+        int rv = pthread_create(&t->thread, NULL, &io_thread_main, t);
+        if (rv != 0) {
+            die("pthread_create()");
+        }
+    }
+    fprintf(stderr, "threaded I/O: %zu I/O threads\n", n);
+}
+
+// fork 1 process per shard, each pinned to a core. The parent is shard 0.
+static void shards_init(uint32_t n) {
+    g_data.nshards = n;
+    // per-shard-pair rings in a shared mapping
+    size_t ring_size = spsc_bytes_size(k_shard_ring_size);
+    uint8_t *mem = (uint8_t *)mmap(NULL, ring_size * n * n,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        die("mmap()");
+    }
+    for (size_t i = 0; i < (size_t)n * n; ++i) {
+        g_data.rings.push_back(
+            spsc_bytes_init(mem + i * ring_size, k_shard_ring_size));
+    }
+    for (uint32_t i = 0; i < n; ++i) {
+        int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (efd < 0) {
+            die("eventfd()");
+        }
+        g_data.shard_efds.push_back(efd);
+    }
+    g_data.outbox.resize(n);
+    g_data.inbox.resize(n);
+
+    for (uint32_t i = 1; i < n; ++i) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            die("fork()");
+        }
+        if (pid == 0) {
+            (void)prctl(PR_SET_PDEATHSIG, SIGTERM);
+            g_data.shard_id = i;
             break;
         }
     }
+
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(g_data.shard_id % (ncpu > 0 ? ncpu : 1), &cpus);
+    (void)sched_setaffinity(0, sizeof(cpus), &cpus);
+    fprintf(stderr, "shard %u/%u: pid %d\n", g_data.shard_id, n, (int)getpid());
+}
+
+static void usage() {
+    fprintf(stderr, "usage: server [--backend uring|epoll|poll]"
+        " [--io-threads N] [--shards N]\n"
+        "    [--output-limit HARD_BYTES SOFT_BYTES SOFT_SECONDS]"
+        " [--output-watermark BYTES]\n"
+        "    [--idle-timeout remote|local MILLISECONDS]"
+        " [--expire-cpu PERCENT]\n"
+        "    [--latency-sample N] [--slowlog-threshold MICROSECONDS]\n");
+    exit(1);
 }
 
-int main() {
+int main(int argc, char **argv) {
+    // command line
+    int backend = POLLER_EPOLL;
+    bool use_uring = false;
+    long io_threads = 0;
+    long shards = 1;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--backend" && i + 1 < argc) {
+            std::string val = argv[++i];
+            if (val == "uring") {
+                use_uring = true;
+            } else if (val == "epoll") {
+                backend = POLLER_EPOLL;
+            } else if (val == "poll") {
+                backend = POLLER_POLL;
+            } else {
+                usage();
+            }
+        } else if (arg == "--io-threads" && i + 1 < argc) {
+            io_threads = strtol(argv[++i], NULL, 10);
+            if (io_threads < 0 || io_threads > 1024) {
+                usage();
+            }
+        } else if (arg == "--shards" && i + 1 < argc) {
+            shards = strtol(argv[++i], NULL, 10);
+            if (shards < 1 || shards > 1024) {
+                usage();
+            }
+        } else if (arg == "--output-limit" && i + 3 < argc) {
+            g_data.out_hard_limit = strtoull(argv[++i], NULL, 10);
+            g_data.out_soft_limit = strtoull(argv[++i], NULL, 10);
+            g_data.out_soft_ms = strtoull(argv[++i], NULL, 10) * 1000;
+        } else if (arg == "--output-watermark" && i + 1 < argc) {
+            g_data.out_watermark = strtoull(argv[++i], NULL, 10);
+        } else if (arg == "--idle-timeout" && i + 2 < argc) {
+            std::string cls = argv[++i];
+            uint64_t ms = strtoull(argv[++i], NULL, 10);
+            if (cls == "remote") {
+                g_data.idle_timeout_ms[CONN_REMOTE] = ms;
+            } else if (cls == "local") {
+                g_data.idle_timeout_ms[CONN_LOCAL] = ms;
+            } else {
+                usage();
+            }
+        } else if (arg == "--expire-cpu" && i + 1 < argc) {
+            long pct = strtol(argv[++i], NULL, 10);
+            if (pct < 1 || pct > 90) {
+                usage();
+            }
+            g_data.expire_cpu_pct = (uint32_t)pct;
+        } else if (arg == "--slowlog-threshold" && i + 1 < argc) {
+            g_data.slowlog.threshold_us = strtoll(argv[++i], NULL, 10);
+        } else if (arg == "--latency-sample" && i + 1 < argc) {
+            long n = strtol(argv[++i], NULL, 10);
+            if (n < 0) {
+                usage();
+            }
+            g_data.latency_sample = (uint32_t)n;
+        } else {
+            usage();
+        }
+    }
+    if (use_uring && (io_threads > 0 || shards > 1)) {
+        msg("io_uring is only supported with a single thread, using epoll");
+        use_uring = false;
+    }
+    if (io_threads > 0 && shards > 1) {
+        msg("I/O threads are not supported with shards");
+        io_threads = 0;
+    }
+    // before the shards are forked, so they agree on the key owners
+    hash_seed_init();
+    if (shards > 1) {
+        shards_init((uint32_t)shards);
+    }
+
     // initialization
-    dlist_init(&g_data.idle_list);
+    loop_init(&g_data.loop);
+    hwheel_init(&g_data.ttl_wheel, g_data.loop.now_ms);
+    dlist_init(&g_data.rehash_zsets);
+    g_data.cmd_stats.resize(k_ncommands);
     thread_pool_init(&g_data.thread_pool, 4);
+    if (use_uring && uring_init(&g_data.uring,
+        k_uring_entries, k_uring_nbufs, k_uring_buf_size))
+    {
+        msg("event loop: io_uring");
+    } else {
+        if (use_uring) {
+            msg("io_uring unavailable, falling back to epoll");
+        }
+        if (!poller_init(&g_data.loop.poller, backend)) {
+            msg_errno("epoll unavailable, falling back to poll()");
+            backend = POLLER_POLL;
+            poller_init(&g_data.loop.poller, backend);
+        }
+        fprintf(stderr, "event loop: %s\n", poller_name(&g_data.loop.poller));
+    }
+    if (io_threads > 0) {
+        io_threads_init((size_t)io_threads, backend);
+    }
 
     // the listening socket
     int fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -811,6 +3018,10 @@ int main() {
     }
     int val = 1;
     setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+    if (g_data.nshards > 1) {
+        // each shard has its own listener, the kernel balances the load
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val));
+    }
 
     // bind
     struct sockaddr_in addr = {};
@@ -832,33 +3043,26 @@ int main() {
     }
 
     // the event loop
-    std::vector<struct pollfd> poll_args;
+    if (g_data.uring.fd >= 0) {
+        uring_loop(fd);
+        return 0;
+    }
+    poller_add(&g_data.loop.poller, fd, POLLIN);
+    int shard_efd = -1;
+    if (g_data.nshards > 1) {
+        shard_efd = g_data.shard_efds[g_data.shard_id];
+        poller_add(&g_data.loop.poller, shard_efd, POLLIN);
+    }
+    bool outbox_pending = false;
+    std::vector<PollEvent> events;
     while (true) {
-        // prepare the arguments of the poll()
-        poll_args.clear();
-        // put the listening sockets in the first position
-        struct pollfd pfd = {fd, POLLIN, 0};
-        poll_args.push_back(pfd);
-        // the rest are connection sockets
-        for (Conn *conn : g_data.fd2conn) {
-            if (!conn) {
-                continue;
-            }
-            // always poll() for error
-            struct pollfd pfd = {conn->fd, POLLERR, 0};
-            // poll() flags from the application's intent
-            if (conn->want_read) {
-                pfd.events |= POLLIN;
-            }
-            if (conn->want_write) {
-                pfd.events |= POLLOUT;
-            }
-            poll_args.push_back(pfd);
-        }
-
         // wait for readiness
         int32_t timeout_ms = next_timer_ms();
-        int rv = poll(poll_args.data(), (nfds_t)poll_args.size(), timeout_ms);
+        if (outbox_pending && (timeout_ms < 0 || timeout_ms > 1)) {
+            timeout_ms = 1;     // retry when other shards have made room
+        }
+        int rv = poller_wait(&g_data.loop.poller, events, timeout_ms);
+        loop_update_time(&g_data.loop);
         if (rv < 0 && errno == EINTR) {
             continue;   // not an error
         }
@@ -866,42 +3070,37 @@ int main() {
             die("poll");
         }
 
-        // handle the listening socket
-        if (poll_args[0].revents) {
-            handle_accept(fd);
-        }
-
-        // handle connection sockets
-        for (size_t i = 1; i < poll_args.size(); ++i) { // note: skip the 1st
-            uint32_t ready = poll_args[i].revents;
-            if (ready == 0) {
+        for (const PollEvent &ev : events) {
+            uint32_t ready = ev.events;
+            // handle the listening socket
+            if (ev.fd == fd) {
+                handle_accept(fd);
                 continue;
             }
-            Conn *conn = g_data.fd2conn[poll_args[i].fd];
-
-            // update the idle timer by moving conn to the end of the list
-            conn->last_active_ms = get_monotonic_msec();
-            dlist_detach(&conn->idle_node);
-            dlist_insert_before(&g_data.idle_list, &conn->idle_node);
-
-            // handle IO
-            if (ready & POLLIN) {
-                assert(conn->want_read);
-                handle_read(conn);  // application logic
-            }
-            if (ready & POLLOUT) {
-                assert(conn->want_write);
-                handle_write(conn); // application logic
+            // requests from the I/O threads
+            if (ev.fd == g_data.efd) {
+                eventfd_drain(g_data.efd);
+                io_execute_batches();
+                continue;
             }
-
-            // close the socket from socket error or application logic
-            if ((ready & POLLERR) || conn->want_close) {
-                conn_destroy(conn);
+            // messages from other shards
+            if (ev.fd == shard_efd) {
+                eventfd_drain(shard_efd);
+                shard_poll_inbox();
+                continue;
             }
-        }   // for each connection sockets
+            // handle connection sockets
+            handle_conn_event(g_data.loop.fd2conn[ev.fd], ready);
+        }   // for each ready fd
+        // write the responses
+        flush_writes(&g_data.loop);
 
         // handle timers
-        process_timers();
+        process_timers(events.empty());
+        // messages to other shards
+        if (g_data.nshards > 1) {
+            outbox_pending = !shard_flush_outbox();
+        }
     }   // the event loop
     return 0;
-}
\ No newline at end of file
+}
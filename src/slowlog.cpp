@@ -0,0 +1,36 @@
+#include <assert.h>
+#include <string.h>
+#include "slowlog.h"
+
+
+void slowlog_push(Slowlog *log, const std::string_view *argv, size_t argc,
+    int fd, uint64_t duration_us, uint64_t unix_us)
+{
+    // overwrite the oldest
+    SlowlogEntry *ent = &log->entries[log->next_id % k_slowlog_len];
+    ent->id = log->next_id++;
+    ent->unix_us = unix_us;
+    ent->duration_us = duration_us;
+    ent->fd = fd;
+    ent->argc = (uint32_t)argc;
+    ent->nargs = (uint32_t)(argc < k_slowlog_max_args ? argc : k_slowlog_max_args);
+    for (size_t i = 0; i < ent->nargs; ++i) {
+        size_t len = argv[i].size();
+        ent->arg_lens[i] = (uint32_t)len;
+        memcpy(ent->args[i], argv[i].data(),
+            len < k_slowlog_max_arg_len ? len : k_slowlog_max_arg_len);
+    }
+    if (log->size < k_slowlog_len) {
+        log->size++;
+    }
+}
+
+const SlowlogEntry *slowlog_at(const Slowlog *log, size_t i) {
+    assert(i < log->size);
+    return &log->entries[(log->next_id - 1 - i) % k_slowlog_len];
+}
+
+// the ids keep increasing
+void slowlog_reset(Slowlog *log) {
+    log->size = 0;
+}
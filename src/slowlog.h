@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string_view>
+
+
+// A ring buffer of the latest commands slower than a threshold.
+// The records have a fixed size, so logging never allocates: only the
+// first arguments are kept, each truncated.
+const size_t k_slowlog_len = 128;
+const size_t k_slowlog_max_args = 8;
+const size_t k_slowlog_max_arg_len = 64;
+
+struct SlowlogEntry {
+    uint64_t id = 0;
+    uint64_t unix_us = 0;       // when it finished, wall clock
+    uint64_t duration_us = 0;
+    int fd = -1;                // the client, -1 if none
+    uint32_t argc = 0;          // the original number of arguments
+    uint32_t nargs = 0;         // the number kept
+    uint32_t arg_lens[k_slowlog_max_args] = {};     // the original lengths
+    char args[k_slowlog_max_args][k_slowlog_max_arg_len];
+};
+
+struct Slowlog {
+    SlowlogEntry entries[k_slowlog_len];
+    uint64_t next_id = 0;       // also the total number logged
+    size_t size = 0;            // the number of entries, oldest evicted
+    int64_t threshold_us = 10 * 1000;   // negative disables, 0 logs all
+};
+
+inline bool slowlog_wants(const Slowlog *log, uint64_t duration_us) {
+    return log->threshold_us >= 0 && duration_us >= (uint64_t)log->threshold_us;
+}
+
+void slowlog_push(Slowlog *log, const std::string_view *argv, size_t argc,
+    int fd, uint64_t duration_us, uint64_t unix_us);
+// the i-th latest entry, i < size
+const SlowlogEntry *slowlog_at(const Slowlog *log, size_t i);
+void slowlog_reset(Slowlog *log);
+// the kept part of an argument
+inline std::string_view slowlog_arg(const SlowlogEntry *ent, size_t i) {
+    size_t len = ent->arg_lens[i];
+    return std::string_view(ent->args[i],
+        len < k_slowlog_max_arg_len ? len : k_slowlog_max_arg_len);
+}
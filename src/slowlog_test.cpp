@@ -0,0 +1,61 @@
+#include <assert.h>
+#include <string>
+#include <vector>
+#include "slowlog.cpp"
+
+
+static void test_ring() {
+    Slowlog *log = new Slowlog();
+    assert(log->size == 0);
+    std::string_view argv[] = {"get", "k"};
+    for (uint64_t i = 0; i < k_slowlog_len + 10; ++i) {
+        slowlog_push(log, argv, 2, 5, 1000 + i, i);
+    }
+    assert(log->size == k_slowlog_len);
+    // the latest first
+    for (size_t i = 0; i < log->size; ++i) {
+        const SlowlogEntry *ent = slowlog_at(log, i);
+        assert(ent->id == k_slowlog_len + 9 - i);
+        assert(ent->duration_us == 1000 + ent->id);
+        assert(ent->fd == 5 && ent->argc == 2 && ent->nargs == 2);
+        assert(slowlog_arg(ent, 0) == "get" && slowlog_arg(ent, 1) == "k");
+    }
+    slowlog_reset(log);
+    assert(log->size == 0);
+    slowlog_push(log, argv, 1, -1, 1, 1);
+    assert(log->size == 1 && slowlog_at(log, 0)->id == k_slowlog_len + 10);
+    delete log;
+}
+
+static void test_truncate() {
+    Slowlog *log = new Slowlog();
+    std::string big(1000, 'x');
+    std::vector<std::string_view> argv;
+    for (size_t i = 0; i < 20; ++i) {
+        argv.push_back(i == 1 ? std::string_view(big) : std::string_view("a"));
+    }
+    slowlog_push(log, argv.data(), argv.size(), 3, 1, 1);
+    const SlowlogEntry *ent = slowlog_at(log, 0);
+    assert(ent->argc == 20 && ent->nargs == k_slowlog_max_args);
+    assert(ent->arg_lens[1] == 1000);
+    assert(slowlog_arg(ent, 1) == std::string(k_slowlog_max_arg_len, 'x'));
+    assert(slowlog_arg(ent, 2) == "a");
+    delete log;
+}
+
+static void test_threshold() {
+    Slowlog log;
+    log.threshold_us = 100;
+    assert(!slowlog_wants(&log, 99) && slowlog_wants(&log, 100));
+    log.threshold_us = 0;
+    assert(slowlog_wants(&log, 0));
+    log.threshold_us = -1;
+    assert(!slowlog_wants(&log, 1000000));
+}
+
+int main() {
+    test_ring();
+    test_truncate();
+    test_threshold();
+    return 0;
+}
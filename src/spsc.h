@@ -0,0 +1,107 @@
+#pragma once
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <vector>
+
+
+// A bounded lock-free single-producer single-consumer queue.
+// The head and the tail are on separate cache lines to avoid false sharing.
+template <class T>
+struct SPSCQueue {
+    std::vector<T> ring;
+    size_t mask = 0;
+    char pad0[64];
+    std::atomic<size_t> head{0};    // written by the consumer
+    char pad1[64];
+    std::atomic<size_t> tail{0};    // written by the producer
+    char pad2[64];
+};
+
+// n must be a power of 2
+template <class T>
+void spsc_init(SPSCQueue<T> *q, size_t n) {
+    assert(n > 0 && ((n - 1) & n) == 0);
+    q->ring.resize(n);
+    q->mask = n - 1;
+}
+
+// producer side, returns false if full
+template <class T>
+bool spsc_push(SPSCQueue<T> *q, const T &item) {
+    size_t tail = q->tail.load(std::memory_order_relaxed);
+    if (tail - q->head.load(std::memory_order_acquire) > q->mask) {
+        return false;
+    }
+    q->ring[tail & q->mask] = item;
+    q->tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+// consumer side, returns false if empty
+template <class T>
+bool spsc_pop(SPSCQueue<T> *q, T &out) {
+    size_t head = q->head.load(std::memory_order_relaxed);
+    if (head == q->tail.load(std::memory_order_acquire)) {
+        return false;
+    }
+    out = q->ring[head & q->mask];
+    q->head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+// A lock-free SPSC byte stream (like a pipe) placed in caller-provided
+// memory, so it also works between processes in a shared mapping.
+struct SPSCBytes {
+    std::atomic<uint64_t> head;     // written by the consumer
+    char pad0[56];
+    std::atomic<uint64_t> tail;     // written by the producer
+    char pad1[56];
+    uint64_t cap = 0;               // power of 2
+    uint8_t data[0];                // flexible array
+};
+
+inline size_t spsc_bytes_size(size_t cap) {
+    return sizeof(SPSCBytes) + cap;
+}
+
+// `mem` must have `spsc_bytes_size(cap)` bytes
+inline SPSCBytes *spsc_bytes_init(void *mem, size_t cap) {
+    assert(cap > 0 && ((cap - 1) & cap) == 0);
+    SPSCBytes *r = new (mem) SPSCBytes();
+    r->head.store(0);
+    r->tail.store(0);
+    r->cap = cap;
+    return r;
+}
+
+// producer side, returns the number of bytes written
+inline size_t spsc_bytes_write(SPSCBytes *r, const uint8_t *data, size_t len) {
+    uint64_t tail = r->tail.load(std::memory_order_relaxed);
+    uint64_t head = r->head.load(std::memory_order_acquire);
+    size_t n = std::min<size_t>(len, r->cap - (size_t)(tail - head));
+    size_t pos = (size_t)tail & (r->cap - 1);
+    size_t n1 = std::min<size_t>(n, r->cap - pos);   // until wrapping
+    memcpy(&r->data[pos], data, n1);
+    memcpy(&r->data[0], data + n1, n - n1);
+    r->tail.store(tail + n, std::memory_order_release);
+    return n;
+}
+
+// consumer side, returns the number of bytes read
+inline size_t spsc_bytes_read(SPSCBytes *r, uint8_t *out, size_t len) {
+    uint64_t head = r->head.load(std::memory_order_relaxed);
+    uint64_t tail = r->tail.load(std::memory_order_acquire);
+    size_t n = std::min<size_t>(len, (size_t)(tail - head));
+    size_t pos = (size_t)head & (r->cap - 1);
+    size_t n1 = std::min<size_t>(n, r->cap - pos);
+    memcpy(out, &r->data[pos], n1);
+    memcpy(out + n1, &r->data[0], n - n1);
+    r->head.store(head + n, std::memory_order_release);
+    return n;
+}
@@ -0,0 +1,145 @@
+// TTL churn: the binary heap versus the hierarchical timing wheel.
+// g++ -std=c++17 -O2 timer_bench.cpp heap.cpp timer_wheel.cpp -o timer_bench
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+#include "common.h"
+#include "heap.h"
+#include "timer_wheel.h"
+
+
+static uint64_t get_monotonic_nsec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+// stands for `Entry`, whose cache line is touched by each timer update
+struct Key {
+    size_t heap_idx = -1;
+    WheelTimer wt;
+    char payload[64];
+};
+
+// the same as `server.cpp` before the timing wheel
+static void heap_delete(std::vector<HeapItem> &a, size_t pos) {
+    a[pos] = a.back();
+    a.pop_back();
+    if (pos < a.size()) {
+        heap_update(a.data(), pos, a.size());
+    }
+}
+
+static void heap_upsert(std::vector<HeapItem> &a, size_t pos, HeapItem t) {
+    if (pos < a.size()) {
+        a[pos] = t;
+    } else {
+        pos = a.size();
+        a.push_back(t);
+    }
+    heap_update(a.data(), pos, a.size());
+}
+
+// TTLs from 1s to 1h
+static uint64_t rand_ttl() {
+    return 1000 + (uint64_t)rand() % (3600 * 1000);
+}
+
+// 1 clock tick (1ms) every `ops_per_ms` updates; expired keys get a new TTL
+struct Workload {
+    size_t nkeys;
+    size_t nops;
+    size_t ops_per_ms;
+    std::vector<uint32_t> picks;    // the key of each update
+    std::vector<uint64_t> ttls;
+};
+
+static Workload make_workload(size_t nkeys, size_t nops, size_t ops_per_ms) {
+    Workload wl;
+    wl.nkeys = nkeys;
+    wl.nops = nops;
+    wl.ops_per_ms = ops_per_ms;
+    for (size_t i = 0; i < nops; ++i) {
+        wl.picks.push_back((uint32_t)((uint64_t)rand() * rand() % nkeys));
+        wl.ttls.push_back(rand_ttl());
+    }
+    return wl;
+}
+
+static double bench_heap(const Workload &wl, size_t &expired) {
+    std::vector<Key> keys(wl.nkeys);
+    std::vector<HeapItem> heap;
+    uint64_t now = 1000000;
+    for (Key &k : keys) {
+        heap_upsert(heap, k.heap_idx, HeapItem{now + rand_ttl(), &k.heap_idx});
+    }
+    expired = 0;
+    uint64_t start = get_monotonic_nsec();
+    for (size_t i = 0; i < wl.nops; ++i) {
+        Key &k = keys[wl.picks[i]];
+        heap_upsert(heap, k.heap_idx, HeapItem{now + wl.ttls[i], &k.heap_idx});
+        if ((i + 1) % wl.ops_per_ms == 0) {
+            now++;
+            while (heap[0].val <= now) {
+                Key *e = container_of(heap[0].ref, Key, heap_idx);
+                heap_delete(heap, e->heap_idx);
+                e->heap_idx = -1;
+                heap_upsert(heap, e->heap_idx, HeapItem{now + rand_ttl(), &e->heap_idx});
+                expired++;
+            }
+        }
+    }
+    return double(get_monotonic_nsec() - start) / wl.nops;
+}
+
+static double bench_wheel(const Workload &wl, size_t &expired) {
+    std::vector<Key> keys(wl.nkeys);
+    HTimerWheel *w = new HTimerWheel();
+    uint64_t now = 1000000;
+    hwheel_init(w, now);
+    for (Key &k : keys) {
+        wheel_timer_init(&k.wt);
+        k.wt.expire_ms = now + rand_ttl();
+        hwheel_add(w, &k.wt);
+    }
+    expired = 0;
+    uint64_t start = get_monotonic_nsec();
+    for (size_t i = 0; i < wl.nops; ++i) {
+        Key &k = keys[wl.picks[i]];
+        hwheel_del(w, &k.wt);
+        k.wt.expire_ms = now + wl.ttls[i];
+        hwheel_add(w, &k.wt);
+        if ((i + 1) % wl.ops_per_ms == 0) {
+            now++;
+            hwheel_advance(w, now);
+            while (WheelTimer *t = hwheel_pop(w)) {
+                t->expire_ms = now + rand_ttl();
+                hwheel_add(w, t);
+                expired++;
+            }
+        }
+    }
+    double ns = double(get_monotonic_nsec() - start) / wl.nops;
+    delete w;
+    return ns;
+}
+
+int main() {
+    const size_t sizes[] = {10 * 1000, 100 * 1000, 1000 * 1000, 4000 * 1000};
+    printf("%10s %12s %12s %12s\n", "keys", "heap ns/op", "wheel ns/op", "expired");
+    for (size_t nkeys : sizes) {
+        Workload wl = make_workload(nkeys, 4000 * 1000, 100);
+        size_t expired_heap = 0;
+        size_t expired_wheel = 0;
+        srand(1);
+        double heap_ns = bench_heap(wl, expired_heap);
+        srand(1);
+        double wheel_ns = bench_wheel(wl, expired_wheel);
+        printf("%10zu %12.1f %12.1f %12zu\n",
+            nkeys, heap_ns, wheel_ns, expired_wheel);
+        (void)expired_heap;
+    }
+    return 0;
+}
@@ -0,0 +1,299 @@
+#include <assert.h>
+#include <string.h>
+#include "common.h"
+#include "timer_wheel.h"
+
+
+static uint64_t wheel_tick_of(TimerWheel *w, uint64_t ms) {
+    return (ms + w->tick_ms - 1) / w->tick_ms;  // rounded up, never early
+}
+
+void wheel_init(TimerWheel *w, size_t nslots, uint64_t tick_ms, uint64_t now_ms) {
+    assert(nslots > 0 && ((nslots - 1) & nslots) == 0);
+    assert(tick_ms > 0);
+    w->slots.resize(nslots);
+    for (DList &slot : w->slots) {
+        dlist_init(&slot);
+    }
+    w->tick_ms = tick_ms;
+    w->cur_tick = now_ms / tick_ms;
+    w->size = 0;
+}
+
+void wheel_timer_init(WheelTimer *t) {
+    dlist_init(&t->node);
+}
+
+void wheel_add(TimerWheel *w, WheelTimer *t) {
+    assert(dlist_empty(&t->node));
+    uint64_t tick = wheel_tick_of(w, t->expire_ms);
+    if (tick <= w->cur_tick) {
+        tick = w->cur_tick + 1;     // already due, fire at the next tick
+    }
+    DList *slot = &w->slots[tick & (w->slots.size() - 1)];
+    dlist_insert_before(slot, &t->node);
+    w->size++;
+}
+
+void wheel_del(TimerWheel *w, WheelTimer *t) {
+    if (dlist_empty(&t->node)) {
+        return;
+    }
+    dlist_detach(&t->node);
+    dlist_init(&t->node);
+    w->size--;
+}
+
+void wheel_advance(TimerWheel *w, uint64_t now_ms, DList *expired) {
+    uint64_t now_tick = now_ms / w->tick_ms;
+    if (now_tick <= w->cur_tick) {
+        return;
+    }
+    // each slot is visited at most once, even after a long stall
+    uint64_t nticks = now_tick - w->cur_tick;
+    if (nticks > w->slots.size()) {
+        nticks = w->slots.size();
+    }
+    for (uint64_t i = 1; i <= nticks; ++i) {
+        DList *slot = &w->slots[(w->cur_tick + i) & (w->slots.size() - 1)];
+        DList *node = slot->next;
+        while (node != slot) {
+            DList *next = node->next;
+            WheelTimer *t = container_of(node, WheelTimer, node);
+            if (wheel_tick_of(w, t->expire_ms) <= now_tick) {
+                dlist_detach(node);
+                dlist_insert_before(expired, node);
+                w->size--;
+            }   // else: a later round
+            node = next;
+        }
+    }
+    w->cur_tick = now_tick;
+}
+
+uint64_t wheel_next_ms(TimerWheel *w) {
+    if (w->size == 0) {
+        return (uint64_t)-1;
+    }
+    for (uint64_t i = 1; i <= w->slots.size(); ++i) {
+        uint64_t tick = w->cur_tick + i;
+        if (!dlist_empty(&w->slots[tick & (w->slots.size() - 1)])) {
+            return tick * w->tick_ms;
+        }
+    }
+    assert(!"unreachable");
+    return (uint64_t)-1;
+}
+
+const uint64_t k_hwheel_l0_size = 1 << k_hwheel_l0_bits;
+const uint64_t k_hwheel_ln_size = 1 << k_hwheel_ln_bits;
+
+static uint32_t hwheel_shift(uint32_t level) {
+    return k_hwheel_l0_bits + k_hwheel_ln_bits * level;
+}
+
+// the first set bit at or after `pos`, or `nbits`
+static uint64_t bitmap_next(const uint64_t *bits, uint64_t nbits, uint64_t pos) {
+    while (pos < nbits) {
+        uint64_t word = bits[pos / 64] >> (pos % 64);
+        if (word) {
+            return pos + __builtin_ctzll(word);
+        }
+        pos = (pos / 64 + 1) * 64;
+    }
+    return nbits;
+}
+
+void hwheel_init(HTimerWheel *w, uint64_t now_ms) {
+    for (DList &slot : w->l0) {
+        dlist_init(&slot);
+    }
+    for (auto &level : w->ln) {
+        for (DList &slot : level) {
+            dlist_init(&slot);
+        }
+    }
+    memset(w->l0_used, 0, sizeof(w->l0_used));
+    memset(w->ln_used, 0, sizeof(w->ln_used));
+    dlist_init(&w->expired);
+    w->cur_ms = now_ms;
+    w->size = 0;
+}
+
+// put the timer in a slot by the distance to the current tick
+static void hwheel_insert(HTimerWheel *w, WheelTimer *t) {
+    uint64_t expire_ms = t->expire_ms;
+    if (expire_ms < w->cur_ms) {
+        expire_ms = w->cur_ms;  // fires at the next tick
+    }
+    uint64_t delta = expire_ms - w->cur_ms;
+    if (delta < k_hwheel_l0_size) {
+        uint64_t idx = expire_ms & (k_hwheel_l0_size - 1);
+        dlist_insert_before(&w->l0[idx], &t->node);
+        w->l0_used[idx / 64] |= (uint64_t)1 << (idx % 64);
+        return;
+    }
+    uint32_t top = k_hwheel_levels - 1;
+    uint64_t max_delta = (uint64_t)1 << (hwheel_shift(top) + k_hwheel_ln_bits);
+    if (delta >= max_delta) {
+        // further than the top level; cascaded again until in range
+        expire_ms = w->cur_ms + max_delta - 1;
+        delta = max_delta - 1;
+    }
+    uint32_t level = 0;
+    while ((delta >> hwheel_shift(level + 1)) != 0) {
+        level++;
+    }
+    uint64_t idx = (expire_ms >> hwheel_shift(level)) & (k_hwheel_ln_size - 1);
+    dlist_insert_before(&w->ln[level][idx], &t->node);
+    w->ln_used[level] |= (uint64_t)1 << idx;
+}
+
+void hwheel_add(HTimerWheel *w, WheelTimer *t) {
+    assert(dlist_empty(&t->node));
+    hwheel_insert(w, t);
+    w->size++;
+}
+
+// the bitmaps are cleared lazily when an empty slot is visited
+void hwheel_del(HTimerWheel *w, WheelTimer *t) {
+    if (dlist_empty(&t->node)) {
+        return;
+    }
+    dlist_detach(&t->node);
+    dlist_init(&t->node);
+    w->size--;
+}
+
+// move the timers of a slot to lower levels
+static void hwheel_cascade(HTimerWheel *w, uint32_t level, uint64_t idx) {
+    DList *slot = &w->ln[level][idx];
+    w->ln_used[level] &= ~((uint64_t)1 << idx);
+    while (!dlist_empty(slot)) {
+        DList *node = slot->next;
+        dlist_detach(node);
+        hwheel_insert(w, container_of(node, WheelTimer, node));
+    }
+}
+
+// move a whole list to the end of `dst`
+static void dlist_splice(DList *dst, DList *src) {
+    if (dlist_empty(src)) {
+        return;
+    }
+    DList *first = src->next;
+    DList *last = src->prev;
+    DList *tail = dst->prev;
+    tail->next = first;
+    first->prev = tail;
+    last->next = dst;
+    dst->prev = last;
+    dlist_init(src);
+}
+
+static uint64_t hwheel_next_tick(HTimerWheel *w);
+
+void hwheel_advance(HTimerWheel *w, uint64_t now_ms) {
+    while (w->cur_ms <= now_ms) {
+        // skip to the next tick with anything to do
+        uint64_t next = hwheel_next_tick(w);
+        if (next > now_ms) {
+            w->cur_ms = now_ms + 1;
+            break;
+        }
+        w->cur_ms = next;
+        uint64_t idx = w->cur_ms & (k_hwheel_l0_size - 1);
+        // at the start of a level 0 rotation, bring down the timers of this
+        // rotation, then from the level above if that one also wraps.
+        uint64_t wrapped = idx;
+        for (uint32_t level = 0; wrapped == 0 && level < k_hwheel_levels; ++level) {
+            wrapped = (w->cur_ms >> hwheel_shift(level)) & (k_hwheel_ln_size - 1);
+            hwheel_cascade(w, level, wrapped);
+        }
+        dlist_splice(&w->expired, &w->l0[idx]);
+        w->l0_used[idx / 64] &= ~((uint64_t)1 << (idx % 64));
+        w->cur_ms++;
+    }
+}
+
+WheelTimer *hwheel_pop(HTimerWheel *w) {
+    WheelTimer *t = hwheel_peek(w);
+    if (t) {
+        hwheel_del(w, t);
+    }
+    return t;
+}
+
+WheelTimer *hwheel_peek(HTimerWheel *w) {
+    if (dlist_empty(&w->expired)) {
+        return NULL;
+    }
+    return container_of(w->expired.next, WheelTimer, node);
+}
+
+// the first non-empty level 0 slot at or after `ms`, before `end`
+static uint64_t hwheel_next_l0(HTimerWheel *w, uint64_t ms, uint64_t end) {
+    while (ms < end) {
+        uint64_t idx = ms & (k_hwheel_l0_size - 1);
+        uint64_t next = bitmap_next(w->l0_used, k_hwheel_l0_size, idx);
+        if (next == k_hwheel_l0_size) {
+            ms += k_hwheel_l0_size - idx;   // wrap around
+            continue;
+        }
+        ms += next - idx;
+        if (ms >= end) {
+            break;
+        }
+        if (!dlist_empty(&w->l0[next])) {
+            return ms;
+        }
+        w->l0_used[next / 64] &= ~((uint64_t)1 << (next % 64));
+    }
+    return (uint64_t)-1;
+}
+
+// the next tick that expires or cascades timers, or -1
+static uint64_t hwheel_next_tick(HTimerWheel *w) {
+    // level 0 is exact until the next cascading
+    uint64_t cur = w->cur_ms;
+    uint64_t boundary = (cur + k_hwheel_l0_size - 1) & ~(k_hwheel_l0_size - 1);
+    uint64_t next = hwheel_next_l0(w, cur, boundary);
+    if (next != (uint64_t)-1) {
+        return next;
+    }
+    // otherwise the earliest of: level 0 after the boundary,
+    // and the next non-empty slot of each level, which is when it cascades.
+    next = hwheel_next_l0(w, boundary, cur + k_hwheel_l0_size);
+    for (uint32_t level = 0; level < k_hwheel_levels; ++level) {
+        uint32_t shift = hwheel_shift(level);
+        uint64_t group = cur >> shift;
+        // the slot of the current group was cascaded unless `cur` is aligned
+        uint64_t k = ((group << shift) == cur) ? 0 : 1;
+        for (; k <= k_hwheel_ln_size; ++k) {
+            uint64_t at = (group + k) << shift;
+            if (at >= next) {
+                break;
+            }
+            uint64_t idx = (group + k) & (k_hwheel_ln_size - 1);
+            if (!(w->ln_used[level] & ((uint64_t)1 << idx))) {
+                continue;
+            }
+            if (!dlist_empty(&w->ln[level][idx])) {
+                next = at;
+                break;
+            }
+            w->ln_used[level] &= ~((uint64_t)1 << idx);
+        }
+    }
+    return next;
+}
+
+uint64_t hwheel_next_ms(HTimerWheel *w) {
+    if (w->size == 0) {
+        return (uint64_t)-1;
+    }
+    if (!dlist_empty(&w->expired)) {
+        return 0;
+    }
+    return hwheel_next_tick(w);
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "list.h"
+
+
+// A timer in a `TimerWheel`, embedded in the owner like `DList`.
+// `node` is self-linked when the timer isn't in a wheel.
+struct WheelTimer {
+    DList node;
+    uint64_t expire_ms = 0;
+};
+
+// A hashed timing wheel with a coarse resolution: a timer is put in the slot
+// of its expiration tick, so adding and removing are O(1), and expiration
+// may be late by up to 1 tick. Timers further than 1 rotation stay in their
+// slot until their round comes.
+struct TimerWheel {
+    std::vector<DList> slots;   // the list heads; must not move
+    uint64_t tick_ms = 0;
+    uint64_t cur_tick = 0;      // the last processed tick
+    size_t size = 0;            // the number of timers
+};
+
+// `nslots` must be a power of 2
+void wheel_init(TimerWheel *w, size_t nslots, uint64_t tick_ms, uint64_t now_ms);
+void wheel_timer_init(WheelTimer *t);
+// add a timer with `t->expire_ms` set
+void wheel_add(TimerWheel *w, WheelTimer *t);
+// no-op if the timer isn't in the wheel
+void wheel_del(TimerWheel *w, WheelTimer *t);
+// move the expired timers to the `expired` list
+void wheel_advance(TimerWheel *w, uint64_t now_ms, DList *expired);
+// the start of the next tick with timers, or -1 if empty
+uint64_t wheel_next_ms(TimerWheel *w);
+
+// A hierarchical timing wheel with 1ms resolution for many timers.
+// Level 0 has 1ms slots, and each level above has 64 slots that each span
+// a full rotation of the level below: 256ms, 16s, 17min and 18h slots.
+// A timer is cascaded to a lower level when the time reaches its slot,
+// so adding, removing and rescheduling are O(1) and expiration is exact.
+const uint32_t k_hwheel_l0_bits = 8;
+const uint32_t k_hwheel_ln_bits = 6;
+const uint32_t k_hwheel_levels = 4;     // above level 0
+
+struct HTimerWheel {
+    DList l0[1 << k_hwheel_l0_bits];
+    DList ln[k_hwheel_levels][1 << k_hwheel_ln_bits];
+    // the non-empty slots, may be stale after removals
+    uint64_t l0_used[(1 << k_hwheel_l0_bits) / 64];
+    uint64_t ln_used[k_hwheel_levels];
+    DList expired;          // fired but not yet popped
+    uint64_t cur_ms = 0;    // the next tick to process
+    size_t size = 0;        // the number of timers, including `expired`
+};
+
+// the wheel must not move after this
+void hwheel_init(HTimerWheel *w, uint64_t now_ms);
+// add a timer with `t->expire_ms` set; a timer in the past expires at once
+void hwheel_add(HTimerWheel *w, WheelTimer *t);
+// no-op if the timer isn't in the wheel
+void hwheel_del(HTimerWheel *w, WheelTimer *t);
+// fire the timers up to `now_ms`, see hwheel_pop()
+void hwheel_advance(HTimerWheel *w, uint64_t now_ms);
+// take an expired timer out of the wheel, or NULL
+WheelTimer *hwheel_pop(HTimerWheel *w);
+// the next timer hwheel_pop() returns, or NULL
+WheelTimer *hwheel_peek(HTimerWheel *w);
+// the next expiration or cascading, or -1 if empty; 0 if there are
+// expired timers to pop
+uint64_t hwheel_next_ms(HTimerWheel *w);
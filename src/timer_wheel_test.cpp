@@ -0,0 +1,222 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <set>
+#include <vector>
+#include "timer_wheel.cpp"
+
+
+struct Timer {
+    WheelTimer wt;
+    bool fired = false;
+    uint64_t due_ms = 0;    // added after its time, fires at the next tick
+};
+
+static size_t fire(TimerWheel &w, uint64_t now_ms) {
+    DList expired;
+    dlist_init(&expired);
+    wheel_advance(&w, now_ms, &expired);
+    size_t n = 0;
+    while (!dlist_empty(&expired)) {
+        Timer *t = container_of(expired.next, Timer, wt.node);
+        dlist_detach(&t->wt.node);
+        dlist_init(&t->wt.node);
+        assert(t->wt.expire_ms <= now_ms);  // never early
+        assert(!t->fired);
+        t->fired = true;
+        n++;
+    }
+    return n;
+}
+
+static void test_basic() {
+    TimerWheel w;
+    wheel_init(&w, 8, 10, 1000);
+    assert(wheel_next_ms(&w) == (uint64_t)-1);
+    Timer a, b;
+    wheel_timer_init(&a.wt);
+    wheel_timer_init(&b.wt);
+    a.wt.expire_ms = 1025;
+    b.wt.expire_ms = 1550;  // more than 1 rotation
+    wheel_add(&w, &a.wt);
+    wheel_add(&w, &b.wt);
+    assert(w.size == 2);
+    assert(wheel_next_ms(&w) == 1030);
+    assert(fire(w, 1029) == 0);
+    assert(fire(w, 1030) == 1 && a.fired);
+    assert(fire(w, 1549) == 0);
+    assert(fire(w, 1550) == 1 && b.fired);
+    assert(w.size == 0);
+
+    // removal, and a timer that is already due
+    a.fired = b.fired = false;
+    a.wt.expire_ms = 1600;
+    wheel_add(&w, &a.wt);
+    wheel_del(&w, &a.wt);
+    wheel_del(&w, &a.wt);
+    assert(w.size == 0);
+    b.wt.expire_ms = 0;
+    wheel_add(&w, &b.wt);
+    assert(wheel_next_ms(&w) == 1560);
+    assert(fire(w, 5000) == 1 && b.fired && !a.fired);
+}
+
+static void test_random() {
+    TimerWheel w;
+    uint64_t now = 12345;
+    wheel_init(&w, 16, 8, now);
+    std::vector<Timer> timers(500);
+    std::set<Timer *> active;
+    for (Timer &t : timers) {
+        wheel_timer_init(&t.wt);
+    }
+    for (size_t i = 0; i < 20000; ++i) {
+        Timer *t = &timers[rand() % timers.size()];
+        switch (rand() % 3) {
+        case 0:     // (re)schedule
+            wheel_del(&w, &t->wt);
+            t->wt.expire_ms = now + rand() % 400;
+            t->fired = false;
+            wheel_add(&w, &t->wt);
+            active.insert(t);
+            break;
+        case 1:
+            wheel_del(&w, &t->wt);
+            active.erase(t);
+            break;
+        case 2:     // advance the clock, sometimes by a lot
+            now += (rand() % 50 == 0) ? rand() % 1000 : rand() % 4;
+            fire(w, now);
+            for (auto it = active.begin(); it != active.end();) {
+                if ((*it)->fired) {
+                    it = active.erase(it);
+                } else {
+                    // at most 1 tick late
+                    assert((*it)->wt.expire_ms + w.tick_ms > now);
+                    ++it;
+                }
+            }
+            break;
+        }
+        assert(w.size == active.size());
+        uint64_t next = wheel_next_ms(&w);
+        for (Timer *a : active) {
+            assert(next <= a->wt.expire_ms + w.tick_ms);
+        }
+    }
+}
+
+static size_t hfire(HTimerWheel &w, uint64_t now_ms) {
+    hwheel_advance(&w, now_ms);
+    size_t n = 0;
+    while (WheelTimer *wt = hwheel_pop(&w)) {
+        Timer *t = container_of(wt, Timer, wt);
+        assert(t->wt.expire_ms <= now_ms);  // never early
+        assert(!t->fired);
+        t->fired = true;
+        n++;
+    }
+    return n;
+}
+
+static void test_hwheel_basic() {
+    HTimerWheel *w = new HTimerWheel();
+    hwheel_init(w, 1000);
+    assert(hwheel_next_ms(w) == (uint64_t)-1);
+    // 1 timer on each level, and 1 beyond the top level
+    const uint64_t delays[] = {
+        5, 300, 20 * 1000, 30 * 60 * 1000, 20 * 3600 * 1000,
+        (uint64_t)80 * 24 * 3600 * 1000,
+    };
+    std::vector<Timer> timers(6);
+    uint64_t now = 1000;
+    for (size_t i = 0; i < timers.size(); ++i) {
+        wheel_timer_init(&timers[i].wt);
+        timers[i].wt.expire_ms = now + delays[i];
+        hwheel_add(w, &timers[i].wt);
+    }
+    // follow the next_ms like the event loop, each fires on time
+    size_t fired = 0;
+    size_t wakeups = 0;
+    while (fired < timers.size()) {
+        uint64_t next = hwheel_next_ms(w);
+        assert(next != (uint64_t)-1 && next >= now);
+        now = next;
+        size_t n = hfire(*w, now);
+        if (n) {
+            assert(timers[fired].fired && timers[fired].wt.expire_ms == now);
+        }
+        fired += n;
+        wakeups++;
+    }
+    assert(w->size == 0);
+    assert(wakeups < 1000);
+    delete w;
+}
+
+static void test_hwheel_random() {
+    HTimerWheel *w = new HTimerWheel();
+    uint64_t now = 1234567;
+    hwheel_init(w, now);
+    std::vector<Timer> timers(1000);
+    std::set<Timer *> active;
+    for (Timer &t : timers) {
+        wheel_timer_init(&t.wt);
+    }
+    for (size_t i = 0; i < 100000; ++i) {
+        Timer *t = &timers[rand() % timers.size()];
+        switch (rand() % 4) {
+        case 0:     // (re)schedule, on any level
+        case 1: {
+            hwheel_del(w, &t->wt);
+            uint64_t range = (uint64_t)1 << (rand() % 36);
+            t->wt.expire_ms = now + (uint64_t)rand() * rand() % range;
+            if (rand() % 20 == 0) {
+                t->wt.expire_ms = now - rand() % 10;    // in the past
+            }
+            t->fired = false;
+            t->due_ms = std::max(t->wt.expire_ms, w->cur_ms);
+            hwheel_add(w, &t->wt);
+            active.insert(t);
+            break;
+        }
+        case 2:
+            hwheel_del(w, &t->wt);
+            active.erase(t);
+            break;
+        case 3: {   // advance the clock, or jump to the next timer
+            uint64_t next = hwheel_next_ms(w);
+            if (rand() % 2 && next != (uint64_t)-1) {
+                now = std::max(now, next);
+            } else {
+                now += (rand() % 100 == 0) ? (uint64_t)rand() * 1000 : rand() % 300;
+            }
+            hfire(*w, now);
+            for (auto it = active.begin(); it != active.end();) {
+                if ((*it)->fired) {
+                    it = active.erase(it);
+                } else {
+                    // exact
+                    assert((*it)->due_ms > now);
+                    ++it;
+                }
+            }
+            break;
+        }
+        }
+        assert(w->size == active.size());
+        uint64_t next = hwheel_next_ms(w);
+        for (Timer *a : active) {
+            assert(next <= std::max(a->wt.expire_ms, w->cur_ms));
+        }
+    }
+    delete w;
+}
+
+int main() {
+    test_basic();
+    test_random();
+    test_hwheel_basic();
+    test_hwheel_random();
+    return 0;
+}
@@ -0,0 +1,311 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+
+static int sys_setup(uint32_t entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, uint32_t to_submit, uint32_t min_complete,
+    uint32_t flags, void *arg, size_t argsz)
+{
+    return (int)syscall(
+        __NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_register(int fd, uint32_t op, void *arg, uint32_t nr) {
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, nr);
+}
+
+static uint32_t load_acquire(const uint32_t *p) {
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static void store_release(uint32_t *p, uint32_t v) {
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+static bool map_rings(Uring *r, struct io_uring_params *p) {
+    r->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(uint32_t);
+    r->cq_ring_size =
+        p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_size > r->sq_ring_size) {
+            r->sq_ring_size = r->cq_ring_size;
+        }
+        r->cq_ring_size = r->sq_ring_size;
+    }
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) {
+        r->sq_ring = NULL;
+        return false;
+    }
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+    } else {
+        r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) {
+            r->cq_ring = NULL;
+            return false;
+        }
+    }
+    r->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        return false;
+    }
+    r->sqes = (struct io_uring_sqe *)sqes;
+
+    char *sq = (char *)r->sq_ring;
+    r->sq_head = (uint32_t *)(sq + p->sq_off.head);
+    r->sq_tail = (uint32_t *)(sq + p->sq_off.tail);
+    r->sq_array = (uint32_t *)(sq + p->sq_off.array);
+    r->sq_mask = *(uint32_t *)(sq + p->sq_off.ring_mask);
+    r->sq_local_tail = *r->sq_tail;
+
+    char *cq = (char *)r->cq_ring;
+    r->cq_head = (uint32_t *)(cq + p->cq_off.head);
+    r->cq_tail = (uint32_t *)(cq + p->cq_off.tail);
+    r->cq_mask = *(uint32_t *)(cq + p->cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+    return true;
+}
+
+static bool setup_buf_ring(Uring *r, uint32_t nbufs, uint32_t buf_size) {
+    assert(nbufs > 0 && nbufs <= 32768 && ((nbufs - 1) & nbufs) == 0);
+    r->br_size = nbufs * sizeof(struct io_uring_buf);
+    void *ring = mmap(NULL, r->br_size, PROT_READ | PROT_WRITE,
+        MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ring == MAP_FAILED) {
+        return false;
+    }
+    r->br = (struct io_uring_buf_ring *)ring;
+
+    struct io_uring_buf_reg reg = {};
+    reg.ring_addr = (uint64_t)(uintptr_t)ring;
+    reg.ring_entries = nbufs;
+    reg.bgid = k_uring_bgid;
+    if (sys_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return false;   // kernel < 5.19
+    }
+
+    r->buf_size = buf_size;
+    r->bufs = (uint8_t *)malloc((size_t)nbufs * buf_size);
+    if (!r->bufs) {
+        return false;
+    }
+    r->br_mask = (uint16_t)(nbufs - 1);
+    r->br_tail = 0;
+    for (uint32_t i = 0; i < nbufs; ++i) {
+        uring_buf_recycle(r, (uint16_t)i);
+    }
+    return true;
+}
+
+// multishot recv is the newest feature we need (kernel 6.0),
+// the only reliable check is to try it on a socketpair.
+static bool probe_multishot(Uring *r) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        return false;
+    }
+    uring_prep_recv_multishot(uring_get_sqe(r), fds[0], 1);
+    bool ok = write(fds[1], "x", 1) == 1;
+    struct io_uring_cqe *cqe = NULL;
+    while (ok && !cqe) {
+        int rv = uring_submit_and_wait(r, 1000);
+        cqe = uring_peek_cqe(r);
+        ok = rv >= 0 || rv == -ETIME || rv == -EINTR;
+    }
+    ok = ok && cqe && cqe->res == 1 && (cqe->flags & IORING_CQE_F_MORE)
+        && (cqe->flags & IORING_CQE_F_BUFFER);
+    if (cqe) {
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            uring_buf_recycle(r, (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT));
+        }
+        uring_cqe_seen(r);
+    }
+    // the multishot recv is terminated by the EOF
+    close(fds[1]);
+    while (ok && (cqe = uring_peek_cqe(r)) == NULL) {
+        int rv = uring_submit_and_wait(r, 1000);
+        if (rv < 0 && rv != -EINTR) {
+            ok = false;
+        }
+    }
+    if (cqe) {
+        uring_cqe_seen(r);
+    }
+    close(fds[0]);
+    return ok;
+}
+
+bool uring_init(Uring *r, uint32_t entries, uint32_t nbufs, uint32_t buf_size) {
+    struct io_uring_params p = {};
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;     // room for multishot completions
+    r->fd = sys_setup(entries, &p);
+    if (r->fd < 0) {
+        r->fd = -1;
+        return false;
+    }
+    // timeouts are passed to io_uring_enter() (kernel 5.11)
+    uint32_t need = IORING_FEAT_EXT_ARG | IORING_FEAT_NODROP;
+    bool ok = (p.features & need) == need
+        && map_rings(r, &p)
+        && setup_buf_ring(r, nbufs, buf_size)
+        && probe_multishot(r);
+    if (!ok) {
+        uring_free(r);
+    }
+    return ok;
+}
+
+void uring_free(Uring *r) {
+    if (r->sqes) {
+        munmap(r->sqes, r->sqes_size);
+    }
+    if (r->cq_ring && r->cq_ring != r->sq_ring) {
+        munmap(r->cq_ring, r->cq_ring_size);
+    }
+    if (r->sq_ring) {
+        munmap(r->sq_ring, r->sq_ring_size);
+    }
+    if (r->br) {
+        munmap(r->br, r->br_size);
+    }
+    free(r->bufs);
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+    *r = Uring{};
+}
+
+struct io_uring_sqe *uring_get_sqe(Uring *r) {
+    uint32_t head = load_acquire(r->sq_head);
+    if (r->sq_local_tail - head > r->sq_mask) {
+        // the SQ is full, flush it without waiting
+        store_release(r->sq_tail, r->sq_local_tail);
+        int rv = sys_enter(r->fd, r->sq_local_tail - head, 0, 0, NULL, 0);
+        r->nenter++;
+        assert(rv >= 0);
+        (void)rv;
+    }
+    uint32_t idx = r->sq_local_tail & r->sq_mask;
+    r->sq_array[idx] = idx;
+    r->sq_local_tail++;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd, uint64_t ud) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = ud;
+}
+
+void uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd, uint64_t ud) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = k_uring_bgid;
+    sqe->user_data = ud;
+}
+
+void uring_prep_send(
+    struct io_uring_sqe *sqe, int fd, const void *buf, size_t len, uint64_t ud)
+{
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = ud;
+}
+
+// `msg` and its iovecs must be valid until the completion
+void uring_prep_sendmsg(
+    struct io_uring_sqe *sqe, int fd, const struct msghdr *msg, uint64_t ud)
+{
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = ud;
+}
+
+void uring_prep_cancel_fd(struct io_uring_sqe *sqe, int fd, uint64_t ud) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = ud;
+}
+
+void uring_prep_cancel(struct io_uring_sqe *sqe, uint64_t target, uint64_t ud) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = ud;
+}
+
+int uring_submit_and_wait(Uring *r, int timeout_ms) {
+    store_release(r->sq_tail, r->sq_local_tail);
+    uint32_t to_submit = r->sq_local_tail - load_acquire(r->sq_head);
+
+    struct __kernel_timespec ts = {};
+    struct io_uring_getevents_arg arg = {};
+    uint32_t flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+    uint32_t min_complete = uring_peek_cqe(r) ? 0 : 1;
+    int rv = sys_enter(r->fd, to_submit, min_complete, flags, &arg, sizeof(arg));
+    r->nenter++;
+    return rv < 0 ? -errno : rv;
+}
+
+struct io_uring_cqe *uring_peek_cqe(Uring *r) {
+    uint32_t head = *r->cq_head;
+    if (head == load_acquire(r->cq_tail)) {
+        return NULL;
+    }
+    return &r->cqes[head & r->cq_mask];
+}
+
+void uring_cqe_seen(Uring *r) {
+    store_release(r->cq_head, *r->cq_head + 1);
+}
+
+uint8_t *uring_buf(Uring *r, uint16_t bid) {
+    return r->bufs + (size_t)bid * r->buf_size;
+}
+
+void uring_buf_recycle(Uring *r, uint16_t bid) {
+    // note: not `r->br->bufs`, the kernel's flexible array macro
+    // shifts it by 8 bytes in C++ (an empty struct has a non-zero size).
+    struct io_uring_buf *buf = (struct io_uring_buf *)r->br;
+    buf += r->br_tail & r->br_mask;
+    buf->addr = (uint64_t)(uintptr_t)uring_buf(r, bid);
+    buf->len = r->buf_size;
+    buf->bid = bid;
+    r->br_tail++;
+    __atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+}
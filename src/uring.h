@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+
+// A minimal io_uring wrapper on top of the raw syscalls.
+// Received data goes into a ring of provided buffers owned by the kernel.
+struct Uring {
+    int fd = -1;
+    // submission queue
+    uint32_t *sq_head = NULL;
+    uint32_t *sq_tail = NULL;
+    uint32_t *sq_array = NULL;
+    uint32_t sq_mask = 0;
+    uint32_t sq_local_tail = 0;     // SQEs prepared but not yet published
+    struct io_uring_sqe *sqes = NULL;
+    // completion queue
+    uint32_t *cq_head = NULL;
+    uint32_t *cq_tail = NULL;
+    uint32_t cq_mask = 0;
+    struct io_uring_cqe *cqes = NULL;
+    // mmap regions
+    void *sq_ring = NULL;
+    size_t sq_ring_size = 0;
+    void *cq_ring = NULL;
+    size_t cq_ring_size = 0;
+    size_t sqes_size = 0;
+    // provided buffer ring for multishot recv
+    struct io_uring_buf_ring *br = NULL;
+    size_t br_size = 0;
+    uint16_t br_mask = 0;
+    uint16_t br_tail = 0;
+    uint8_t *bufs = NULL;
+    uint32_t buf_size = 0;
+    // stats
+    uint64_t nenter = 0;    // io_uring_enter() calls
+};
+
+const uint16_t k_uring_bgid = 0;    // the provided buffer group
+
+// Returns false if the kernel lacks io_uring, the buffer ring,
+// or multishot accept/recv, so the caller can fall back to epoll/poll.
+bool uring_init(Uring *r, uint32_t entries, uint32_t nbufs, uint32_t buf_size);
+void uring_free(Uring *r);
+
+// SQEs are submitted in batch by uring_submit_and_wait()
+struct io_uring_sqe *uring_get_sqe(Uring *r);
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd, uint64_t ud);
+void uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd, uint64_t ud);
+void uring_prep_send(
+    struct io_uring_sqe *sqe, int fd, const void *buf, size_t len, uint64_t ud);
+void uring_prep_sendmsg(
+    struct io_uring_sqe *sqe, int fd, const struct msghdr *msg, uint64_t ud);
+void uring_prep_cancel_fd(struct io_uring_sqe *sqe, int fd, uint64_t ud);
+// cancel the op submitted with `target` as user_data
+void uring_prep_cancel(struct io_uring_sqe *sqe, uint64_t target, uint64_t ud);
+
+// submit all pending SQEs and wait for at least 1 CQE or the timeout.
+// returns -errno on error; -ETIME is a timeout.
+int  uring_submit_and_wait(Uring *r, int timeout_ms);
+// returns NULL if the completion queue is empty
+struct io_uring_cqe *uring_peek_cqe(Uring *r);
+void uring_cqe_seen(Uring *r);
+
+// the provided buffer selected by a recv CQE
+uint8_t *uring_buf(Uring *r, uint16_t bid);
+// give the buffer back to the kernel
+void uring_buf_recycle(Uring *r, uint16_t bid);